@@ -0,0 +1,57 @@
+// In-process interface to the compiler. Building parser.cpp with
+// -DCOMPILER_LIBRARY leaves out the command-line driver, so the object can be
+// linked into another program that calls compile() directly.
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct CompileOptions
+{
+    bool dumpAst = false;      // fill CompileResult::ast
+    bool optimize = false;     // run constant propagation on the IR
+    bool execute = false;      // run the program on the bytecode VM
+    bool emitAssembly = false; // fill CompileResult::assembly
+    bool emitIrImage = false;  // fill CompileResult::irImage
+    uint32_t maxDepth = 0;     // deepest nesting the parser accepts; 0 for its default
+    unsigned lexThreads = 1;   // threads to lex a large source on
+    unsigned parseThreads = 1; // threads to parse and lower a long program's top-level statements on
+};
+
+struct Diagnostic
+{
+    uint32_t offset; // byte offset in the source
+    uint32_t line;   // 1-based, 0 if unknown
+    uint32_t column; // 1-based, 0 if unknown
+    std::string message;
+};
+
+struct CompileResult
+{
+    bool ok = false; // no diagnostics were reported
+    std::vector<Diagnostic> diagnostics;
+
+    // Listings; empty when compilation failed or they were not requested.
+    std::string symbols;  // symbol table, one identifier per line
+    std::string ast;      // S-expressions, one top-level statement per line
+    std::string ir;       // three-address code
+    std::string report;   // optimizer and register allocator summaries
+    std::string assembly; // x86-64 AT&T assembly for the program's main()
+    std::string irImage;  // the IR in the binary container format read by --dump-ir
+
+    // Filled in when CompileOptions::execute is set and compilation succeeded.
+    bool executed = false;
+    int64_t returnValue = 0;
+    uint64_t instructionsExecuted = 0;
+    double executeSeconds = 0;
+    std::string runtimeError;
+};
+
+// Compiles `source`, which only has to stay alive for the duration of the
+// call. Every call works on its own state, so any number may run at once.
+CompileResult compile(std::string_view source, const CompileOptions &options = CompileOptions());
+
+#endif
@@ -2,14 +2,50 @@
 #include <vector>
 #include <algorithm>
 #include <cctype>
+#include <cstring>
 #include <unordered_map>
 #include <map>
-#include <fstream>
 #include <stack>
+#include <stdexcept>
+#include <set>
+#include <queue>
+#include <string_view>
+#include <memory>
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <sstream>
+#include <cmath>
+#include <fstream>
+#include <list>
+#include <new>
+#include <random>
+#include <csignal>
+#include <cerrno>
+#include <ctime>
+#include <charconv>
+#include <malloc.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "compiler.h"
 
 using namespace std;
 
-enum TokenType
+enum TokenType : uint8_t
 {
     T_INT,
     T_CHAR,
@@ -64,911 +100,9834 @@ enum TokenType
     T_EOF,
 };
 
-struct Token
-{
-    TokenType type;
-    string value;
-    int line;
+// Enumerator names, indexed by TokenType, for the --stats report.
+const char *const TOKEN_TYPE_NAMES[] = {
+    "T_INT", "T_CHAR", "T_FLOAT", "T_DOUBLE", "T_BOOLEAN", "T_ID", "T_NUM", "T_IF", "T_AND", "T_OR",
+    "T_EQ", "T_NEQ", "T_GTE", "T_LTE", "T_TRUE", "T_FALSE", "T_ELSE", "T_RETURN", "T_ASSIGN",
+    "T_PLUS_ASSIGN", "T_MINUS_ASSIGN", "T_MUL_ASSIGN", "T_DIV_ASSIGN", "T_INCREMENT", "T_DECREMENT",
+    "T_PLUS", "T_MINUS", "T_MUL", "T_DIV", "T_MOD", "T_LPAREN", "T_RPAREN", "T_COMMA", "T_LBRACE",
+    "T_RBRACE", "T_SEMICOLON", "T_COLON", "T_QUESTION", "T_GT", "T_LT", "T_CHAR_LITERAL",
+    "T_FLOAT_LITERAL", "T_FOR", "T_WHILE", "T_SWITCH", "T_CASE", "T_BREAK", "T_CONTINUE", "T_DEFAULT",
+    "T_EOL", "T_EOF",
 };
 
-class SymbolTable
+static_assert(sizeof(TOKEN_TYPE_NAMES) / sizeof(TOKEN_TYPE_NAMES[0]) == T_EOF + 1, "TOKEN_TYPE_NAMES out of date");
+
+const char *tokenSpelling(TokenType type)
+{
+    switch (type)
+    {
+    case T_AND: return "&&";
+    case T_OR: return "||";
+    case T_EQ: return "==";
+    case T_NEQ: return "!=";
+    case T_GTE: return ">=";
+    case T_LTE: return "<=";
+    case T_ASSIGN: return "=";
+    case T_PLUS_ASSIGN: return "+=";
+    case T_MINUS_ASSIGN: return "-=";
+    case T_MUL_ASSIGN: return "*=";
+    case T_DIV_ASSIGN: return "/=";
+    case T_INCREMENT: return "++";
+    case T_DECREMENT: return "--";
+    case T_PLUS: return "+";
+    case T_MINUS: return "-";
+    case T_MUL: return "*";
+    case T_DIV: return "/";
+    case T_MOD: return "%";
+    case T_LPAREN: return "(";
+    case T_RPAREN: return ")";
+    case T_COMMA: return ",";
+    case T_LBRACE: return "{";
+    case T_RBRACE: return "}";
+    case T_SEMICOLON: return ";";
+    case T_COLON: return ":";
+    case T_QUESTION: return "?";
+    case T_GT: return ">";
+    case T_LT: return "<";
+    case T_EOL: return "\n";
+    default: return "";
+    }
+}
+
+// Stores each distinct string once and hands out dense 32-bit ids. Storage is
+// allocated in fixed blocks, so a view returned by get() stays valid for the
+// lifetime of the pool.
+class StringPool
 {
 private:
-    unordered_map<string, TokenType> table;
+    static const size_t BLOCK_SIZE = 64 * 1024;
 
-public:
-    void insert(const string &identifier, TokenType type)
+    vector<unique_ptr<char[]>> blocks;
+    char *cursor;
+    size_t remaining;
+    vector<string_view> strings;
+    vector<uint32_t> hashes;
+    vector<uint32_t> slots; // id + 1, 0 marks an empty slot
+
+    static uint32_t hash(string_view s)
     {
-        table[identifier] = type;
+        uint32_t h = 2166136261u;
+        for (char c : s)
+        {
+            h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return h;
     }
 
-    bool exists(const string &identifier)
+    const char *store(string_view s)
     {
-        return table.find(identifier) != table.end();
+        if (s.size() > BLOCK_SIZE / 4)
+        {
+            blocks.emplace_back(new char[s.size()]);
+            memcpy(blocks.back().get(), s.data(), s.size());
+            return blocks.back().get();
+        }
+        if (s.size() > remaining)
+        {
+            blocks.emplace_back(new char[BLOCK_SIZE]);
+            cursor = blocks.back().get();
+            remaining = BLOCK_SIZE;
+        }
+        char *out = cursor;
+        memcpy(out, s.data(), s.size());
+        cursor += s.size();
+        remaining -= s.size();
+        return out;
     }
 
-    TokenType getType(const string &identifier)
+    void grow()
     {
-        return table.at(identifier);
+        vector<uint32_t> bigger(slots.empty() ? 1024 : slots.size() * 2, 0);
+        size_t mask = bigger.size() - 1;
+        for (uint32_t id = 0; id < strings.size(); id++)
+        {
+            size_t i = hashes[id] & mask;
+            while (bigger[i] != 0)
+                i = (i + 1) & mask;
+            bigger[i] = id + 1;
+        }
+        slots.swap(bigger);
     }
 
-    void printTable()
+public:
+    StringPool() : cursor(nullptr), remaining(0) {}
+
+    StringPool(StringPool &&) = default;
+    StringPool &operator=(StringPool &&) = default;
+
+    uint32_t intern(string_view s)
     {
-        for (const auto &entry : table)
+        if ((strings.size() + 1) * 2 > slots.size())
+            grow();
+
+        uint32_t h = hash(s);
+        size_t mask = slots.size() - 1;
+        size_t i = h & mask;
+        while (slots[i] != 0)
         {
-            cout << "Identifier: " << entry.first << ", Type: " << entry.second << endl;
+            uint32_t id = slots[i] - 1;
+            if (hashes[id] == h && strings[id] == s)
+                return id;
+            i = (i + 1) & mask;
         }
+
+        uint32_t id = strings.size();
+        strings.push_back(string_view(store(s), s.size()));
+        hashes.push_back(h);
+        slots[i] = id + 1;
+        return id;
+    }
+
+    string_view get(uint32_t id) const
+    {
+        return strings[id];
+    }
+
+    // Forgets every string but keeps the first block and the slot array for reuse.
+    void clear()
+    {
+        if (blocks.size() > 1)
+            blocks.resize(1);
+        cursor = blocks.empty() ? nullptr : blocks[0].get();
+        remaining = blocks.empty() ? 0 : BLOCK_SIZE;
+        strings.clear();
+        hashes.clear();
+        fill(slots.begin(), slots.end(), 0);
+    }
+
+    size_t size() const
+    {
+        return strings.size();
     }
 };
-class Lexer
+
+// Leaves the elements a resize() adds uninitialized, for arrays that are
+// filled in right after they grow, possibly by several threads.
+template <class T>
+struct UninitializedAllocator : allocator<T>
 {
-private:
-    string src;
-    size_t pos;
-    int lineNumber;
-
-    unordered_map<string, TokenType> keywords = {
-        {"if", T_IF},
-        {"agar", T_IF},
-        {"else", T_ELSE},
-        {"return", T_RETURN},
-        {"int", T_INT},
-        {"char", T_CHAR},
-        {"float", T_FLOAT},
-        {"double", T_DOUBLE},
-        {"bool", T_BOOLEAN},
-        {"for", T_FOR},
-        {"while", T_WHILE},
-        {"true", T_TRUE},
-        {"false", T_FALSE},
-        {"switch", T_SWITCH},
-        {"case", T_CASE},
-        {"break", T_BREAK},
-        {"continue", T_CONTINUE},
-        {"default", T_DEFAULT},
+    template <class U>
+    struct rebind
+    {
+        using other = UninitializedAllocator<U>;
     };
 
-    unordered_map<char, TokenType> symbols = {
-        {'=', T_ASSIGN},
-        {'+', T_PLUS},
-        {'-', T_MINUS},
-        {'*', T_MUL},
-        {'/', T_DIV},
-        {'%', T_MOD},
-        {',', T_COMMA},
-        {'(', T_LPAREN},
-        {')', T_RPAREN},
-        {'{', T_LBRACE},
-        {'}', T_RBRACE},
-        {';', T_SEMICOLON},
-        {':', T_COLON},
-        {'?', T_QUESTION},
-        {'>', T_GT},
-        {'<', T_LT},
-        {'\n', T_EOL},
-    };
+    UninitializedAllocator() = default;
 
-    unordered_map<string, TokenType> multiCharSymbols = {
-        {"&&", T_AND},
-        {"||", T_OR},
-        {"==", T_EQ},
-        {"!=", T_NEQ},
-        {">=", T_GTE},
-        {"<=", T_LTE},
-        {"+=", T_PLUS_ASSIGN},
-        {"-=", T_MINUS_ASSIGN},
-        {"*=", T_MUL_ASSIGN},
-        {"/=", T_DIV_ASSIGN},
-        {"++", T_INCREMENT},
-        {"--", T_DECREMENT},
-    };
+    template <class U>
+    UninitializedAllocator(const UninitializedAllocator<U> &) {}
 
-public:
-    Lexer(const string &src)
+    template <class U>
+    void construct(U *p)
     {
-        this->src = src;
-        this->pos = 0;
-        this->lineNumber = 1;
+        ::new (static_cast<void *>(p)) U;
     }
 
-    string consumeCharLiteral()
+    template <class U, class... Args>
+    void construct(U *p, Args &&...args)
     {
-        size_t start = this->pos;
-        this->pos++;
+        ::new (static_cast<void *>(p)) U(forward<Args>(args)...);
+    }
+};
 
-        if (this->src[this->pos] == '\\')
-        {
-            this->pos += 2;
-        }
-        else
-        {
-            this->pos++;
-        }
+template <class T>
+using TokenArray = vector<T, UninitializedAllocator<T>>;
 
-        if (this->pos >= this->src.size() || this->src[this->pos] != '\'')
-        {
-            cerr << "Invalid character literal at line number " << lineNumber << endl;
-            exit(1);
-        }
-        this->pos++;
+// The token stream as parallel arrays: the parser's type checks walk a dense
+// byte array, and lexemes live once in the string pool.
+struct TokenBuffer
+{
+    static constexpr uint32_t NO_VALUE = UINT32_MAX;
 
-        return src.substr(start, this->pos - start);
-    }
+    TokenArray<TokenType> types;
+    TokenArray<uint32_t> offsets;
+    TokenArray<uint32_t> values; // StringPool id for identifiers, keywords and literals
+    StringPool strings;
 
-    string consumeNumber()
+    size_t size() const
     {
-        size_t start = this->pos;
-        bool hasDecimalPoint = false;
+        return types.size();
+    }
 
-        while (this->pos < this->src.size() && (isdigit(this->src[this->pos]) || this->src[this->pos] == '.'))
-        {
-            if (this->src[this->pos] == '.')
-            {
-                if (hasDecimalPoint)
-                    break;
-                hasDecimalPoint = true;
-            }
-            pos++;
-        }
+    void push(TokenType type, size_t offset, uint32_t value)
+    {
+        types.push_back(type);
+        offsets.push_back(static_cast<uint32_t>(offset));
+        values.push_back(value);
+    }
 
-        return src.substr(start, pos - start);
+    string_view text(size_t i) const
+    {
+        if (values[i] != NO_VALUE)
+            return strings.get(values[i]);
+        return tokenSpelling(types[i]);
     }
-    void consumeSingleLineComment()
+
+    // Drops the first `count` tokens. The survivors' lexemes are re-interned
+    // into a cleared pool, so a window that is repeatedly refilled and
+    // discarded does not accumulate strings.
+    void discard(size_t count)
     {
-        while (this->src[this->pos] != '\n')
+        size_t kept = size() - count;
+        vector<string> lexemes(kept);
+        for (size_t i = 0; i < kept; i++)
         {
-            this->pos++;
+            if (values[count + i] != NO_VALUE)
+                lexemes[i] = string(strings.get(values[count + i]));
+        }
+        strings.clear();
+        for (size_t i = 0; i < kept; i++)
+        {
+            types[i] = types[count + i];
+            offsets[i] = offsets[count + i];
+            values[i] = values[count + i] == NO_VALUE ? NO_VALUE : strings.intern(lexemes[i]);
         }
-        this->lineNumber++;
+        types.resize(kept);
+        offsets.resize(kept);
+        values.resize(kept);
     }
+};
 
-    void consumeMultiLineComment()
+// Owns the bytes of one input. Regular files are memory-mapped so the lexer
+// works directly on the page cache; pipes and stdin fall back to one bulk read.
+class SourceFile
+{
+private:
+    const char *data;
+    size_t length;
+    bool mapped;
+    string buffer;
+
+    bool readAll(int fd)
     {
-        while (this->pos + 1 < this->src.size())
+        size_t capacity = 1 << 16;
+        size_t used = 0;
+        buffer.resize(capacity);
+        while (true)
         {
-
-            if (this->src[this->pos] == '*' && this->src[this->pos + 1] == '/')
-            {
-                this->pos = this->pos + 2;
-                return;
-            }
-
-            else
+            if (used == capacity)
             {
-                this->pos++;
+                capacity *= 2;
+                buffer.resize(capacity);
             }
+            ssize_t n = read(fd, &buffer[used], capacity - used);
+            if (n < 0)
+                return false;
+            if (n == 0)
+                break;
+            used += n;
         }
+        buffer.resize(used);
+        data = buffer.data();
+        length = used;
+        return true;
     }
 
-    string consumeWord()
+public:
+    SourceFile() : data(nullptr), length(0), mapped(false) {}
+
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    ~SourceFile()
     {
-        size_t start = this->pos;
-        while (this->pos < this->src.size() && isalnum(this->src[this->pos]))
-            pos++;
-        return src.substr(start, pos - start);
+        if (mapped)
+        {
+            munmap(const_cast<char *>(data), length);
+        }
     }
 
-    vector<Token> tokenize(SymbolTable &symbolTable)
+    // "-" reads from stdin.
+    bool open(const string &filename)
     {
-        vector<Token> tokens;
-        while (pos < src.size())
+        if (filename == "-")
         {
-            char c = src[pos];
-            if (c == '\n')
-            {
-                lineNumber++;
-            }
-            if (isspace(c))
-            {
-                pos++;
-                continue;
-            }
-            if (src[pos - 1] != '"' && c == '/' && src[pos + 1] == '/')
-            {
-                pos = pos + 2;
-                consumeSingleLineComment();
-                continue;
-            }
-            if (src[pos - 1] != '"' && c == '/' && src[pos + 1] == '*')
-            {
-                pos = pos + 2;
-                consumeMultiLineComment();
-                continue;
-            }
-            if (isdigit(c) || (c == '.' && pos + 1 < src.size() && isdigit(src[pos + 1])))
-            {
-                tokens.push_back({T_NUM, consumeNumber(), lineNumber});
-                continue;
-            }
-
-            if (isalpha(c))
-            {
-                string word = consumeWord();
-                if (keywords.find(word) != keywords.end())
-                {
-                    tokens.push_back({keywords[word], word, lineNumber});
-                }
-                else
-                {
-                    tokens.push_back({T_ID, word, lineNumber});
+            return readAll(STDIN_FILENO);
+        }
 
-                    symbolTable.insert(word, T_ID);
-                }
-                continue;
-            }
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
 
-            if (c == '\'')
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            if (st.st_size == 0)
             {
-                tokens.push_back({T_CHAR_LITERAL, consumeCharLiteral(), lineNumber});
-                continue;
+                close(fd);
+                return true;
             }
-
-            string potentialMultiChar = src.substr(pos, 2);
-            if (multiCharSymbols.find(potentialMultiChar) != multiCharSymbols.end())
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
             {
-                tokens.push_back({multiCharSymbols[potentialMultiChar], potentialMultiChar, lineNumber});
-                pos += 2;
-                continue;
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char *>(p);
+                length = st.st_size;
+                mapped = true;
+                close(fd);
+                return true;
             }
+        }
 
-            if (symbols.find(c) != symbols.end())
-            {
-                tokens.push_back({symbols[c], string(1, c), lineNumber});
-                pos++;
-                continue;
-            }
+        bool ok = readAll(fd);
+        close(fd);
+        return ok;
+    }
 
-            cout << "Unexpected character at line number " << lineNumber << ": " << c << endl;
-            pos++;
-        }
-        tokens.push_back({T_EOF, "", lineNumber});
+    string_view view() const
+    {
+        return string_view(data, length);
+    }
 
-        return tokens;
+    bool isMapped() const
+    {
+        return mapped;
+    }
+
+    // Returns the mapped pages before `offset` to the kernel. Used by the
+    // streaming pipeline so resident memory tracks the unconsumed input only.
+    void release(size_t offset)
+    {
+        if (!mapped)
+            return;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t end = offset / page * page;
+        if (end > 0)
+            madvise(const_cast<char *>(data), end, MADV_DONTNEED);
     }
 };
 
-class Parser
+// Reads a pipe, stdin or another byte source a chunk at a time for the
+// streaming lexer. Only the unconsumed tail of the input is buffered.
+class ChunkReader
 {
 private:
-    vector<Token> tokens;
-    size_t pos;
-    int lineNumber;
-    SymbolTable symbolTable;
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    function<size_t(char *, size_t)> source; // fills up to `size` bytes; 0 at the end
+    size_t chunkSize;
+    string buffer;
+    size_t newlineEnd; // one past the last '\n' in buffer, or 0
+    bool eof;
 
 public:
-    Parser(const vector<Token> &tokens)
+    ChunkReader(int fd) : ChunkReader([fd](char *out, size_t size)
+                                      {
+                                          ssize_t n = read(fd, out, size);
+                                          return n > 0 ? static_cast<size_t>(n) : 0; },
+                                      CHUNK_SIZE)
     {
-        this->tokens = tokens;
-        this->pos = 0;
-        this->lineNumber = 1;
     }
 
-    void parseProgram()
+    // Reads from `source` instead of a file, `chunkSize` bytes at a time.
+    ChunkReader(function<size_t(char *, size_t)> source, size_t chunkSize)
+        : source(move(source)), chunkSize(chunkSize), newlineEnd(0), eof(false)
     {
-        while (tokens[pos].type != T_EOF)
-        {
-            parseStatement();
-        }
-        cout << "Parsing completed successfully" << endl;
-        symbolTable.printTable();
     }
 
-    void parseIfStatement()
+    bool atEnd() const
     {
-        expect(T_IF);
-        expect(T_LPAREN);
-        parseExpression();
-        expect(T_RPAREN);
+        return eof;
+    }
 
-        if (tokens[pos].type == T_LBRACE)
-        {
-            parseBlock();
-        }
-        else
-        {
-            parseStatement();
-        }
+    size_t lastNewline() const
+    {
+        return newlineEnd;
+    }
 
-        while (tokens[pos].type == T_ELSE)
+    // Discards the first `consumed` bytes and reads until the buffer holds a
+    // newline past the retained tail, or input is exhausted.
+    string_view refill(size_t consumed)
+    {
+        buffer.erase(0, consumed);
+        size_t scanFrom = buffer.size();
+        while (true)
         {
-            pos++;
-            if (tokens[pos].type == T_IF)
+            size_t used = buffer.size();
+            buffer.resize(used + chunkSize);
+            size_t n = source(&buffer[used], chunkSize);
+            buffer.resize(used + n);
+            if (n == 0)
             {
-                pos++;
-                expect(T_LPAREN);
-                parseExpression();
-                expect(T_RPAREN);
-
-                if (tokens[pos].type == T_LBRACE)
-                {
-                    parseBlock();
-                }
-                else
-                {
-                    parseStatement();
-                }
+                eof = true;
+                break;
             }
-            else
+            if (memchr(buffer.data() + scanFrom, '\n', buffer.size() - scanFrom) != nullptr)
+                break;
+            scanFrom = buffer.size();
+        }
+
+        newlineEnd = 0;
+        for (size_t i = buffer.size(); i > 0; i--)
+        {
+            if (buffer[i - 1] == '\n')
             {
-                if (tokens[pos].type == T_LBRACE)
-                {
-                    parseBlock();
-                }
-                else
-                {
-                    parseStatement();
-                }
+                newlineEnd = i;
                 break;
             }
         }
+        return buffer;
     }
+};
+
+// Declarations keyed by interned identifier id, with block scopes. Ids are
+// dense, so the innermost declaration of each name is found by indexing
+// rather than hashing. Declarations are kept on a stack, each linked to the
+// one it shadows; leaving a scope pops what it declared and relinks those
+// names to the declarations they hid, so entering and leaving a scope are
+// constant time apart from one step per declaration, already paid for when
+// it was made.
+class SymbolTable
+{
+private:
+    static constexpr uint32_t NO_ENTRY = UINT32_MAX;
 
-    void parseReturnStatement()
+    struct Entry
     {
-        expect(T_RETURN);
-        parseExpression();
-        expect(T_SEMICOLON);
+        uint32_t name;
+        uint32_t shadowed; // entry this one hides, NO_ENTRY if none
+        TokenType type;
+    };
+
+    vector<uint32_t> innermost; // by name id
+    vector<Entry> entries;      // declarations in open scopes, innermost last
+    vector<uint32_t> scopes;    // entries.size() when each open block was entered
+    vector<pair<uint32_t, TokenType>> listed; // every declared name, first declaration first
+    vector<uint32_t> listing;   // by name id: index in `listed`, NO_ENTRY if never declared
+    size_t declarations = 0;
+    size_t deepest = 0;
+
+    uint32_t find(uint32_t name) const
+    {
+        return name < innermost.size() ? innermost[name] : NO_ENTRY;
     }
 
-    void parseStatement()
+public:
+    void enterScope()
     {
-        if (tokens[pos].type == T_INT || tokens[pos].type == T_CHAR ||
-            tokens[pos].type == T_FLOAT || tokens[pos].type == T_DOUBLE || tokens[pos].type == T_BOOLEAN)
-        {
-            parseDeclarationAndAssignment();
-        }
-        else if (tokens[pos].type == T_ID)
-        {
-            parseAssignment();
-            expect(T_SEMICOLON);
-        }
-        else if (tokens[pos].type == T_IF)
-        {
-            parseIfStatement();
-        }
-        else if (tokens[pos].type == T_FOR)
-        {
-            parseForLoop();
-        }
-        else if (tokens[pos].type == T_WHILE)
-        {
-            parseWhileLoop();
-        }
-        else if (tokens[pos].type == T_RETURN)
-        {
-            parseReturnStatement();
-        }
-        else if (tokens[pos].type == T_BREAK)
+        scopes.push_back(static_cast<uint32_t>(entries.size()));
+        deepest = max(deepest, scopes.size());
+    }
+
+    void leaveScope()
+    {
+        while (entries.size() > scopes.back())
         {
-            parseBreakStatement();
+            innermost[entries.back().name] = entries.back().shadowed;
+            entries.pop_back();
         }
-        else if (tokens[pos].type == T_CONTINUE)
+        scopes.pop_back();
+    }
+
+    // Declares `name` in the innermost scope. Returns false, leaving the
+    // table unchanged, if that scope already declares it.
+    bool declare(uint32_t name, TokenType type)
+    {
+        if (name >= innermost.size())
         {
-            parseContinueStatement();
+            innermost.resize(name + 1, NO_ENTRY);
+            listing.resize(name + 1, NO_ENTRY);
         }
-        else if (tokens[pos].type == T_LBRACE)
+        uint32_t current = innermost[name];
+        if (current != NO_ENTRY && current >= (scopes.empty() ? 0 : scopes.back()))
+            return false;
+        innermost[name] = static_cast<uint32_t>(entries.size());
+        entries.push_back({name, current, type});
+        declarations++;
+        if (listing[name] == NO_ENTRY)
         {
-            parseBlock();
+            listing[name] = static_cast<uint32_t>(listed.size());
+            listed.push_back({name, type});
         }
         else
         {
-            cerr << "Unexpected token at line " << lineNumber << ": " << tokens[pos].value << endl;
-            exit(1);
+            listed[listing[name]].second = type;
         }
+        return true;
     }
 
-    void parseDeclarationAndAssignment()
+    bool exists(uint32_t name) const
     {
-        TokenType varType = expectType();
-        do
-        {
-            expect(T_ID);
-            string identifier = tokens[pos - 1].value;
+        return find(name) != NO_ENTRY;
+    }
 
-            if (symbolTable.exists(identifier))
-            {
-                cerr << "Error: Identifier " << identifier << " already declared at line " << lineNumber << endl;
-                exit(1);
-            }
-            symbolTable.insert(identifier, varType);
+    // Type of the innermost visible declaration; T_ID if there is none.
+    TokenType getType(uint32_t name) const
+    {
+        uint32_t entry = find(name);
+        return entry != NO_ENTRY ? entries[entry].type : T_ID;
+    }
 
-            if (tokens[pos].type == T_ASSIGN)
-            {
-                pos++;
-                parseExpression();
-            }
+    // Distinct names ever declared.
+    size_t size() const
+    {
+        return listed.size();
+    }
 
-            if (tokens[pos].type == T_COMMA)
-            {
-                pos++;
-            }
-            else
-            {
-                expect(T_SEMICOLON);
-            }
-        } while (tokens[pos].type == T_COMMA);
+    size_t declarationCount() const
+    {
+        return declarations;
     }
 
-    void parseForLoop()
+    size_t slotCount() const
     {
-        expect(T_FOR);
-        expect(T_LPAREN);
+        return innermost.size();
+    }
+
+    size_t deepestScope() const
+    {
+        return deepest;
+    }
 
-        if (tokens[pos].type != T_SEMICOLON)
+    // Every name declared in any scope, in order of first declaration, with
+    // the type it was last declared with.
+    void printTable(ostream &out, const StringPool &names) const
+    {
+        for (const auto &entry : listed)
         {
-            parseAssignment();
+            out << "Identifier: " << names.get(entry.first) << ", Type: " << static_cast<int>(entry.second) << endl;
         }
+    }
+};
 
-        expect(T_SEMICOLON);
+enum CharClass : uint8_t
+{
+    CC_SPACE = 1,
+    CC_ALPHA = 2,
+    CC_DIGIT = 4,
+};
 
-        if (tokens[pos].type != T_SEMICOLON)
-        {
-            parseExpression();
-        }
+// Byte classes for the C locale, built at compile time so the lexer never
+// calls the locale-dependent <cctype> predicates.
+constexpr array<uint8_t, 256> makeCharClassTable()
+{
+    array<uint8_t, 256> table{};
+    for (int c = 0; c < 256; c++)
+    {
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r')
+            table[c] |= CC_SPACE;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+            table[c] |= CC_ALPHA;
+        if (c >= '0' && c <= '9')
+            table[c] |= CC_DIGIT;
+    }
+    return table;
+}
 
-        expect(T_SEMICOLON);
+constexpr array<uint8_t, 256> CHAR_CLASS = makeCharClassTable();
 
-        if (tokens[pos].type != T_RPAREN)
-        {
-            while (tokens[pos].type != T_RPAREN)
-            {
-                parseAssignment();
-                if (tokens[pos].type == T_COMMA)
-                {
-                    pos++;
-                }
-            }
-        }
+inline bool isSpaceChar(char c) { return CHAR_CLASS[static_cast<unsigned char>(c)] & CC_SPACE; }
+inline bool isAlphaChar(char c) { return CHAR_CLASS[static_cast<unsigned char>(c)] & CC_ALPHA; }
+inline bool isDigitChar(char c) { return CHAR_CLASS[static_cast<unsigned char>(c)] & CC_DIGIT; }
+inline bool isAlnumChar(char c) { return CHAR_CLASS[static_cast<unsigned char>(c)] & (CC_ALPHA | CC_DIGIT); }
+
+struct Keyword
+{
+    string_view text;
+    TokenType type;
+};
+
+constexpr Keyword KEYWORDS[] = {
+    {"if", T_IF},
+    {"agar", T_IF},
+    {"else", T_ELSE},
+    {"return", T_RETURN},
+    {"int", T_INT},
+    {"char", T_CHAR},
+    {"float", T_FLOAT},
+    {"double", T_DOUBLE},
+    {"bool", T_BOOLEAN},
+    {"for", T_FOR},
+    {"while", T_WHILE},
+    {"true", T_TRUE},
+    {"false", T_FALSE},
+    {"switch", T_SWITCH},
+    {"case", T_CASE},
+    {"break", T_BREAK},
+    {"continue", T_CONTINUE},
+    {"default", T_DEFAULT},
+};
+
+constexpr size_t KEYWORD_COUNT = sizeof(KEYWORDS) / sizeof(KEYWORDS[0]);
+constexpr size_t KEYWORD_SLOTS = 32;
+
+// Perfect hash over the keyword set: first byte, last byte and length select a
+// unique slot, so a lookup is one hash and at most one comparison.
+constexpr size_t keywordHash(string_view word)
+{
+    return (static_cast<unsigned char>(word[0]) * 24u +
+            static_cast<unsigned char>(word[word.size() - 1]) * 3u + word.size()) &
+           (KEYWORD_SLOTS - 1);
+}
+
+constexpr array<int8_t, KEYWORD_SLOTS> makeKeywordTable()
+{
+    array<int8_t, KEYWORD_SLOTS> table{};
+    for (size_t i = 0; i < KEYWORD_SLOTS; i++)
+        table[i] = -1;
+    for (size_t i = 0; i < KEYWORD_COUNT; i++)
+        table[keywordHash(KEYWORDS[i].text)] = static_cast<int8_t>(i);
+    return table;
+}
+
+constexpr array<int8_t, KEYWORD_SLOTS> KEYWORD_TABLE = makeKeywordTable();
+
+constexpr bool keywordTableIsPerfect()
+{
+    for (size_t i = 0; i < KEYWORD_COUNT; i++)
+    {
+        if (KEYWORD_TABLE[keywordHash(KEYWORDS[i].text)] != static_cast<int8_t>(i))
+            return false;
+    }
+    return true;
+}
+
+static_assert(keywordTableIsPerfect(), "keyword hash has a collision; adjust keywordHash");
+
+// Returns the keyword's token type, or T_ID for an ordinary identifier.
+inline TokenType lookupKeyword(string_view word)
+{
+    int8_t index = KEYWORD_TABLE[keywordHash(word)];
+    if (index >= 0 && KEYWORDS[index].text == word)
+        return KEYWORDS[index].type;
+    return T_ID;
+}
+
+// Run-finding kernels used by the lexer's hot loops. Each returns a pointer to
+// the first byte that ends the run (or `end`). The newline kernels serve the
+// line index, which is only built when a location is needed.
+struct ScanKernels
+{
+    const char *name;
+    const char *(*skipSpace)(const char *p, const char *end);
+    const char *(*findNewline)(const char *p, const char *end);
+    const char *(*findCommentEnd)(const char *p, const char *end);
+    const char *(*skipAlnum)(const char *p, const char *end);
+    const char *(*skipDigits)(const char *p, const char *end);
+    size_t (*countNewlines)(const char *p, const char *end);
+    // Appends base + i + 1 for each '\n' at p[i]: the starts of the lines after them.
+    void (*lineStarts)(const char *p, const char *end, size_t base, vector<uint32_t> &starts);
+};
+
+const char *skipSpaceScalar(const char *p, const char *end)
+{
+    while (p < end && isSpaceChar(*p))
+        p++;
+    return p;
+}
+
+const char *findNewlineScalar(const char *p, const char *end)
+{
+    while (p < end && *p != '\n')
+        p++;
+    return p;
+}
+
+// Returns the position of the '*' that starts the closing "*/".
+const char *findCommentEndScalar(const char *p, const char *end)
+{
+    while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+        p++;
+    return p + 1 < end ? p : end;
+}
+
+const char *skipAlnumScalar(const char *p, const char *end)
+{
+    while (p < end && isAlnumChar(*p))
+        p++;
+    return p;
+}
+
+const char *skipDigitsScalar(const char *p, const char *end)
+{
+    while (p < end && isDigitChar(*p))
+        p++;
+    return p;
+}
+
+size_t countNewlinesScalar(const char *p, const char *end)
+{
+    size_t newlines = 0;
+    for (; p < end; p++)
+        newlines += *p == '\n';
+    return newlines;
+}
+
+void lineStartsScalar(const char *p, const char *end, size_t base, vector<uint32_t> &starts)
+{
+    for (const char *q = p; q < end; q++)
+    {
+        if (*q == '\n')
+            starts.push_back(static_cast<uint32_t>(base + (q - p) + 1));
+    }
+}
+
+const ScanKernels SCALAR_KERNELS = {
+    "scalar",
+    skipSpaceScalar,
+    findNewlineScalar,
+    findCommentEndScalar,
+    skipAlnumScalar,
+    skipDigitsScalar,
+    countNewlinesScalar,
+    lineStartsScalar,
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+// Lanes where lo <= v <= hi, as an unsigned byte range test.
+inline __m128i inRange16(__m128i v, char lo, char hi)
+{
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(hi - lo)), t);
+}
+
+inline __m128i spaceMask16(__m128i v)
+{
+    return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), inRange16(v, '\t', '\r'));
+}
+
+inline __m128i alnumMask16(__m128i v)
+{
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    return _mm_or_si128(inRange16(lower, 'a', 'z'), inRange16(v, '0', '9'));
+}
+
+const char *skipSpaceSse2(const char *p, const char *end)
+{
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        uint32_t space = _mm_movemask_epi8(spaceMask16(v));
+        if (space != 0xFFFF)
+            return p + __builtin_ctz(~space);
+        p += 16;
+    }
+    return skipSpaceScalar(p, end);
+}
+
+const char *findNewlineSse2(const char *p, const char *end)
+{
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        uint32_t nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        if (nl != 0)
+            return p + __builtin_ctz(nl);
+        p += 16;
+    }
+    return findNewlineScalar(p, end);
+}
+
+const char *findCommentEndSse2(const char *p, const char *end)
+{
+    while (end - p >= 17)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+        uint32_t close = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('*')),
+                                                         _mm_cmpeq_epi8(next, _mm_set1_epi8('/'))));
+        if (close != 0)
+            return p + __builtin_ctz(close);
+        p += 16;
+    }
+    return findCommentEndScalar(p, end);
+}
+
+const char *skipAlnumSse2(const char *p, const char *end)
+{
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        uint32_t alnum = _mm_movemask_epi8(alnumMask16(v));
+        if (alnum != 0xFFFF)
+            return p + __builtin_ctz(~alnum);
+        p += 16;
+    }
+    return skipAlnumScalar(p, end);
+}
+
+const char *skipDigitsSse2(const char *p, const char *end)
+{
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        uint32_t digits = _mm_movemask_epi8(inRange16(v, '0', '9'));
+        if (digits != 0xFFFF)
+            return p + __builtin_ctz(~digits);
+        p += 16;
+    }
+    return skipDigitsScalar(p, end);
+}
+
+size_t countNewlinesSse2(const char *p, const char *end)
+{
+    size_t newlines = 0;
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        newlines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+        p += 16;
+    }
+    return newlines + countNewlinesScalar(p, end);
+}
+
+void lineStartsSse2(const char *p, const char *end, size_t base, vector<uint32_t> &starts)
+{
+    const char *begin = p;
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        uint32_t nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        for (; nl != 0; nl &= nl - 1)
+        {
+            starts.push_back(static_cast<uint32_t>(base + (p - begin) + __builtin_ctz(nl) + 1));
+        }
+        p += 16;
+    }
+    lineStartsScalar(p, end, base + (p - begin), starts);
+}
+
+const ScanKernels SSE2_KERNELS = {
+    "sse2",
+    skipSpaceSse2,
+    findNewlineSse2,
+    findCommentEndSse2,
+    skipAlnumSse2,
+    skipDigitsSse2,
+    countNewlinesSse2,
+    lineStartsSse2,
+};
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET inline __m256i inRange32(__m256i v, char lo, char hi)
+{
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(hi - lo)), t);
+}
+
+AVX2_TARGET const char *skipSpaceAvx2(const char *p, const char *end)
+{
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), inRange32(v, '\t', '\r'));
+        uint32_t mask = _mm256_movemask_epi8(space);
+        if (mask != 0xFFFFFFFFu)
+            return p + __builtin_ctz(~mask);
+        p += 32;
+    }
+    return skipSpaceSse2(p, end);
+}
+
+AVX2_TARGET const char *findNewlineAvx2(const char *p, const char *end)
+{
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        uint32_t nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        if (nl != 0)
+            return p + __builtin_ctz(nl);
+        p += 32;
+    }
+    return findNewlineSse2(p, end);
+}
+
+AVX2_TARGET const char *findCommentEndAvx2(const char *p, const char *end)
+{
+    while (end - p >= 33)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 1));
+        uint32_t close = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')),
+                                                               _mm256_cmpeq_epi8(next, _mm256_set1_epi8('/'))));
+        if (close != 0)
+            return p + __builtin_ctz(close);
+        p += 32;
+    }
+    return findCommentEndSse2(p, end);
+}
+
+AVX2_TARGET const char *skipAlnumAvx2(const char *p, const char *end)
+{
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i alnum = _mm256_or_si256(inRange32(lower, 'a', 'z'), inRange32(v, '0', '9'));
+        uint32_t mask = _mm256_movemask_epi8(alnum);
+        if (mask != 0xFFFFFFFFu)
+            return p + __builtin_ctz(~mask);
+        p += 32;
+    }
+    return skipAlnumSse2(p, end);
+}
+
+AVX2_TARGET const char *skipDigitsAvx2(const char *p, const char *end)
+{
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        uint32_t mask = _mm256_movemask_epi8(inRange32(v, '0', '9'));
+        if (mask != 0xFFFFFFFFu)
+            return p + __builtin_ctz(~mask);
+        p += 32;
+    }
+    return skipDigitsSse2(p, end);
+}
+
+AVX2_TARGET size_t countNewlinesAvx2(const char *p, const char *end)
+{
+    size_t newlines = 0;
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        newlines += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+        p += 32;
+    }
+    return newlines + countNewlinesSse2(p, end);
+}
+
+AVX2_TARGET void lineStartsAvx2(const char *p, const char *end, size_t base, vector<uint32_t> &starts)
+{
+    const char *begin = p;
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        uint32_t nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        for (; nl != 0; nl &= nl - 1)
+        {
+            starts.push_back(static_cast<uint32_t>(base + (p - begin) + __builtin_ctz(nl) + 1));
+        }
+        p += 32;
+    }
+    lineStartsSse2(p, end, base + (p - begin), starts);
+}
+
+const ScanKernels AVX2_KERNELS = {
+    "avx2",
+    skipSpaceAvx2,
+    findNewlineAvx2,
+    findCommentEndAvx2,
+    skipAlnumAvx2,
+    skipDigitsAvx2,
+    countNewlinesAvx2,
+    lineStartsAvx2,
+};
+
+#endif
+
+// Picks the widest kernel set the CPU supports. MYCOMPILER_SIMD=scalar|sse2|avx2
+// overrides the choice, e.g. to compare implementations.
+const ScanKernels &selectScanKernels()
+{
+    const char *forced = getenv("MYCOMPILER_SIMD");
+    string choice = forced ? forced : "";
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (choice == "scalar")
+        return SCALAR_KERNELS;
+    if (choice == "sse2" || !hasAvx2)
+        return SSE2_KERNELS;
+    return AVX2_KERNELS;
+#else
+    return SCALAR_KERNELS;
+#endif
+}
+
+const ScanKernels &scanKernels()
+{
+    static const ScanKernels &kernels = selectScanKernels();
+    return kernels;
+}
+
+// Maps byte offsets to lines and columns. Nothing is computed until the
+// first lookup, which finds every line start with one vector scan; lookups
+// are then binary searches. A streamed input is indexed a window at a time:
+// text that leaves the window is reduced to a newline count and the start of
+// the line it ended in.
+class LineIndex
+{
+private:
+    string_view text;       // the indexed text
+    size_t base;            // offset of text[0] in the input
+    uint32_t linesBefore;   // newlines before base
+    uint32_t firstLine;     // start of the line holding base
+    vector<uint32_t> starts; // start of the line after each newline in text
+    bool indexed;            // starts covers text
+
+public:
+    LineIndex(string_view text = string_view()) : text(text), base(0), linesBefore(0), firstLine(0), indexed(false) {}
+
+    // Streaming: forgets the first `count` bytes of the window. Must be
+    // called while those bytes are still readable.
+    void drop(size_t count)
+    {
+        size_t newlines = scanKernels().countNewlines(text.data(), text.data() + count);
+        if (newlines != 0)
+        {
+            linesBefore += newlines;
+            const char *last = static_cast<const char *>(memrchr(text.data(), '\n', count));
+            firstLine = static_cast<uint32_t>(base + (last - text.data()) + 1);
+        }
+        base += count;
+        text = text.substr(count);
+        indexed = false;
+    }
+
+    // Streaming: the window now holds `window`, starting where the old one
+    // continued.
+    void slide(string_view window)
+    {
+        text = window;
+        indexed = false;
+    }
+
+    // False if the offset is not in the indexed text.
+    bool locate(size_t offset, uint32_t &line, uint32_t &column)
+    {
+        if (text.empty() || offset < firstLine || offset > base + text.size())
+            return false;
+        if (!indexed)
+        {
+            starts.clear();
+            scanKernels().lineStarts(text.data(), text.data() + text.size(), base, starts);
+            indexed = true;
+        }
+        size_t index = upper_bound(starts.begin(), starts.end(), offset) - starts.begin();
+        line = static_cast<uint32_t>(linesBefore + index + 1);
+        column = static_cast<uint32_t>(offset - (index ? starts[index - 1] : firstLine) + 1);
+        return true;
+    }
+};
+
+// Collects the errors of one compilation. Errors are reported by byte
+// offset and located through a line index of the source, when there is one.
+class Diagnostics
+{
+private:
+    LineIndex lines;
+    vector<Diagnostic> entries;
+    ostream *echo;
+
+public:
+    // With `echo`, each error is also printed as soon as it is reported.
+    Diagnostics(string_view source = string_view(), ostream *echo = nullptr) : lines(source), echo(echo) {}
+
+    // The index a streaming lexer keeps in step with its window.
+    LineIndex &lineIndex()
+    {
+        return lines;
+    }
+
+    void error(size_t offset, const string &message)
+    {
+        Diagnostic diagnostic{static_cast<uint32_t>(offset), 0, 0, message};
+        lines.locate(offset, diagnostic.line, diagnostic.column);
+        entries.push_back(diagnostic);
+        if (echo)
+            print(*echo, diagnostic);
+    }
+
+    bool empty() const
+    {
+        return entries.empty();
+    }
+
+    const vector<Diagnostic> &all() const
+    {
+        return entries;
+    }
+
+    // Hands over the errors in source order.
+    vector<Diagnostic> take()
+    {
+        stable_sort(entries.begin(), entries.end(), [](const Diagnostic &x, const Diagnostic &y)
+                    { return x.offset < y.offset; });
+        return move(entries);
+    }
+
+    static void print(ostream &out, const Diagnostic &diagnostic)
+    {
+        if (diagnostic.column != 0)
+            out << "Error at line " << diagnostic.line << ", column " << diagnostic.column;
+        else if (diagnostic.line != 0)
+            out << "Error at line " << diagnostic.line;
+        else
+            out << "Error at offset " << diagnostic.offset;
+        out << ": " << diagnostic.message << endl;
+    }
+
+    // The compiler-style form, path:line:column: message, for listings that
+    // mix the diagnostics of many inputs.
+    static void print(ostream &out, const Diagnostic &diagnostic, const string &path)
+    {
+        out << path << ':';
+        if (diagnostic.line != 0)
+        {
+            out << diagnostic.line << ':';
+            if (diagnostic.column != 0)
+                out << diagnostic.column << ':';
+        }
+        else
+        {
+            out << " offset " << diagnostic.offset << ':';
+        }
+        out << ' ' << diagnostic.message << endl;
+    }
+};
+
+class Lexer
+{
+private:
+    string_view src;
+    size_t pos;
+    const ScanKernels &scan;
+    ChunkReader *reader;
+    size_t base; // absolute offset of src[0]; nonzero only when reading chunks
+    size_t end;  // no token starts at or after this position
+    Diagnostics &diagnostics;
+
+    // Drops consumed input (keeping one byte for the '"' lookbehind) and reads
+    // more from the chunk reader.
+    void refill()
+    {
+        size_t keep = pos > 0 ? pos - 1 : 0;
+        diagnostics.lineIndex().drop(keep);
+        src = reader->refill(keep);
+        diagnostics.lineIndex().slide(src);
+        base += keep;
+        pos -= keep;
+        end = src.size();
+    }
+
+    // Most runs are a few bytes long, where an indirect call into a vector
+    // kernel costs more than it saves; only runs that outlast a short inline
+    // scan are handed to the kernel.
+    static const char *skipShortRun(const char *p, const char *end, bool (*inRun)(char),
+                                    const char *(*kernel)(const char *, const char *))
+    {
+        const char *limit = end - p > 8 ? p + 8 : end;
+        while (p < limit && inRun(*p))
+            p++;
+        if (p == limit && p < end)
+            p = kernel(p, end);
+        return p;
+    }
+
+public:
+    // The lexer does not own its input; `src` must outlive every token it produces.
+    Lexer(string_view src, Diagnostics &diagnostics) : scan(scanKernels()), diagnostics(diagnostics)
+    {
+        this->src = src;
+        this->pos = 0;
+        this->reader = nullptr;
+        this->base = 0;
+        this->end = src.size();
+    }
+
+    // Streams input from `reader` instead of a complete buffer. The reader's
+    // first byte is at `offset` in the input.
+    Lexer(ChunkReader &reader, Diagnostics &diagnostics, size_t offset = 0) : Lexer(string_view(), diagnostics)
+    {
+        this->reader = &reader;
+        this->base = offset;
+    }
+
+    string_view consumeCharLiteral()
+    {
+        size_t start = this->pos;
+        this->pos++;
+
+        if (this->pos < this->src.size() && this->src[this->pos] == '\\')
+        {
+            this->pos += 2;
+        }
+        else
+        {
+            this->pos++;
+        }
+
+        if (this->pos >= this->src.size() || this->src[this->pos] != '\'')
+        {
+            // Reported, then lexed as a literal of whatever was consumed.
+            diagnostics.error(base + start, "Invalid character literal");
+            this->pos = min(this->pos, this->src.size());
+            return src.substr(start, this->pos - start);
+        }
+        this->pos++;
+
+        return src.substr(start, this->pos - start);
+    }
+
+    string_view consumeNumber()
+    {
+        size_t start = this->pos;
+        const char *end = src.data() + src.size();
+
+        const char *p = skipShortRun(src.data() + pos, end, isDigitChar, scan.skipDigits);
+        if (p < end && *p == '.')
+        {
+            p = skipShortRun(p + 1, end, isDigitChar, scan.skipDigits);
+        }
+        this->pos = p - src.data();
+
+        return src.substr(start, pos - start);
+    }
+
+    // Leaves pos on the terminating '\n'.
+    void consumeSingleLineComment()
+    {
+        this->pos = scan.findNewline(src.data() + pos, src.data() + src.size()) - src.data();
+    }
+
+    void consumeMultiLineComment()
+    {
+        while (true)
+        {
+            const char *end = src.data() + src.size();
+            const char *close = scan.findCommentEnd(src.data() + pos, end);
+            if (close != end)
+            {
+                this->pos = close - src.data() + 2;
+                return;
+            }
+            if (!reader || reader->atEnd())
+            {
+                this->pos = src.size();
+                return;
+            }
+            // A trailing '*' may be the first half of a "*/" split across chunks.
+            this->pos = src.back() == '*' ? src.size() - 1 : src.size();
+            refill();
+        }
+    }
+
+    string_view consumeWord()
+    {
+        size_t start = this->pos;
+        this->pos = skipShortRun(src.data() + pos + 1, src.data() + src.size(), isAlnumChar, scan.skipAlnum) - src.data();
+        return src.substr(start, pos - start);
+    }
+
+    // Matches the one- or two-character operator at pos. Returns its length,
+    // or 0 if the byte does not start an operator.
+    size_t matchOperator(TokenType &type) const
+    {
+        char next = pos + 1 < src.size() ? src[pos + 1] : '\0';
+        switch (src[pos])
+        {
+        case '&':
+            type = T_AND;
+            return next == '&' ? 2 : 0;
+        case '|':
+            type = T_OR;
+            return next == '|' ? 2 : 0;
+        case '!':
+            type = T_NEQ;
+            return next == '=' ? 2 : 0;
+        case '=':
+            type = next == '=' ? T_EQ : T_ASSIGN;
+            return next == '=' ? 2 : 1;
+        case '>':
+            type = next == '=' ? T_GTE : T_GT;
+            return next == '=' ? 2 : 1;
+        case '<':
+            type = next == '=' ? T_LTE : T_LT;
+            return next == '=' ? 2 : 1;
+        case '+':
+            type = next == '=' ? T_PLUS_ASSIGN : next == '+' ? T_INCREMENT : T_PLUS;
+            return type == T_PLUS ? 1 : 2;
+        case '-':
+            type = next == '=' ? T_MINUS_ASSIGN : next == '-' ? T_DECREMENT : T_MINUS;
+            return type == T_MINUS ? 1 : 2;
+        case '*':
+            type = next == '=' ? T_MUL_ASSIGN : T_MUL;
+            return next == '=' ? 2 : 1;
+        case '/':
+            type = next == '=' ? T_DIV_ASSIGN : T_DIV;
+            return next == '=' ? 2 : 1;
+        case '%': type = T_MOD; return 1;
+        case ',': type = T_COMMA; return 1;
+        case '(': type = T_LPAREN; return 1;
+        case ')': type = T_RPAREN; return 1;
+        case '{': type = T_LBRACE; return 1;
+        case '}': type = T_RBRACE; return 1;
+        case ';': type = T_SEMICOLON; return 1;
+        case ':': type = T_COLON; return 1;
+        case '?': type = T_QUESTION; return 1;
+        default: return 0;
+        }
+    }
+
+    // Lexes the next token into `tokens`. Returns false once T_EOF has been
+    // pushed; further calls push T_EOF again.
+    bool lexNext(TokenBuffer &tokens)
+    {
+        if (lexToken(tokens))
+            return true;
+        tokens.push(T_EOF, base + pos, TokenBuffer::NO_VALUE);
+        return false;
+    }
+
+    // Lexes the next token if one starts before the stop position; false
+    // when none is left.
+    bool lexToken(TokenBuffer &tokens)
+    {
+        while (true)
+        {
+            // A token never spans a line, so it is complete once a newline
+            // follows it in the buffer. Char literals need up to 4 bytes.
+            while (reader && !reader->atEnd() && pos + 4 > reader->lastNewline())
+                refill();
+            if (pos >= end)
+                return false;
+
+            char c = src[pos];
+            if (isSpaceChar(c))
+            {
+                if (pos + 1 < src.size() && !isSpaceChar(src[pos + 1]))
+                {
+                    pos++;
+                    continue;
+                }
+                pos = scan.skipSpace(src.data() + pos, src.data() + src.size()) - src.data();
+                continue;
+            }
+            bool afterQuote = pos > 0 && src[pos - 1] == '"';
+            char next = pos + 1 < src.size() ? src[pos + 1] : '\0';
+            if (!afterQuote && c == '/' && next == '/')
+            {
+                pos = pos + 2;
+                consumeSingleLineComment();
+                continue;
+            }
+            if (!afterQuote && c == '/' && next == '*')
+            {
+                pos = pos + 2;
+                consumeMultiLineComment();
+                continue;
+            }
+            size_t start = base + pos;
+            if (isDigitChar(c) || (c == '.' && isDigitChar(next)))
+            {
+                tokens.push(T_NUM, start, tokens.strings.intern(consumeNumber()));
+                return true;
+            }
+
+            if (isAlphaChar(c))
+            {
+                string_view word = consumeWord();
+                uint32_t value = tokens.strings.intern(word);
+                tokens.push(lookupKeyword(word), start, value);
+                return true;
+            }
+
+            if (c == '\'')
+            {
+                tokens.push(T_CHAR_LITERAL, start, tokens.strings.intern(consumeCharLiteral()));
+                return true;
+            }
+
+            TokenType op;
+            size_t length = matchOperator(op);
+            if (length != 0)
+            {
+                tokens.push(op, start, TokenBuffer::NO_VALUE);
+                pos += length;
+                return true;
+            }
+
+            diagnostics.error(start, string("Unexpected character '") + c + "'");
+            pos++;
+        }
+    }
+
+    TokenBuffer tokenize()
+    {
+        TokenBuffer tokens;
+        if (src.size() > UINT32_MAX)
+        {
+            diagnostics.error(0, "Input larger than 4 GiB is not supported");
+            tokens.push(T_EOF, 0, TokenBuffer::NO_VALUE);
+            return tokens;
+        }
+        tokens.types.reserve(src.size() / 4);
+        tokens.offsets.reserve(src.size() / 4);
+        tokens.values.reserve(src.size() / 4);
+
+        while (lexNext(tokens))
+        {
+        }
+
+        return tokens;
+    }
+
+    // Absolute input offset of the next unread byte.
+    size_t offset() const
+    {
+        return base + pos;
+    }
+
+    // Restarts lexing at `offset`, which must be the start of a token or of
+    // the input. A streaming lexer cannot seek back out of its window.
+    void seek(size_t offset)
+    {
+        this->pos = offset - base;
+    }
+
+    // Makes lexToken() stop before a token that would start at or after
+    // `offset`, for lexing one part of a complete buffer.
+    void stopAt(size_t offset)
+    {
+        this->end = offset;
+    }
+};
+
+enum NodeKind : uint8_t
+{
+    N_PROGRAM,     // a: first statement
+    N_BLOCK,       // a: first statement
+    N_DECLARATION, // op: declared type, a: first N_DECLARATOR
+    N_DECLARATOR,  // token: identifier, a: initializer
+    N_ASSIGNMENT,  // token: target, op: assignment/++/-- operator, a: value
+    N_IF,          // a: condition, b: then branch, c: else branch (may be another N_IF)
+    N_FOR,         // a: init, b: condition, c: N_FOR_STEP
+    N_FOR_STEP,    // a: first update assignment, b: body
+    N_WHILE,       // a: condition, b: body
+    N_RETURN,      // a: value
+    N_BREAK,
+    N_CONTINUE,
+    N_TERNARY,     // a: condition, b: then value, c: else value
+    N_BINARY,      // op: operator, a: left, b: right
+    N_UNARY,       // op: prefix operator, a: operand
+    N_POSTFIX,     // op: ++ or --, a: operand
+    N_IDENTIFIER,  // token: name
+    N_LITERAL,     // token: literal; op: T_NUM, T_CHAR_LITERAL, T_TRUE or T_FALSE
+};
+
+// One AST node in 24 bytes. Children are 32-bit arena indices and lists
+// (statements, declarators, for-updates) are chained through `next`.
+// Index 0 is never allocated and stands for "no node".
+struct AstNode
+{
+    NodeKind kind;
+    TokenType op;
+    uint16_t flags;
+    uint32_t token; // index of the node's token in the parser's TokenBuffer
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t next;
+};
+
+const uint32_t NO_NODE = 0;
+
+// Bump allocator for AST nodes. Nodes live in fixed-size chunks that never
+// move, so references stay valid while the tree grows, and a whole
+// compilation unit is released at once by reset().
+class AstArena
+{
+private:
+    static constexpr uint32_t CHUNK_SHIFT = 12;
+    static constexpr uint32_t CHUNK_NODES = 1u << CHUNK_SHIFT;
+
+    vector<unique_ptr<AstNode[]>> chunks;
+    uint32_t count;
+
+public:
+    AstArena()
+    {
+        reset();
+    }
+
+    uint32_t allocate(NodeKind kind, TokenType op, uint32_t token)
+    {
+        if ((count >> CHUNK_SHIFT) == chunks.size())
+            chunks.emplace_back(new AstNode[CHUNK_NODES]);
+        uint32_t index = count++;
+        AstNode &node = (*this)[index];
+        node.kind = kind;
+        node.op = op;
+        node.flags = 0;
+        node.token = token;
+        node.a = node.b = node.c = node.next = NO_NODE;
+        return index;
+    }
+
+    AstNode &operator[](uint32_t index)
+    {
+        return chunks[index >> CHUNK_SHIFT][index & (CHUNK_NODES - 1)];
+    }
+
+    const AstNode &operator[](uint32_t index) const
+    {
+        return chunks[index >> CHUNK_SHIFT][index & (CHUNK_NODES - 1)];
+    }
+
+    // Frees every node at once; the first chunk is kept for reuse.
+    void reset()
+    {
+        if (chunks.size() > 1)
+            chunks.resize(1);
+        count = 1;
+    }
+
+    size_t size() const
+    {
+        return count - 1;
+    }
+
+    size_t bytesReserved() const
+    {
+        return chunks.size() * CHUNK_NODES * sizeof(AstNode);
+    }
+};
+
+// Appends to a `next`-linked list while remembering its tail.
+struct NodeList
+{
+    uint32_t head = NO_NODE;
+    uint32_t tail = NO_NODE;
+
+    void append(AstArena &ast, uint32_t node)
+    {
+        if (node == NO_NODE)
+            return;
+        if (head == NO_NODE)
+            head = node;
+        else
+            ast[tail].next = node;
+        tail = node;
+    }
+};
+
+// Lexes on demand into a token window, for the streaming pipeline.
+struct TokenFeed
+{
+    Lexer *lexer;
+    TokenBuffer &window;
+
+    void pull()
+    {
+        lexer->lexNext(window);
+    }
+};
+
+enum NameUseKind : uint8_t
+{
+    NAME_DECLARED,
+    NAME_USED,     // read, or the target of an assignment
+    SCOPE_ENTERED, // token: the block's '{'
+    SCOPE_LEFT,    // token: the block's '}', or where it should have been
+};
+
+// A declaration, use of a name or block boundary seen by a parser that logs
+// names instead of checking them.
+struct NameUse
+{
+    uint32_t token;
+    NameUseKind kind;
+    TokenType type; // the declared type, for NAME_DECLARED
+};
+
+// How tightly each operator binds, lowest first. Binary operators are
+// left-associative; the ternary is right-associative.
+enum BindingPower : uint8_t
+{
+    BP_NONE, // the token ends the expression
+    BP_TERNARY,
+    BP_OR,
+    BP_AND,
+    BP_EQUALITY,
+    BP_RELATIONAL,
+    BP_ADDITIVE,
+    BP_MULTIPLICATIVE,
+    BP_PREFIX,
+    BP_POSTFIX,
+};
+
+constexpr array<uint8_t, T_EOF + 1> makeInfixPowerTable()
+{
+    array<uint8_t, T_EOF + 1> table{};
+    table[T_QUESTION] = BP_TERNARY;
+    table[T_OR] = BP_OR;
+    table[T_AND] = BP_AND;
+    table[T_EQ] = table[T_NEQ] = BP_EQUALITY;
+    table[T_LT] = table[T_GT] = table[T_LTE] = table[T_GTE] = BP_RELATIONAL;
+    table[T_PLUS] = table[T_MINUS] = BP_ADDITIVE;
+    table[T_MUL] = table[T_DIV] = table[T_MOD] = BP_MULTIPLICATIVE;
+    table[T_INCREMENT] = table[T_DECREMENT] = BP_POSTFIX;
+    return table;
+}
+
+// Binding power of each token in infix or postfix position, by TokenType.
+constexpr array<uint8_t, T_EOF + 1> INFIX_POWER = makeInfixPowerTable();
+
+// A statement the parser has opened but not finished: a block waiting for
+// its next statement, or an if, else or loop waiting for its body.
+enum FrameKind : uint8_t
+{
+    FRAME_BLOCK,
+    FRAME_THEN,
+    FRAME_ELSE,
+    FRAME_LOOP,
+};
+
+struct StatementFrame
+{
+    FrameKind kind;
+    uint32_t statement; // handed on when the frame closes
+    uint32_t node;      // takes the body: the N_IF, N_FOR_STEP or N_WHILE
+    NodeList list;      // a block's statements so far
+};
+
+// Where an operand the expression parser is still working on ends up.
+enum OperandSlot : uint8_t
+{
+    SLOT_WHOLE,   // it is the whole expression
+    SLOT_PREFIX,  // a of a prefix operator
+    SLOT_RIGHT,   // b of a binary operator
+    SLOT_THEN,    // b of a ternary
+    SLOT_ELSE,    // c of a ternary
+    SLOT_GROUPED, // inside parentheses
+};
+
+struct OperandFrame
+{
+    OperandSlot slot;
+    uint8_t minPower; // weakest operator the operand may still take in
+    uint32_t node;    // the operator node it belongs to
+};
+
+// Thrown by the parser after it has reported a syntax error; the innermost
+// statement list catches it and resynchronizes.
+struct SyntaxError : runtime_error
+{
+    SyntaxError() : runtime_error("syntax error") {}
+};
+
+// A syntax error that ends parsing: statement lists pass it on instead.
+struct NestingError : SyntaxError
+{
+};
+
+class Parser
+{
+private:
+    const TokenBuffer &tokens;
+    size_t pos;
+    SymbolTable symbolTable;
+    StringPool streamedNames; // the window's ids do not survive a discard
+    TokenFeed *feed;
+    AstArena ast;
+    Diagnostics &diagnostics;
+    size_t lastErrorOffset;
+    vector<NameUse> *nameLog;
+
+    // Open statements and unfinished operands, innermost last. Nesting lives
+    // here rather than on the call stack, so its cost is linear in the depth
+    // and maxDepth is the only limit on it.
+    vector<StatementFrame> frames;
+    vector<OperandFrame> operands;
+    uint32_t maxDepth;
+
+    // Every step forward goes through here so a streaming parser can lex the
+    // next token only when it becomes the lookahead.
+    void advance()
+    {
+        pos++;
+        if (feed && pos == tokens.size())
+            feed->pull();
+    }
+
+    // Symbol table key of an identifier token: its interned id, which
+    // stays stable unless tokens are streamed through a window.
+    uint32_t nameId(size_t token)
+    {
+        if (feed)
+            return streamedNames.intern(tokens.text(token));
+        return tokens.values[token];
+    }
+
+    const StringPool &names() const
+    {
+        return feed ? streamedNames : tokens.strings;
+    }
+
+    void log(size_t token, NameUseKind kind, TokenType type = T_ID)
+    {
+        nameLog->push_back({static_cast<uint32_t>(token), kind, type});
+    }
+
+    uint32_t node(NodeKind kind, TokenType op, size_t token)
+    {
+        return ast.allocate(kind, op, static_cast<uint32_t>(token));
+    }
+
+    // Only the first error at a token is reported, so recovery does not
+    // repeat itself.
+    void error(size_t token, const string &message)
+    {
+        size_t offset = tokens.offsets[token];
+        if (offset == lastErrorOffset)
+            return;
+        lastErrorOffset = offset;
+        diagnostics.error(offset, message);
+    }
+
+    [[noreturn]] void syntaxError(const string &message)
+    {
+        error(pos, message);
+        throw SyntaxError();
+    }
+
+    string found() const
+    {
+        if (tokens.types[pos] == T_EOF)
+            return "end of input";
+        return "'" + string(tokens.text(pos)) + "'";
+    }
+
+    // Skips the rest of a broken statement: up to and including the next ';'
+    // outside braces, or the '}' closing a block the statement opened. A '}'
+    // belonging to an enclosing block is left for that block.
+    void synchronize()
+    {
+        int depth = 0;
+        while (tokens.types[pos] != T_EOF)
+        {
+            TokenType type = tokens.types[pos];
+            if (type == T_RBRACE && depth == 0)
+                return;
+            advance();
+            if (type == T_LBRACE)
+                depth++;
+            else if (type == T_RBRACE && --depth == 0)
+                return;
+            else if (type == T_SEMICOLON && depth == 0)
+                return;
+        }
+    }
+
+    // Called before opening a frame of either kind. Going too deep is fatal:
+    // the rest of the input is skipped rather than recovered from level by
+    // level.
+    void nest()
+    {
+        if (frames.size() + operands.size() < maxDepth)
+            return;
+        error(pos, "Nesting deeper than " + to_string(maxDepth) + " levels");
+        while (tokens.types[pos] != T_EOF)
+            advance();
+        throw NestingError();
+    }
+
+    // Drops every frame above `base`, closing the scopes of open blocks.
+    void unwind(size_t base)
+    {
+        while (frames.size() > base)
+        {
+            if (frames.back().kind == FRAME_BLOCK)
+            {
+                if (nameLog)
+                    log(pos, SCOPE_LEFT);
+                else
+                    symbolTable.leaveScope();
+            }
+            frames.pop_back();
+        }
+    }
+
+    // One top-level statement; NO_NODE if it had to be skipped. Statements
+    // inside blocks recover within parseStatement.
+    uint32_t parseListedStatement()
+    {
+        try
+        {
+            return parseStatement();
+        }
+        catch (const SyntaxError &)
+        {
+            synchronize();
+            return NO_NODE;
+        }
+    }
+
+public:
+    // Deep enough for any hand-written program. The passes after parsing
+    // keep their own stacks too, so a higher limit only costs memory.
+    static constexpr uint32_t DEFAULT_MAX_DEPTH = 10000;
+
+    // Borrows the token buffer; it must outlive the parser.
+    Parser(const TokenBuffer &tokens, Diagnostics &diagnostics) : tokens(tokens), diagnostics(diagnostics)
+    {
+        this->pos = 0;
+        this->feed = nullptr;
+        this->lastErrorOffset = SIZE_MAX;
+        this->nameLog = nullptr;
+        this->maxDepth = DEFAULT_MAX_DEPTH;
+    }
+
+    // Streaming parser: tokens are pulled from `feed` as the parser needs them.
+    Parser(TokenFeed &feed, Diagnostics &diagnostics) : Parser(feed.window, diagnostics)
+    {
+        this->feed = &feed;
+        if (tokens.size() == 0)
+            feed.pull();
+    }
+
+    const AstArena &tree() const
+    {
+        return ast;
+    }
+
+    AstArena &tree()
+    {
+        return ast;
+    }
+
+    size_t position() const
+    {
+        return pos;
+    }
+
+    void seek(size_t position)
+    {
+        this->pos = position;
+        this->lastErrorOffset = SIZE_MAX;
+    }
+
+    // With a log, declarations and uses of names are appended to it
+    // instead of being checked, for a caller that parses statements out of
+    // order and resolves names itself.
+    void logNames(vector<NameUse> *log)
+    {
+        this->nameLog = log;
+    }
+
+    // Most statements and operands that may be open at once; anything
+    // nested deeper is reported and skipped.
+    void setMaxDepth(uint32_t depth)
+    {
+        this->maxDepth = depth;
+    }
+
+    void printSummary(ostream &out = cout)
+    {
+        out << "Parsing completed successfully" << endl;
+        symbolTable.printTable(out, names());
+    }
+
+    void printSymbols(ostream &out)
+    {
+        symbolTable.printTable(out, names());
+    }
+
+    const SymbolTable &symbols() const
+    {
+        return symbolTable;
+    }
+
+    uint32_t parseProgram()
+    {
+        uint32_t program = node(N_PROGRAM, T_EOF, pos);
+        NodeList statements;
+        while (tokens.types[pos] != T_EOF)
+        {
+            statements.append(ast, parseTopLevelStatement());
+        }
+        ast[program].a = statements.head;
+        return program;
+    }
+
+    // NO_NODE if the statement had to be skipped.
+    uint32_t parseTopLevelStatement()
+    {
+        uint32_t statement = parseListedStatement();
+        // A stray '}' ends nothing at the top level.
+        if (tokens.types[pos] == T_RBRACE)
+        {
+            error(pos, "Unexpected '}'");
+            advance();
+        }
+        return statement;
+    }
+
+    // Parses one top-level statement at a time. After each one, `onStatement`
+    // receives the window holding exactly that statement's tokens and its AST,
+    // after which both are discarded; only the lookahead token is carried over.
+    void parseProgramStreaming(const function<void(const TokenBuffer &, size_t, const AstArena &, uint32_t)> &onStatement)
+    {
+        while (tokens.types[pos] != T_EOF)
+        {
+            uint32_t statement = parseTopLevelStatement();
+            if (statement != NO_NODE)
+                onStatement(tokens, pos, ast, statement);
+            feed->window.discard(pos);
+            pos = 0;
+            ast.reset();
+        }
+    }
+
+    // Parses one statement together with everything nested in it. Statements
+    // that hold others open a frame and the loop carries on with their body;
+    // a finished statement is handed to the frame below it. An error inside a
+    // block is recovered from there, as the statement list it is; with no
+    // block open it is passed on to the caller.
+    uint32_t parseStatement()
+    {
+        size_t base = frames.size();
+        bool starting = true;
+        uint32_t done = NO_NODE;
+        while (true)
+        {
+            try
+            {
+                if (starting)
+                {
+                    if (frames.size() > base && frames.back().kind == FRAME_BLOCK &&
+                        (tokens.types[pos] == T_RBRACE || tokens.types[pos] == T_EOF))
+                    {
+                        done = closeBlock();
+                        starting = false;
+                    }
+                    else
+                    {
+                        done = startStatement();
+                        starting = done == NO_NODE;
+                    }
+                    continue;
+                }
+
+                if (frames.size() == base)
+                    return done;
+                StatementFrame &frame = frames.back();
+                switch (frame.kind)
+                {
+                case FRAME_BLOCK:
+                    frame.list.append(ast, done);
+                    starting = true;
+                    break;
+                case FRAME_THEN:
+                    ast[frame.node].b = done;
+                    if (tokens.types[pos] != T_ELSE)
+                    {
+                        done = frame.statement;
+                        frames.pop_back();
+                        break;
+                    }
+                    // An else-if is simply an if statement as the else branch.
+                    advance();
+                    frame.kind = FRAME_ELSE;
+                    starting = true;
+                    break;
+                case FRAME_ELSE:
+                    ast[frame.node].c = done;
+                    done = frame.statement;
+                    frames.pop_back();
+                    break;
+                case FRAME_LOOP:
+                    ast[frame.node].b = done;
+                    done = frame.statement;
+                    frames.pop_back();
+                    break;
+                }
+            }
+            catch (const NestingError &)
+            {
+                operands.clear();
+                unwind(base);
+                throw;
+            }
+            catch (const SyntaxError &)
+            {
+                operands.clear();
+                size_t block = frames.size();
+                while (block > base && frames[block - 1].kind != FRAME_BLOCK)
+                    block--;
+                frames.resize(block);
+                if (block == base)
+                    throw;
+                synchronize();
+                starting = true;
+            }
+        }
+    }
+
+    // A statement that holds no others, or NO_NODE after opening a frame for
+    // one that does.
+    uint32_t startStatement()
+    {
+        if (tokens.types[pos] == T_INT || tokens.types[pos] == T_CHAR ||
+            tokens.types[pos] == T_FLOAT || tokens.types[pos] == T_DOUBLE || tokens.types[pos] == T_BOOLEAN)
+        {
+            return parseDeclarationAndAssignment();
+        }
+        else if (tokens.types[pos] == T_ID)
+        {
+            uint32_t assignment = parseAssignment();
+            expect(T_SEMICOLON);
+            return assignment;
+        }
+        else if (tokens.types[pos] == T_IF)
+        {
+            nest();
+            uint32_t ifNode = parseCondition(N_IF);
+            frames.push_back({FRAME_THEN, ifNode, ifNode, {}});
+        }
+        else if (tokens.types[pos] == T_FOR)
+        {
+            nest();
+            openForLoop();
+        }
+        else if (tokens.types[pos] == T_WHILE)
+        {
+            nest();
+            uint32_t whileNode = parseCondition(N_WHILE);
+            frames.push_back({FRAME_LOOP, whileNode, whileNode, {}});
+        }
+        else if (tokens.types[pos] == T_RETURN)
+        {
+            return parseReturnStatement();
+        }
+        else if (tokens.types[pos] == T_BREAK)
+        {
+            return parseBreakStatement();
+        }
+        else if (tokens.types[pos] == T_CONTINUE)
+        {
+            return parseContinueStatement();
+        }
+        else if (tokens.types[pos] == T_LBRACE)
+        {
+            nest();
+            openBlock();
+        }
+        else
+        {
+            syntaxError("Unexpected " + found() + " at the start of a statement");
+        }
+        return NO_NODE;
+    }
+
+    // `if (a)` or `while (a)`, up to where the body starts.
+    uint32_t parseCondition(NodeKind kind)
+    {
+        TokenType keyword = tokens.types[pos];
+        uint32_t statement = node(kind, keyword, pos);
+        advance();
+        expect(T_LPAREN);
+        ast[statement].a = parseExpression();
+        expect(T_RPAREN);
+        return statement;
+    }
+
+    uint32_t parseReturnStatement()
+    {
+        uint32_t ret = node(N_RETURN, T_RETURN, expect(T_RETURN));
+        ast[ret].a = parseExpression();
+        expect(T_SEMICOLON);
+        return ret;
+    }
+
+    uint32_t parseDeclarationAndAssignment()
+    {
+        size_t typeToken = pos;
+        TokenType varType = expectType();
+        uint32_t declaration = node(N_DECLARATION, varType, typeToken);
+        NodeList declarators;
+        while (true)
+        {
+            size_t name = expect(T_ID);
+            uint32_t declarator = node(N_DECLARATOR, varType, name);
+
+            if (nameLog)
+            {
+                log(name, NAME_DECLARED, varType);
+            }
+            else if (!symbolTable.declare(nameId(name), varType))
+            {
+                error(name, "Identifier '" + string(tokens.text(name)) + "' already declared");
+            }
+
+            if (tokens.types[pos] == T_ASSIGN)
+            {
+                advance();
+                ast[declarator].a = parseExpression();
+            }
+            declarators.append(ast, declarator);
+
+            if (tokens.types[pos] == T_COMMA)
+            {
+                advance();
+            }
+            else
+            {
+                expect(T_SEMICOLON);
+                break;
+            }
+        }
+        ast[declaration].a = declarators.head;
+        return declaration;
+    }
+
+    void openForLoop()
+    {
+        uint32_t forNode = node(N_FOR, T_FOR, expect(T_FOR));
+        uint32_t step = node(N_FOR_STEP, T_FOR, pos);
+        ast[forNode].c = step;
+        expect(T_LPAREN);
+
+        if (tokens.types[pos] != T_SEMICOLON)
+        {
+            ast[forNode].a = parseAssignment();
+        }
+
+        expect(T_SEMICOLON);
+
+        if (tokens.types[pos] != T_SEMICOLON)
+        {
+            ast[forNode].b = parseExpression();
+        }
+
+        expect(T_SEMICOLON);
+
+        NodeList updates;
+        while (tokens.types[pos] != T_RPAREN)
+        {
+            updates.append(ast, parseAssignment());
+            if (tokens.types[pos] == T_COMMA)
+            {
+                advance();
+            }
+        }
+        ast[step].a = updates.head;
 
         expect(T_RPAREN);
+        frames.push_back({FRAME_LOOP, forNode, step, {}});
+    }
+
+    // Every read and assignment must name a declaration that is in scope.
+    void use(size_t name)
+    {
+        if (nameLog)
+            log(name, NAME_USED);
+        else if (!symbolTable.exists(nameId(name)))
+            error(name, "Identifier '" + string(tokens.text(name)) + "' not declared");
+    }
+
+    uint32_t parseAssignment()
+    {
+        size_t target = expect(T_ID);
+        use(target);
+
+        uint32_t assignment = node(N_ASSIGNMENT, tokens.types[pos], target);
+        if (tokens.types[pos] == T_INCREMENT || tokens.types[pos] == T_DECREMENT)
+        {
+            advance();
+        }
+        else if (tokens.types[pos] == T_ASSIGN || tokens.types[pos] == T_PLUS_ASSIGN ||
+                 tokens.types[pos] == T_MINUS_ASSIGN || tokens.types[pos] == T_MUL_ASSIGN ||
+                 tokens.types[pos] == T_DIV_ASSIGN)
+        {
+            advance();
+            ast[assignment].a = parseExpression();
+        }
+        else
+        {
+            syntaxError("Expected an assignment or increment/decrement operator but found " + found());
+        }
+
+        if (tokens.types[pos] == T_INCREMENT || tokens.types[pos] == T_DECREMENT)
+        {
+            advance();
+        }
+        return assignment;
+    }
+
+    void openBlock()
+    {
+        uint32_t block = node(N_BLOCK, T_LBRACE, expect(T_LBRACE));
+        if (nameLog)
+            log(pos - 1, SCOPE_ENTERED);
+        else
+            symbolTable.enterScope();
+        frames.push_back({FRAME_BLOCK, block, block, {}});
+    }
+
+    // Recovery stops at the innermost block rather than popping it, so each
+    // scope is left here or, after a nesting error, in unwind().
+    uint32_t closeBlock()
+    {
+        StatementFrame frame = frames.back();
+        frames.pop_back();
+        if (nameLog)
+            log(pos, SCOPE_LEFT);
+        else
+            symbolTable.leaveScope();
+        expect(T_RBRACE);
+        ast[frame.statement].a = frame.list.head;
+        return frame.statement;
+    }
+
+    uint32_t parseBreakStatement()
+    {
+        uint32_t breakNode = node(N_BREAK, T_BREAK, expect(T_BREAK));
+        expect(T_SEMICOLON);
+        return breakNode;
+    }
+
+    uint32_t parseContinueStatement()
+    {
+        uint32_t continueNode = node(N_CONTINUE, T_CONTINUE, expect(T_CONTINUE));
+        expect(T_SEMICOLON);
+        return continueNode;
+    }
+
+    // Pratt parser with its operands on `operands` instead of the call stack.
+    // Each round takes the operator after the current operand if it binds at
+    // least as tightly as the innermost frame allows, and opens a frame for
+    // its right operand; otherwise that frame's operand is complete and goes
+    // into its slot.
+    uint32_t parseExpression()
+    {
+        nest();
+        operands.push_back({SLOT_WHOLE, BP_TERNARY, NO_NODE});
+        uint32_t left = parsePrefix();
+        while (true)
+        {
+            TokenType type = tokens.types[pos];
+            uint8_t power = INFIX_POWER[type];
+            if (power >= operands.back().minPower)
+            {
+                size_t op = pos;
+                if (power == BP_POSTFIX)
+                {
+                    advance();
+                    uint32_t postfix = node(N_POSTFIX, type, op);
+                    ast[postfix].a = left;
+                    left = postfix;
+                    continue;
+                }
+                nest();
+                advance();
+                if (power == BP_TERNARY)
+                {
+                    // Right-associative: both arms may hold further ternaries.
+                    uint32_t ternary = node(N_TERNARY, T_QUESTION, op);
+                    ast[ternary].a = left;
+                    operands.push_back({SLOT_THEN, BP_TERNARY, ternary});
+                }
+                else
+                {
+                    uint32_t binary = node(N_BINARY, type, op);
+                    ast[binary].a = left;
+                    operands.push_back({SLOT_RIGHT, static_cast<uint8_t>(power + 1), binary});
+                }
+                left = parsePrefix();
+                continue;
+            }
+
+            OperandFrame frame = operands.back();
+            operands.pop_back();
+            switch (frame.slot)
+            {
+            case SLOT_WHOLE:
+                return left;
+            case SLOT_PREFIX:
+                ast[frame.node].a = left;
+                left = frame.node;
+                break;
+            case SLOT_RIGHT:
+                ast[frame.node].b = left;
+                left = frame.node;
+                break;
+            case SLOT_THEN:
+                ast[frame.node].b = left;
+                expect(T_COLON);
+                operands.push_back({SLOT_ELSE, BP_TERNARY, frame.node});
+                left = parsePrefix();
+                break;
+            case SLOT_ELSE:
+                ast[frame.node].c = left;
+                left = frame.node;
+                break;
+            case SLOT_GROUPED:
+                expect(T_RPAREN);
+                break;
+            }
+        }
+    }
+
+    // The next primary expression. Prefix operators and opening parentheses
+    // on the way each open a frame for the operand that follows them.
+    uint32_t parsePrefix()
+    {
+        while (true)
+        {
+            TokenType type = tokens.types[pos];
+            switch (type)
+            {
+            case T_PLUS:
+            case T_MINUS:
+            case T_INCREMENT:
+            case T_DECREMENT:
+            {
+                nest();
+                uint32_t prefix = node(N_UNARY, type, pos);
+                advance();
+                operands.push_back({SLOT_PREFIX, BP_PREFIX, prefix});
+                break;
+            }
+            case T_ID:
+            {
+                uint32_t identifier = node(N_IDENTIFIER, T_ID, pos);
+                use(pos);
+                advance();
+                return identifier;
+            }
+            case T_NUM:
+            case T_TRUE:
+            case T_FALSE:
+            case T_CHAR_LITERAL:
+            case T_FLOAT_LITERAL:
+            {
+                uint32_t literal = node(N_LITERAL, type, pos);
+                advance();
+                return literal;
+            }
+            case T_LPAREN:
+                nest();
+                advance();
+                operands.push_back({SLOT_GROUPED, BP_TERNARY, NO_NODE});
+                break;
+            default:
+                syntaxError("Expected an expression but found " + found());
+            }
+        }
+    }
+
+    TokenType expectType()
+    {
+        TokenType type = tokens.types[pos];
+        if (type == T_INT || type == T_CHAR || type == T_FLOAT || type == T_DOUBLE || type == T_BOOLEAN)
+        {
+            advance();
+            return type;
+        }
+        syntaxError("Expected a type but found " + found());
+    }
+
+    size_t expect(TokenType expectedType)
+    {
+        if (tokens.types[pos] == expectedType)
+        {
+            size_t index = pos;
+            advance();
+            return index;
+        }
+        string wanted = expectedType == T_ID ? string("an identifier") : string("'") + tokenSpelling(expectedType) + "'";
+        syntaxError("Expected " + wanted + " but found " + found());
+    }
+};
+
+// Writes the tree as S-expressions, one top-level statement per line.
+class AstPrinter
+{
+private:
+    // Text to write, or a node to expand when `node` is not TEXT_ONLY.
+    struct Item
+    {
+        string_view text;
+        uint32_t node;
+    };
+    static constexpr uint32_t TEXT_ONLY = NO_NODE - 1;
+
+    const AstArena &ast;
+    const TokenBuffer &tokens;
+    ostream &out;
+    uint32_t firstToken; // node tokens are relative to this one
+    vector<Item> pending; // the next item last
+    vector<Item> parts;   // the expansion of one node, in order
+
+    void text(string_view s)
+    {
+        parts.push_back({s, TEXT_ONLY});
+    }
+
+    void child(uint32_t n)
+    {
+        parts.push_back({{}, n});
+    }
+
+    void list(uint32_t head)
+    {
+        for (uint32_t n = head; n != NO_NODE; n = ast[n].next)
+        {
+            text(" ");
+            child(n);
+        }
+    }
+
+    // Writes the node's own text and queues its children in place, so deep
+    // trees use the heap rather than the call stack.
+    void expand(uint32_t n)
+    {
+        if (n == NO_NODE)
+        {
+            out << "_";
+            return;
+        }
+        const AstNode &node = ast[n];
+        parts.clear();
+        switch (node.kind)
+        {
+        case N_PROGRAM:
+            for (uint32_t s = node.a; s != NO_NODE; s = ast[s].next)
+            {
+                child(s);
+                text("\n");
+            }
+            break;
+        case N_BLOCK:
+            text("(block");
+            list(node.a);
+            text(")");
+            break;
+        case N_DECLARATION:
+            text("(declare ");
+            text(tokens.text(firstToken + node.token));
+            list(node.a);
+            text(")");
+            break;
+        case N_DECLARATOR:
+            text(tokens.text(firstToken + node.token));
+            if (node.a != NO_NODE)
+            {
+                text("=");
+                child(node.a);
+            }
+            break;
+        case N_ASSIGNMENT:
+            text("(");
+            text(tokenSpelling(node.op));
+            text(" ");
+            text(tokens.text(firstToken + node.token));
+            if (node.a != NO_NODE)
+            {
+                text(" ");
+                child(node.a);
+            }
+            text(")");
+            break;
+        case N_IF:
+            text("(if ");
+            child(node.a);
+            text(" ");
+            child(node.b);
+            if (node.c != NO_NODE)
+            {
+                text(" ");
+                child(node.c);
+            }
+            text(")");
+            break;
+        case N_FOR:
+            text("(for ");
+            child(node.a);
+            text(" ");
+            child(node.b);
+            text(" (step");
+            list(ast[node.c].a);
+            text(") ");
+            child(ast[node.c].b);
+            text(")");
+            break;
+        case N_WHILE:
+            text("(while ");
+            child(node.a);
+            text(" ");
+            child(node.b);
+            text(")");
+            break;
+        case N_RETURN:
+            text("(return ");
+            child(node.a);
+            text(")");
+            break;
+        case N_BREAK:
+            text("(break)");
+            break;
+        case N_CONTINUE:
+            text("(continue)");
+            break;
+        case N_TERNARY:
+            text("(? ");
+            child(node.a);
+            text(" ");
+            child(node.b);
+            text(" ");
+            child(node.c);
+            text(")");
+            break;
+        case N_BINARY:
+            text("(");
+            text(tokenSpelling(node.op));
+            text(" ");
+            child(node.a);
+            text(" ");
+            child(node.b);
+            text(")");
+            break;
+        case N_UNARY:
+            text("(");
+            text(tokenSpelling(node.op));
+            text(" ");
+            child(node.a);
+            text(")");
+            break;
+        case N_POSTFIX:
+            text("(");
+            child(node.a);
+            text(" ");
+            text(tokenSpelling(node.op));
+            text(")");
+            break;
+        case N_IDENTIFIER:
+        case N_LITERAL:
+            text(tokens.text(firstToken + node.token));
+            break;
+        default:
+            text("?");
+            break;
+        }
+        pending.insert(pending.end(), parts.rbegin(), parts.rend());
+    }
+
+public:
+    AstPrinter(const AstArena &ast, const TokenBuffer &tokens, ostream &out) : ast(ast), tokens(tokens), out(out), firstToken(0) {}
+
+    void print(uint32_t n, uint32_t firstToken = 0)
+    {
+        this->firstToken = firstToken;
+        pending.push_back({{}, n});
+        while (!pending.empty())
+        {
+            Item item = pending.back();
+            pending.pop_back();
+            if (item.node == TEXT_ONLY)
+                out << item.text;
+            else
+                expand(item.node);
+        }
+    }
+};
+
+// The text of an edited document, as pieces of the original text and of an
+// append-only buffer of inserted text. An edit walks the pieces instead of
+// moving the bytes behind it; once there are many pieces they are joined
+// back into one string.
+class PieceTable
+{
+private:
+    static const size_t PIECE_LIMIT = 1024;
+
+    struct Piece
+    {
+        bool added; // in `added` rather than `original`
+        size_t start;
+        size_t length;
+    };
+
+    string original;
+    string added;
+    vector<Piece> pieces;
+    size_t length;
+
+    const char *bytes(const Piece &piece) const
+    {
+        return (piece.added ? added.data() : original.data()) + piece.start;
+    }
+
+    // Splits the piece holding `offset` so that one starts there, and
+    // returns its index.
+    size_t split(size_t offset)
+    {
+        size_t at = 0;
+        for (size_t i = 0; i < pieces.size(); i++)
+        {
+            if (offset == at)
+                return i;
+            if (offset < at + pieces[i].length)
+            {
+                Piece tail = pieces[i];
+                tail.start += offset - at;
+                tail.length -= offset - at;
+                pieces[i].length = offset - at;
+                pieces.insert(pieces.begin() + i + 1, tail);
+                return i + 1;
+            }
+            at += pieces[i].length;
+        }
+        return pieces.size();
+    }
+
+public:
+    explicit PieceTable(string text) : original(move(text)), length(original.size())
+    {
+        if (length != 0)
+            pieces.push_back({false, 0, length});
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    void replace(size_t start, size_t end, string_view replacement)
+    {
+        size_t first = split(start);
+        size_t last = split(end);
+        pieces.erase(pieces.begin() + first, pieces.begin() + last);
+        if (!replacement.empty())
+        {
+            pieces.insert(pieces.begin() + first, {true, added.size(), replacement.size()});
+            added.append(replacement);
+        }
+        length = length - (end - start) + replacement.size();
+
+        if (pieces.size() > PIECE_LIMIT)
+        {
+            original = str();
+            added.clear();
+            pieces.clear();
+            if (length != 0)
+                pieces.push_back({false, 0, length});
+        }
+    }
+
+    // Copies up to `count` bytes from `offset` to `out`, and returns how
+    // many there were.
+    size_t copy(size_t offset, size_t count, char *out) const
+    {
+        size_t copied = 0;
+        size_t at = 0;
+        for (size_t i = 0; i < pieces.size() && copied < count; i++)
+        {
+            const Piece &piece = pieces[i];
+            size_t from = offset + copied;
+            if (from < at + piece.length)
+            {
+                size_t n = min(at + piece.length - from, count - copied);
+                memcpy(out + copied, bytes(piece) + (from - at), n);
+                copied += n;
+            }
+            at += piece.length;
+        }
+        return copied;
+    }
+
+    string str() const
+    {
+        string text;
+        text.reserve(length);
+        for (const Piece &piece : pieces)
+            text.append(bytes(piece), piece.length);
+        return text;
+    }
+};
+
+// Keeps the tokens and AST of a text current under edits. An edit is re-lexed
+// and re-parsed from the top-level statement ahead of it until a statement
+// starts, behind the edit, where an old one did; everything else is kept.
+// Each statement owns its tokens, with offsets and token indices relative to
+// its first token, and statements are kept in segments with their own bases,
+// so the statements behind an edit are moved by shifting one base per
+// segment. An edit costs in proportion to the text it re-reads, a segment,
+// and the number of segments, rather than to the length of the file.
+class IncrementalDocument
+{
+private:
+    static const size_t READ_CHUNK = 4096;
+    static const size_t SEGMENT_STATEMENTS = 256;
+
+    // A statement's tokens run from its first token to the next statement's.
+    // Token indices are relative to the first token, offsets to its offset.
+    struct Parsed
+    {
+        TokenArray<TokenType> types;
+        TokenArray<uint32_t> offsets;
+        TokenArray<uint32_t> values;  // ids in the window's string pool
+        uint32_t root;                // NO_NODE if the statement was skipped after an error
+        uint32_t nodes;               // arena nodes allocated while parsing it
+        vector<NameUse> names;
+        vector<Diagnostic> errors;    // from the parser
+        vector<Diagnostic> lexErrors; // from the lexer, anywhere in the statement's tokens
+    };
+
+    struct Statement
+    {
+        uint32_t start;      // offset of the first token
+        uint32_t firstToken; // index of the first token in the document
+        unique_ptr<Parsed> parsed;
+    };
+
+    // Consecutive statements whose start and firstToken are relative to the
+    // segment's.
+    struct Segment
+    {
+        uint32_t start;
+        uint32_t firstToken;
+        vector<Statement> statements;
+    };
+
+    PieceTable text;
+    TokenBuffer window; // the tokens of the statements being parsed; its pool holds every lexeme
+    TokenFeed feed;
+    Diagnostics parseErrors; // drained after every statement
+    unique_ptr<Parser> parser;
+    vector<NameUse> nameLog;
+    vector<Segment> segments; // never empty ones
+    vector<Diagnostic> leadingErrors; // lexer errors before the first statement
+    size_t tokenCount;
+    size_t liveNodes;
+    size_t relexed;
+    size_t reparsed;
+
+    // Parses the statement at the parser's position; window[0] is token
+    // `firstToken` of the document.
+    Statement parseStatement(size_t firstToken)
+    {
+        size_t begin = parser->position();
+        Statement statement{window.offsets[begin], static_cast<uint32_t>(firstToken + begin), unique_ptr<Parsed>(new Parsed())};
+        Parsed &parsed = *statement.parsed;
+        AstArena &ast = parser->tree();
+        uint32_t nodesBefore = static_cast<uint32_t>(ast.size());
+        nameLog.clear();
+        parsed.root = parser->parseTopLevelStatement();
+        parsed.nodes = static_cast<uint32_t>(ast.size() - nodesBefore);
+
+        size_t end = parser->position();
+        parsed.types.assign(window.types.begin() + begin, window.types.begin() + end);
+        parsed.values.assign(window.values.begin() + begin, window.values.begin() + end);
+        parsed.offsets.resize(end - begin);
+        for (size_t i = begin; i < end; i++)
+        {
+            parsed.offsets[i - begin] = window.offsets[i] - statement.start;
+        }
+        for (uint32_t n = nodesBefore + 1; n <= ast.size(); n++)
+        {
+            ast[n].token -= static_cast<uint32_t>(begin);
+        }
+        for (NameUse use : nameLog)
+        {
+            parsed.names.push_back({use.token - static_cast<uint32_t>(begin), use.kind, use.type});
+        }
+        for (Diagnostic &error : parseErrors.take())
+        {
+            error.offset -= statement.start;
+            parsed.errors.push_back(error);
+        }
+        return statement;
+    }
+
+    // Re-lexes and re-parses from statement `index` of segment `first`, or
+    // from the start of the text if that is the first statement, until a
+    // statement starts at or after offset `stable` where an old one started
+    // `delta` bytes earlier. The new statements replace the old ones before
+    // that one.
+    void reparse(size_t first, size_t index, size_t stable, int64_t delta)
+    {
+        bool fromStart = first == 0 && index == 0;
+        size_t restart = fromStart ? 0 : segments[first].start + segments[first].statements[index].start;
+        size_t firstToken = fromStart ? 0 : segments[first].firstToken + segments[first].statements[index].firstToken;
+
+        // Reading starts a byte early for the lexer's '"' lookbehind.
+        size_t readFrom = restart > 0 ? restart - 1 : 0;
+        ChunkReader reader([this, at = readFrom](char *out, size_t size) mutable
+                           {
+                               size_t n = text.copy(at, size, out);
+                               at += n;
+                               return n; },
+                           READ_CHUNK);
+        Diagnostics lexDiagnostics;
+        Lexer lexer(reader, lexDiagnostics, readFrom);
+        lexer.seek(restart);
+        window.types.clear();
+        window.offsets.clear();
+        window.values.clear();
+        feed.lexer = &lexer;
+        feed.pull();
+        if (!parser)
+        {
+            parser.reset(new Parser(feed, parseErrors));
+            parser->logNames(&nameLog);
+        }
+        parser->seek(0);
+
+        // Old statements from (first, index) up to (last, next) are replaced.
+        vector<Statement> replaced;
+        size_t last = first;
+        size_t next = index;
+        size_t resume = SIZE_MAX; // where the kept statements start
+        size_t dropped = 0;       // arena nodes of the replaced statements
+        while (true)
+        {
+            size_t position = parser->position();
+            if (window.types[position] == T_EOF)
+            {
+                for (; last < segments.size(); last++, next = 0)
+                {
+                    for (; next < segments[last].statements.size(); next++)
+                        dropped += segments[last].statements[next].parsed->nodes;
+                }
+                break;
+            }
+            int64_t offset = window.offsets[position];
+            if (offset >= static_cast<int64_t>(stable))
+            {
+                int64_t old = offset - delta;
+                while (last < segments.size() && segments[last].start + segments[last].statements[next].start < old)
+                {
+                    dropped += segments[last].statements[next].parsed->nodes;
+                    if (++next == segments[last].statements.size())
+                    {
+                        last++;
+                        next = 0;
+                    }
+                }
+                if (last < segments.size() && segments[last].start + segments[last].statements[next].start == old)
+                {
+                    resume = static_cast<size_t>(offset);
+                    break;
+                }
+            }
+            replaced.push_back(parseStatement(firstToken));
+        }
+
+        if (fromStart)
+            leadingErrors.clear();
+        size_t owner = 0;
+        for (Diagnostic &error : lexDiagnostics.take())
+        {
+            // The first kept statement's errors were reported before.
+            if (error.offset >= resume)
+                break;
+            while (owner < replaced.size() && replaced[owner].start <= error.offset)
+                owner++;
+            if (owner == 0)
+            {
+                leadingErrors.push_back(error);
+                continue;
+            }
+            error.offset -= replaced[owner - 1].start;
+            replaced[owner - 1].parsed->lexErrors.push_back(error);
+        }
+
+        size_t lexed = parser->position();
+        size_t oldEnd = last < segments.size() ? segments[last].firstToken + segments[last].statements[next].firstToken : tokenCount;
+        int64_t tokenShift = static_cast<int64_t>(lexed) - static_cast<int64_t>(oldEnd - firstToken);
+        tokenCount += tokenShift;
+        liveNodes -= dropped;
+        for (const Statement &statement : replaced)
+        {
+            liveNodes += statement.parsed->nodes;
+        }
+        relexed = lexed;
+        reparsed = replaced.size();
+
+        // The kept statements around the new ones in the affected segments
+        // are re-segmented with them; the segments behind only move.
+        vector<Statement> merged;
+        auto keep = [&](Segment &segment, size_t from, size_t to, int64_t shift, int64_t shiftTokens)
+        {
+            for (size_t i = from; i < to; i++)
+            {
+                Statement &statement = segment.statements[i];
+                statement.start = static_cast<uint32_t>(segment.start + statement.start + shift);
+                statement.firstToken = static_cast<uint32_t>(segment.firstToken + statement.firstToken + shiftTokens);
+                merged.push_back(move(statement));
+            }
+        };
+        if (first < segments.size())
+            keep(segments[first], 0, index, 0, 0);
+        move(replaced.begin(), replaced.end(), back_inserter(merged));
+        size_t end = last;
+        if (last < segments.size())
+        {
+            keep(segments[last], next, segments[last].statements.size(), delta, tokenShift);
+            end = last + 1;
+        }
+        for (size_t i = end; i < segments.size(); i++)
+        {
+            segments[i].start = static_cast<uint32_t>(segments[i].start + delta);
+            segments[i].firstToken = static_cast<uint32_t>(segments[i].firstToken + tokenShift);
+        }
+
+        vector<Segment> rebuilt;
+        for (size_t i = 0; i < merged.size(); i += SEGMENT_STATEMENTS)
+        {
+            Segment segment{merged[i].start, merged[i].firstToken, {}};
+            for (size_t j = i; j < min(i + SEGMENT_STATEMENTS, merged.size()); j++)
+            {
+                merged[j].start -= segment.start;
+                merged[j].firstToken -= segment.firstToken;
+                segment.statements.push_back(move(merged[j]));
+            }
+            rebuilt.push_back(move(segment));
+        }
+        size_t begin = min(first, segments.size());
+        segments.erase(segments.begin() + begin, segments.begin() + end);
+        segments.insert(segments.begin() + begin, make_move_iterator(rebuilt.begin()), make_move_iterator(rebuilt.end()));
+    }
+
+    void rebuild()
+    {
+        parser.reset();
+        window = TokenBuffer();
+        segments.clear();
+        leadingErrors.clear();
+        tokenCount = 0;
+        liveNodes = 0;
+        reparse(0, 0, 0, 0);
+    }
+
+public:
+    IncrementalDocument(string text) : text(move(text)), feed{nullptr, window}
+    {
+        rebuild();
+    }
+
+    IncrementalDocument(const IncrementalDocument &) = delete;
+    IncrementalDocument &operator=(const IncrementalDocument &) = delete;
+
+    // Replaces the bytes [start, end) with `replacement`. Returns false, and
+    // changes nothing, if the range is out of bounds.
+    bool edit(size_t start, size_t end, string_view replacement)
+    {
+        if (start > end || end > text.size() || text.size() - (end - start) + replacement.size() > UINT32_MAX)
+            return false;
+        int64_t delta = static_cast<int64_t>(replacement.size()) - static_cast<int64_t>(end - start);
+        text.replace(start, end, replacement);
+
+        // The last token starting before the edit may extend into it, and the
+        // statement holding the token before that may have looked at it (for
+        // an `else`), so re-parsing starts with that statement.
+        size_t first = 0;
+        size_t index = 0;
+        size_t before = lower_bound(segments.begin(), segments.end(), start,
+                                    [](const Segment &segment, size_t offset)
+                                    { return segment.start < offset; }) -
+                        segments.begin();
+        if (before > 0)
+        {
+            const Segment &segment = segments[before - 1];
+            size_t after = lower_bound(segment.statements.begin(), segment.statements.end(), start - segment.start,
+                                       [](const Statement &statement, size_t offset)
+                                       { return statement.start < offset; }) -
+                           segment.statements.begin();
+            const Statement &statement = segment.statements[after - 1];
+            const TokenArray<uint32_t> &offsets = statement.parsed->offsets;
+            size_t token = lower_bound(offsets.begin(), offsets.end(), start - segment.start - statement.start) - offsets.begin() - 1;
+            first = before - 1;
+            index = after - 1;
+            if (token == 0 && index > 0)
+                index--;
+            else if (token == 0 && first > 0)
+                index = segments[--first].statements.size() - 1;
+        }
+        reparse(first, index, start + replacement.size(), delta);
+
+        // Replaced statements leave their nodes behind in the arena.
+        if (parser->tree().size() > 2 * liveNodes + 65536)
+            rebuild();
+        return true;
+    }
+
+    string source() const
+    {
+        return text.str();
+    }
+
+    // Calls visit(type, offset, text) for each token in order.
+    template <class Visit>
+    void forEachToken(Visit visit) const
+    {
+        for (const Segment &segment : segments)
+        {
+            for (const Statement &statement : segment.statements)
+            {
+                const Parsed &parsed = *statement.parsed;
+                uint32_t start = segment.start + statement.start;
+                for (size_t i = 0; i < parsed.types.size(); i++)
+                {
+                    uint32_t value = parsed.values[i];
+                    visit(parsed.types[i], start + parsed.offsets[i],
+                          value == TokenBuffer::NO_VALUE ? tokenSpelling(parsed.types[i]) : window.strings.get(value));
+                }
+            }
+        }
+    }
+
+    // The document's tokens as one buffer, ending with T_EOF.
+    TokenBuffer tokens() const
+    {
+        TokenBuffer tokens;
+        for (const Segment &segment : segments)
+        {
+            for (const Statement &statement : segment.statements)
+            {
+                const Parsed &parsed = *statement.parsed;
+                for (size_t i = 0; i < parsed.types.size(); i++)
+                {
+                    uint32_t value = parsed.values[i];
+                    if (value != TokenBuffer::NO_VALUE)
+                        value = tokens.strings.intern(window.strings.get(value));
+                    tokens.push(parsed.types[i], segment.start + statement.start + parsed.offsets[i], value);
+                }
+            }
+        }
+        tokens.push(T_EOF, text.size(), TokenBuffer::NO_VALUE);
+        return tokens;
+    }
+
+    // Prints the statements as AstPrinter prints a whole program.
+    void printAst(ostream &out) const
+    {
+        TokenBuffer all = tokens();
+        AstPrinter printer(parser->tree(), all, out);
+        for (const Segment &segment : segments)
+        {
+            for (const Statement &statement : segment.statements)
+            {
+                if (statement.parsed->root == NO_NODE)
+                    continue;
+                printer.print(statement.parsed->root, segment.firstToken + statement.firstToken);
+                out << '\n';
+            }
+        }
+    }
+
+    size_t relexedTokens() const
+    {
+        return relexed;
+    }
+
+    size_t reparsedStatements() const
+    {
+        return reparsed;
+    }
+
+    // The errors a full compile of the current text would report. Names are
+    // resolved here, in one pass over the statements' declarations, name
+    // uses and blocks, since a change to one declaration can affect any
+    // later statement.
+    vector<Diagnostic> diagnostics() const
+    {
+        vector<Diagnostic> parsed;
+        vector<Diagnostic> all = leadingErrors;
+        SymbolTable symbols;
+        for (const Segment &segment : segments)
+        {
+            for (const Statement &statement : segment.statements)
+            {
+                const Parsed &tokens = *statement.parsed;
+                uint32_t start = segment.start + statement.start;
+                for (NameUse use : tokens.names)
+                {
+                    switch (use.kind)
+                    {
+                    case SCOPE_ENTERED:
+                        symbols.enterScope();
+                        break;
+                    case SCOPE_LEFT:
+                        // Logged at T_EOF if the input ends inside the block,
+                        // and no statement holds that token.
+                        symbols.leaveScope();
+                        break;
+                    case NAME_DECLARED:
+                    case NAME_USED:
+                    {
+                        uint32_t name = tokens.values[use.token];
+                        bool declared = use.kind == NAME_DECLARED;
+                        if (declared ? !symbols.declare(name, T_ID) : !symbols.exists(name))
+                            parsed.push_back({start + tokens.offsets[use.token], 0, 0,
+                                              "Identifier '" + string(window.strings.get(name)) +
+                                                  (declared ? "' already declared" : "' not declared")});
+                        break;
+                    }
+                    }
+                }
+                for (Diagnostic error : tokens.errors)
+                {
+                    error.offset += start;
+                    parsed.push_back(error);
+                }
+                for (Diagnostic error : tokens.lexErrors)
+                {
+                    error.offset += start;
+                    all.push_back(error);
+                }
+            }
+        }
+
+        // The parser reports at most one error per token.
+        auto byOffset = [](const Diagnostic &x, const Diagnostic &y)
+        { return x.offset < y.offset; };
+        stable_sort(parsed.begin(), parsed.end(), byOffset);
+        for (size_t i = 0; i < parsed.size(); i++)
+        {
+            if (i == 0 || parsed[i].offset != parsed[i - 1].offset)
+                all.push_back(parsed[i]);
+        }
+        stable_sort(all.begin(), all.end(), byOffset);
+
+        string source = text.str();
+        Diagnostics located(source);
+        for (const Diagnostic &diagnostic : all)
+        {
+            located.error(diagnostic.offset, diagnostic.message);
+        }
+        return located.take();
+    }
+};
+
+// Value types in promotion order: arithmetic on two operands is carried out in
+// the higher of their types, and never below int.
+enum ValueType : uint8_t
+{
+    VT_BOOL,
+    VT_CHAR,
+    VT_INT,
+    VT_FLOAT,
+    VT_DOUBLE,
+};
+
+const char *valueTypeName(ValueType type)
+{
+    switch (type)
+    {
+    case VT_BOOL: return "bool";
+    case VT_CHAR: return "char";
+    case VT_INT: return "int";
+    case VT_FLOAT: return "float";
+    case VT_DOUBLE: return "double";
+    }
+    return "?";
+}
+
+ValueType valueTypeOf(TokenType declared)
+{
+    switch (declared)
+    {
+    case T_BOOLEAN: return VT_BOOL;
+    case T_CHAR: return VT_CHAR;
+    case T_FLOAT: return VT_FLOAT;
+    case T_DOUBLE: return VT_DOUBLE;
+    default: return VT_INT;
+    }
+}
+
+ValueType promote(ValueType a, ValueType b)
+{
+    ValueType wider = a > b ? a : b;
+    return wider < VT_INT ? VT_INT : wider;
+}
+
+inline bool isFloating(ValueType type)
+{
+    return type == VT_FLOAT || type == VT_DOUBLE;
+}
+
+enum IrOp : uint8_t
+{
+    IR_COPY,         // dest = a, converted to `type`
+    IR_ADD,          // dest = a op b, computed in `type`
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_MOD,
+    IR_EQ,           // dest (bool) = a cmp b, compared in `type`
+    IR_NEQ,
+    IR_LT,
+    IR_LTE,
+    IR_GT,
+    IR_GTE,
+    IR_NEG,          // dest = -a
+    IR_LABEL,        // dest: label number
+    IR_JUMP,         // goto label dest
+    IR_BRANCH_FALSE, // if a == 0 goto label dest
+    IR_BRANCH_TRUE,  // if a != 0 goto label dest
+    IR_RETURN,       // return a
+};
+
+// A three-address quadruple. Operands are tagged ids (see operandKind); for
+// labels and jumps `dest` is a label number.
+struct IrInstr
+{
+    IrOp op;
+    ValueType type;
+    uint16_t flags;
+    uint32_t dest;
+    uint32_t a;
+    uint32_t b;
+};
+
+// Operand ids carry their table in the top two bits so variables, temporaries
+// and constants share one dense 32-bit space.
+enum OperandKind : uint32_t
+{
+    OPERAND_VARIABLE = 0,
+    OPERAND_TEMPORARY = 1,
+    OPERAND_CONSTANT = 2,
+};
+
+const uint32_t OPERAND_SHIFT = 30;
+const uint32_t OPERAND_INDEX_MASK = (1u << OPERAND_SHIFT) - 1;
+const uint32_t NO_OPERAND = UINT32_MAX;
+
+inline uint32_t makeOperand(OperandKind kind, uint32_t index)
+{
+    return (static_cast<uint32_t>(kind) << OPERAND_SHIFT) | index;
+}
+
+inline OperandKind operandKind(uint32_t operand)
+{
+    return static_cast<OperandKind>(operand >> OPERAND_SHIFT);
+}
+
+inline uint32_t operandIndex(uint32_t operand)
+{
+    return operand & OPERAND_INDEX_MASK;
+}
+
+struct IrVariable
+{
+    uint32_t name; // id in IrModule::names
+    ValueType type;
+};
+
+struct IrConstant
+{
+    ValueType type;
+    int64_t i; // value for bool/char/int
+    double d;  // value for float/double
+};
+
+// The output of IR generation: code plus the operand tables it refers to.
+struct IrModule
+{
+    vector<IrInstr> code;
+    vector<IrVariable> variables;
+    vector<ValueType> temporaries;
+    vector<IrConstant> constants;
+    StringPool names;
+    map<pair<ValueType, int64_t>, uint32_t> constantIds;
+    uint32_t labelCount = 0;
+    uint32_t temporaryBase = 0; // printed number of temporaries[0], minus one
+    vector<uint32_t> regions;   // start of each top-level statement in code
+    bool full = false;          // a table outgrew the operand index space; the code is not usable
+
+    uint32_t operand(OperandKind kind, size_t index)
+    {
+        if (index > OPERAND_INDEX_MASK)
+            full = true;
+        return makeOperand(kind, static_cast<uint32_t>(index & OPERAND_INDEX_MASK));
+    }
+
+    ValueType typeOf(uint32_t operand) const
+    {
+        switch (operandKind(operand))
+        {
+        case OPERAND_VARIABLE: return variables[operandIndex(operand)].type;
+        case OPERAND_TEMPORARY: return temporaries[operandIndex(operand)];
+        default: return constants[operandIndex(operand)].type;
+        }
+    }
+
+    uint32_t temporary(ValueType type)
+    {
+        temporaries.push_back(type);
+        return operand(OPERAND_TEMPORARY, temporaries.size() - 1);
+    }
+
+    uint32_t constant(ValueType type, int64_t i, double d)
+    {
+        int64_t bits = i;
+        if (isFloating(type))
+            memcpy(&bits, &d, sizeof(bits));
+        auto found = constantIds.find({type, bits});
+        if (found != constantIds.end())
+            return found->second;
+        uint32_t id = operand(OPERAND_CONSTANT, constants.size());
+        constants.push_back({type, i, d});
+        constantIds[{type, bits}] = id;
+        return id;
+    }
+
+    uint32_t intConstant(int64_t value)
+    {
+        return constant(VT_INT, value, static_cast<double>(value));
+    }
+
+    uint32_t newLabel()
+    {
+        return labelCount++;
+    }
+
+    void emit(IrOp op, ValueType type, uint32_t dest, uint32_t a = NO_OPERAND, uint32_t b = NO_OPERAND)
+    {
+        code.push_back({op, type, 0, dest, a, b});
+    }
+
+    // Drops emitted code and its temporaries; variables, constants and the
+    // label/temporary numbering carry on. Used by the streaming pipeline.
+    void clearCode()
+    {
+        code.clear();
+        regions.clear();
+        temporaryBase += temporaries.size();
+        temporaries.clear();
+    }
+};
+
+// Shortest text that reads back as the same value (as a float when `single`).
+string formatDouble(double value, bool single = false)
+{
+    char text[32];
+    for (int precision = single ? 6 : 15; precision <= 17; precision++)
+    {
+        snprintf(text, sizeof(text), "%.*g", precision, value);
+        double back = strtod(text, nullptr);
+        if (single ? static_cast<float>(back) == static_cast<float>(value) : back == value)
+            break;
+    }
+    string result = text;
+    if (result.find_first_of(".eninf") == string::npos)
+        result += ".0";
+    return result;
+}
+
+string formatChar(int64_t value)
+{
+    switch (value)
+    {
+    case '\n': return "'\\n'";
+    case '\t': return "'\\t'";
+    case '\r': return "'\\r'";
+    case '\0': return "'\\0'";
+    case '\\': return "'\\\\'";
+    case '\'': return "'\\''";
+    }
+    if (value >= 32 && value < 127)
+        return string("'") + static_cast<char>(value) + "'";
+    return to_string(value);
+}
+
+string formatConstant(const IrConstant &c)
+{
+    switch (c.type)
+    {
+    case VT_BOOL: return c.i ? "true" : "false";
+    case VT_CHAR: return formatChar(c.i);
+    case VT_INT: return to_string(c.i);
+    default: return formatDouble(c.d, c.type == VT_FLOAT);
+    }
+}
+
+// The textual form of the IR, used for --ir output and debugging.
+class IrPrinter
+{
+private:
+    const IrModule &module;
+
+public:
+    IrPrinter(const IrModule &module) : module(module) {}
+
+    string operand(uint32_t id) const
+    {
+        uint32_t index = operandIndex(id);
+        switch (operandKind(id))
+        {
+        case OPERAND_VARIABLE:
+            return string(module.names.get(module.variables[index].name));
+        case OPERAND_TEMPORARY:
+            return "t" + to_string(module.temporaryBase + index + 1);
+        default:
+            return formatConstant(module.constants[index]);
+        }
+    }
+
+    static const char *opSymbol(IrOp op)
+    {
+        switch (op)
+        {
+        case IR_ADD: return "+";
+        case IR_SUB: return "-";
+        case IR_MUL: return "*";
+        case IR_DIV: return "/";
+        case IR_MOD: return "%";
+        case IR_EQ: return "==";
+        case IR_NEQ: return "!=";
+        case IR_LT: return "<";
+        case IR_LTE: return "<=";
+        case IR_GT: return ">";
+        case IR_GTE: return ">=";
+        default: return "?";
+        }
+    }
+
+    void print(const IrInstr &instr, ostream &out) const
+    {
+        switch (instr.op)
+        {
+        case IR_COPY:
+            out << operand(instr.dest) << " = " << operand(instr.a);
+            break;
+        case IR_NEG:
+            out << operand(instr.dest) << " = -" << operand(instr.a);
+            break;
+        case IR_LABEL:
+            out << "L" << instr.dest << ":";
+            break;
+        case IR_JUMP:
+            out << "goto L" << instr.dest;
+            break;
+        case IR_BRANCH_FALSE:
+            out << "ifFalse " << operand(instr.a) << " goto L" << instr.dest;
+            break;
+        case IR_BRANCH_TRUE:
+            out << "if " << operand(instr.a) << " goto L" << instr.dest;
+            break;
+        case IR_RETURN:
+            out << "return " << operand(instr.a);
+            break;
+        default:
+            out << operand(instr.dest) << " = " << operand(instr.a) << " " << opSymbol(instr.op) << " " << operand(instr.b);
+            break;
+        }
+    }
+
+    void print(ostream &out) const
+    {
+        for (const IrInstr &instr : module.code)
+        {
+            if (instr.op != IR_LABEL)
+                out << "    ";
+            print(instr, out);
+            out << '\n';
+        }
+    }
+};
+
+// Binary form of an IrModule, laid out so a reader can map the file and use
+// the tables in place. Integers are little-endian and every section starts on
+// an 8-byte boundary. Sections are found through the header, so a later
+// version can append new ones without moving the old.
+const char IR_IMAGE_MAGIC[8] = {'I', 'R', 'I', 'M', 'A', 'G', 'E', '\0'};
+const uint32_t IR_IMAGE_VERSION = 1;
+
+struct IrImageSection
+{
+    uint64_t offset; // from the start of the image
+    uint64_t count;  // entries; bytes for the string section
+};
+
+struct IrImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t labelCount;
+    uint32_t temporaryBase;
+    IrImageSection code;        // IrInstr
+    IrImageSection constants;   // IrImageConstant
+    IrImageSection variables;   // IrImageVariable
+    IrImageSection temporaries; // ValueType
+    IrImageSection regions;     // uint32_t
+    IrImageSection strings;     // variable names, back to back
+};
+
+struct IrImageConstant
+{
+    ValueType type;
+    uint8_t reserved[7];
+    int64_t i;
+    double d;
+};
+
+struct IrImageVariable
+{
+    uint32_t name;   // byte offset in the string section
+    uint32_t length;
+    ValueType type;
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(IrInstr) == 16 && sizeof(IrImageHeader) == 120 && sizeof(IrImageConstant) == 24 &&
+                  sizeof(IrImageVariable) == 12,
+              "IR image layout changed; bump IR_IMAGE_VERSION");
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "IR images are written in host byte order");
+
+string writeIrImage(const IrModule &module)
+{
+    IrImageHeader header = {};
+    memcpy(header.magic, IR_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IR_IMAGE_VERSION;
+    header.headerSize = sizeof(header);
+    header.labelCount = module.labelCount;
+    header.temporaryBase = module.temporaryBase;
+
+    size_t stringBytes = 0;
+    for (const IrVariable &variable : module.variables)
+    {
+        stringBytes += module.names.get(variable.name).size();
+    }
+    size_t size = sizeof(header);
+    auto place = [&](IrImageSection &section, size_t count, size_t width)
+    {
+        section.offset = size;
+        section.count = count;
+        size = (size + count * width + 7) & ~static_cast<size_t>(7);
+    };
+    place(header.code, module.code.size(), sizeof(IrInstr));
+    place(header.constants, module.constants.size(), sizeof(IrImageConstant));
+    place(header.variables, module.variables.size(), sizeof(IrImageVariable));
+    place(header.temporaries, module.temporaries.size(), sizeof(ValueType));
+    place(header.regions, module.regions.size(), sizeof(uint32_t));
+    place(header.strings, stringBytes, 1);
+
+    string image(size, '\0');
+    char *base = &image[0];
+    memcpy(base, &header, sizeof(header));
+    if (!module.code.empty())
+        memcpy(base + header.code.offset, module.code.data(), module.code.size() * sizeof(IrInstr));
+    for (size_t i = 0; i < module.constants.size(); i++)
+    {
+        const IrConstant &c = module.constants[i];
+        IrImageConstant entry = {c.type, {}, c.i, c.d};
+        memcpy(base + header.constants.offset + i * sizeof(entry), &entry, sizeof(entry));
+    }
+    uint32_t name = 0;
+    for (size_t i = 0; i < module.variables.size(); i++)
+    {
+        string_view text = module.names.get(module.variables[i].name);
+        IrImageVariable entry = {name, static_cast<uint32_t>(text.size()), module.variables[i].type, {}};
+        memcpy(base + header.variables.offset + i * sizeof(entry), &entry, sizeof(entry));
+        memcpy(base + header.strings.offset + name, text.data(), text.size());
+        name += text.size();
+    }
+    if (!module.temporaries.empty())
+        memcpy(base + header.temporaries.offset, module.temporaries.data(), module.temporaries.size());
+    if (!module.regions.empty())
+        memcpy(base + header.regions.offset, module.regions.data(), module.regions.size() * sizeof(uint32_t));
+    return image;
+}
+
+// A read-only view of an IR image, usually a mapped file. Nothing is copied
+// or decoded: open() checks the header and section bounds in constant time
+// and the accessors point into the buffer. verify() walks the tables and the
+// code once; until it has passed, only the header fields are safe to trust.
+class IrImage
+{
+private:
+    const char *base = nullptr;
+    const IrImageHeader *header = nullptr;
+
+    template <typename T> const T *section(const IrImageSection &s) const
+    {
+        return reinterpret_cast<const T *>(base + s.offset);
+    }
+
+    bool validOperand(uint32_t id) const
+    {
+        uint32_t index = operandIndex(id);
+        switch (operandKind(id))
+        {
+        case OPERAND_VARIABLE: return index < header->variables.count;
+        case OPERAND_TEMPORARY: return index < header->temporaries.count;
+        case OPERAND_CONSTANT: return index < header->constants.count;
+        default: return false;
+        }
+    }
+
+    void appendOperand(string &text, uint32_t id, const vector<string> &constantText) const
+    {
+        uint32_t index = operandIndex(id);
+        switch (operandKind(id))
+        {
+        case OPERAND_VARIABLE:
+            text += variableName(index);
+            break;
+        case OPERAND_TEMPORARY:
+            text += 't';
+            appendNumber(text, header->temporaryBase + index + 1);
+            break;
+        default:
+            text += constantText[index];
+            break;
+        }
+    }
+
+    static void appendNumber(string &text, uint32_t value)
+    {
+        char digits[16];
+        text.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+    }
+
+public:
+    // Fails with a message in `error` unless `bytes` holds an image of this
+    // version. `bytes` must be 8-byte aligned and outlive the view.
+    bool open(string_view bytes, string &error)
+    {
+        header = nullptr;
+        if (reinterpret_cast<uintptr_t>(bytes.data()) % 8 != 0)
+        {
+            error = "image buffer is not 8-byte aligned";
+            return false;
+        }
+        const IrImageHeader *h = reinterpret_cast<const IrImageHeader *>(bytes.data());
+        if (bytes.size() < sizeof(IrImageHeader) || memcmp(h->magic, IR_IMAGE_MAGIC, sizeof(h->magic)) != 0)
+        {
+            error = "not an IR image";
+            return false;
+        }
+        if (h->version != IR_IMAGE_VERSION || h->headerSize < sizeof(IrImageHeader))
+        {
+            error = "unsupported IR image version " + to_string(h->version);
+            return false;
+        }
+        const pair<const IrImageSection *, size_t> sections[] = {
+            {&h->code, sizeof(IrInstr)},         {&h->constants, sizeof(IrImageConstant)},
+            {&h->variables, sizeof(IrImageVariable)}, {&h->temporaries, sizeof(ValueType)},
+            {&h->regions, sizeof(uint32_t)},     {&h->strings, 1},
+        };
+        for (const auto &[s, width] : sections)
+        {
+            if (s->offset < h->headerSize || s->offset > bytes.size() || s->offset % 8 != 0 ||
+                s->count > (bytes.size() - s->offset) / width || s->count > OPERAND_INDEX_MASK)
+            {
+                error = "IR image section out of bounds";
+                return false;
+            }
+        }
+        base = bytes.data();
+        header = h;
+        return true;
+    }
+
+    bool verify(string &error) const
+    {
+        auto fail = [&](const string &message)
+        {
+            error = message;
+            return false;
+        };
+        for (size_t i = 0; i < header->variables.count; i++)
+        {
+            const IrImageVariable &v = variables()[i];
+            if (v.type > VT_DOUBLE || v.name > header->strings.count || v.length > header->strings.count - v.name)
+                return fail("bad variable " + to_string(i));
+        }
+        for (size_t i = 0; i < header->constants.count; i++)
+        {
+            if (constants()[i].type > VT_DOUBLE)
+                return fail("bad constant " + to_string(i));
+        }
+        for (size_t i = 0; i < header->temporaries.count; i++)
+        {
+            if (temporaries()[i] > VT_DOUBLE)
+                return fail("bad temporary " + to_string(i));
+        }
+        for (size_t i = 0; i < header->regions.count; i++)
+        {
+            if (regions()[i] > header->code.count || (i > 0 && regions()[i] < regions()[i - 1]))
+                return fail("bad region " + to_string(i));
+        }
+        for (size_t i = 0; i < header->code.count; i++)
+        {
+            const IrInstr &instr = code()[i];
+            bool ok = instr.op <= IR_RETURN && instr.type <= VT_DOUBLE;
+            switch (instr.op)
+            {
+            case IR_LABEL:
+            case IR_JUMP:
+                ok = ok && instr.dest < header->labelCount;
+                break;
+            case IR_BRANCH_FALSE:
+            case IR_BRANCH_TRUE:
+                ok = ok && instr.dest < header->labelCount && validOperand(instr.a);
+                break;
+            case IR_RETURN:
+                ok = ok && validOperand(instr.a);
+                break;
+            case IR_COPY:
+            case IR_NEG:
+                ok = ok && validOperand(instr.dest) && validOperand(instr.a);
+                break;
+            default:
+                ok = ok && validOperand(instr.dest) && validOperand(instr.a) && validOperand(instr.b);
+                break;
+            }
+            if (!ok)
+                return fail("bad instruction " + to_string(i));
+        }
+        return true;
+    }
+
+    size_t codeSize() const { return header->code.count; }
+    size_t constantCount() const { return header->constants.count; }
+    size_t variableCount() const { return header->variables.count; }
+    size_t temporaryCount() const { return header->temporaries.count; }
+    size_t regionCount() const { return header->regions.count; }
+    uint32_t labelCount() const { return header->labelCount; }
+
+    const IrInstr *code() const { return section<IrInstr>(header->code); }
+    const IrImageConstant *constants() const { return section<IrImageConstant>(header->constants); }
+    const IrImageVariable *variables() const { return section<IrImageVariable>(header->variables); }
+    const ValueType *temporaries() const { return section<ValueType>(header->temporaries); }
+    const uint32_t *regions() const { return section<uint32_t>(header->regions); }
+
+    string_view variableName(uint32_t index) const
+    {
+        const IrImageVariable &v = variables()[index];
+        return string_view(base + header->strings.offset + v.name, v.length);
+    }
+
+    // Writes the same text as IrPrinter, formatted into a buffer that is
+    // flushed in large blocks rather than streamed an operand at a time.
+    void dump(ostream &out) const
+    {
+        vector<string> constantText(header->constants.count);
+        for (size_t i = 0; i < constantText.size(); i++)
+        {
+            const IrImageConstant &c = constants()[i];
+            constantText[i] = formatConstant({c.type, c.i, c.d});
+        }
+
+        const size_t FLUSH_BYTES = 1 << 16;
+        string text;
+        text.reserve(FLUSH_BYTES + 256);
+        for (size_t i = 0; i < header->code.count; i++)
+        {
+            const IrInstr &instr = code()[i];
+            switch (instr.op)
+            {
+            case IR_COPY:
+            case IR_NEG:
+                text += "    ";
+                appendOperand(text, instr.dest, constantText);
+                text += instr.op == IR_NEG ? " = -" : " = ";
+                appendOperand(text, instr.a, constantText);
+                break;
+            case IR_LABEL:
+                text += 'L';
+                appendNumber(text, instr.dest);
+                text += ':';
+                break;
+            case IR_JUMP:
+                text += "    goto L";
+                appendNumber(text, instr.dest);
+                break;
+            case IR_BRANCH_FALSE:
+            case IR_BRANCH_TRUE:
+                text += instr.op == IR_BRANCH_FALSE ? "    ifFalse " : "    if ";
+                appendOperand(text, instr.a, constantText);
+                text += " goto L";
+                appendNumber(text, instr.dest);
+                break;
+            case IR_RETURN:
+                text += "    return ";
+                appendOperand(text, instr.a, constantText);
+                break;
+            default:
+                text += "    ";
+                appendOperand(text, instr.dest, constantText);
+                text += " = ";
+                appendOperand(text, instr.a, constantText);
+                text += ' ';
+                text += IrPrinter::opSymbol(instr.op);
+                text += ' ';
+                appendOperand(text, instr.b, constantText);
+                break;
+            }
+            text += '\n';
+            if (text.size() >= FLUSH_BYTES)
+            {
+                out.write(text.data(), text.size());
+                text.clear();
+            }
+        }
+        out.write(text.data(), text.size());
+    }
+};
+
+// A pending piece of lowering work. Fields x, y and z hold what the step
+// needs: labels, a target, a saved position.
+enum LowerStep : uint8_t
+{
+    LOWER_STATEMENT,       // node
+    LOWER_STATEMENTS,      // node: the first of a list
+    LOWER_LEAVE_BLOCK,     // x: shadowed entries to keep
+    LOWER_DECLARATORS,     // node: the first left, x: declared type
+    LOWER_ASSIGN,          // pops the value; x: target, y: operator
+    LOWER_IF_ELSE,         // node: the if, x: label of the else arm
+    LOWER_WHILE_END,       // x: loop top, y: exit
+    LOWER_FOR_LOOP,        // node: the for, after its init
+    LOWER_FOR_STEP,        // node: the for, x: top, y: step, z: exit
+    LOWER_RETURN,          // pops the value
+    LOWER_LABEL,           // x: label
+    LOWER_JUMP,            // x: label
+    LOWER_EXPRESSION,      // node; pushes its value
+    LOWER_NEGATE,          // node: the unary + or -; pops the operand
+    LOWER_ARITHMETIC,      // node: the binary operator; pops both operands
+    LOWER_LOGICAL,         // node: && or ||, x: false/true label, y: end, z: result
+    LOWER_TERNARY_THEN,    // node, x: else label, y: end; pops the then value
+    LOWER_TERNARY_ELSE,    // x: the then arm's copy, y: end; pops the else value
+    LOWER_BRANCH_FALSE,    // node: condition, x: label
+    LOWER_BRANCH_TRUE,     // node: condition, x: label
+    LOWER_BRANCH_ON_VALUE, // pops the condition; x: label, y: branch when true
+};
+
+struct LowerTask
+{
+    LowerStep step;
+    uint32_t node;
+    uint32_t x;
+    uint32_t y;
+    uint32_t z;
+};
+
+// Lowers the AST to three-address code with explicit labels and jumps.
+class ICGenerator
+{
+private:
+    IrModule module;
+    vector<uint32_t> variableOfName; // indexed by names id: the innermost visible variable
+    vector<uint32_t> variablesNamed; // indexed by names id
+    vector<uint32_t> variableDepth;  // indexed by variable: block depth of its declaration
+    vector<pair<uint32_t, uint32_t>> shadowed; // (name, variable hidden) for each block declaration
+    uint32_t blockDepth = 0;
+    vector<pair<uint32_t, uint32_t>> loops; // (break label, continue label)
+    vector<LowerTask> work;  // steps left, the next one last
+    vector<uint32_t> values; // results of lowered expressions not yet used
+    const vector<pair<uint32_t, ValueType>> *globals; // see lowerFrom()
+    uint32_t firstToken;
+    const AstArena *ast;
+    const TokenBuffer *tokens;
+    Diagnostics &diagnostics;
+
+    void error(const AstNode &node, const string &message)
+    {
+        diagnostics.error(tokens->offsets[node.token], message);
+    }
+
+    uint32_t nameOf(string_view text)
+    {
+        uint32_t name = module.names.intern(text);
+        if (name >= variableOfName.size())
+        {
+            variableOfName.resize(name + 1, NO_OPERAND);
+            variablesNamed.resize(name + 1, 0);
+        }
+        return name;
+    }
+
+    // A variable that reuses a name is listed with a suffix.
+    uint32_t addVariable(uint32_t name, string_view text, ValueType type, uint32_t depth)
+    {
+        uint32_t listed = name;
+        if (variablesNamed[name]++ > 0)
+            listed = module.names.intern(string(text) + "." + to_string(variablesNamed[name] - 1));
+        module.variables.push_back({listed, type});
+        variableDepth.push_back(depth);
+        return module.operand(OPERAND_VARIABLE, module.variables.size() - 1);
+    }
+
+    uint32_t variable(uint32_t token, ValueType declaredType, bool declaring)
+    {
+        uint32_t name = nameOf(tokens->text(token));
+        uint32_t visible = variableOfName[name];
+        if (visible != NO_OPERAND && (!declaring || variableDepth[operandIndex(visible)] == blockDepth))
+        {
+            if (declaring)
+                module.variables[operandIndex(visible)].type = declaredType;
+            return visible;
+        }
+
+        // A declaration inside a block gets its own variable, hidden again
+        // when the block ends. The parser rejects uses of names that are not
+        // in scope, so a use with no visible variable can only be of a
+        // global declared by an earlier part of the program (see
+        // lowerFrom()); adopt() joins the two.
+        ValueType type = declaredType;
+        if (!declaring)
+        {
+            if (!globals || (*globals)[tokens->values[token]].first >= firstToken)
+            {
+                diagnostics.error(tokens->offsets[token], "Identifier '" + string(tokens->text(token)) + "' not declared");
+                return module.intConstant(0);
+            }
+            type = (*globals)[tokens->values[token]].second;
+        }
+        uint32_t depth = declaring ? blockDepth : 0;
+        if (depth > 0)
+            shadowed.push_back({name, visible});
+        variableOfName[name] = addVariable(name, tokens->text(token), type, depth);
+        return variableOfName[name];
+    }
+
+    uint32_t literal(const AstNode &node)
+    {
+        string_view text = tokens->text(node.token);
+        switch (node.op)
+        {
+        case T_TRUE:
+            return module.constant(VT_BOOL, 1, 1.0);
+        case T_FALSE:
+            return module.constant(VT_BOOL, 0, 0.0);
+        case T_CHAR_LITERAL:
+        {
+            int64_t value = text.size() > 1 ? static_cast<unsigned char>(text[1]) : 0;
+            if (text.size() > 2 && text[1] == '\\')
+            {
+                switch (text[2])
+                {
+                case 'n': value = '\n'; break;
+                case 't': value = '\t'; break;
+                case 'r': value = '\r'; break;
+                case '0': value = '\0'; break;
+                default: value = static_cast<unsigned char>(text[2]); break;
+                }
+            }
+            return module.constant(VT_CHAR, value, static_cast<double>(value));
+        }
+        default:
+        {
+            string number(text);
+            if (number.find('.') != string::npos)
+            {
+                double value = strtod(number.c_str(), nullptr);
+                return module.constant(VT_DOUBLE, static_cast<int64_t>(value), value);
+            }
+            int64_t value = strtoll(number.c_str(), nullptr, 10);
+            return module.constant(VT_INT, value, static_cast<double>(value));
+        }
+        }
+    }
+
+    static IrOp binaryOp(TokenType op)
+    {
+        switch (op)
+        {
+        case T_PLUS: case T_PLUS_ASSIGN: case T_INCREMENT: return IR_ADD;
+        case T_MINUS: case T_MINUS_ASSIGN: case T_DECREMENT: return IR_SUB;
+        case T_MUL: case T_MUL_ASSIGN: return IR_MUL;
+        case T_DIV: case T_DIV_ASSIGN: return IR_DIV;
+        case T_MOD: return IR_MOD;
+        case T_EQ: return IR_EQ;
+        case T_NEQ: return IR_NEQ;
+        case T_LT: return IR_LT;
+        case T_LTE: return IR_LTE;
+        case T_GT: return IR_GT;
+        default: return IR_GTE;
+        }
+    }
+
+    static bool isComparison(IrOp op)
+    {
+        return op >= IR_EQ && op <= IR_GTE;
+    }
+
+    uint32_t arithmetic(IrOp op, uint32_t left, uint32_t right)
+    {
+        ValueType type = promote(module.typeOf(left), module.typeOf(right));
+        uint32_t temp = module.temporary(isComparison(op) ? VT_BOOL : type);
+        module.emit(op, type, temp, left, right);
+        return temp;
+    }
+
+    bool isLogical(uint32_t n, TokenType op) const
+    {
+        return n != NO_NODE && (*ast)[n].kind == N_BINARY && (*ast)[n].op == op;
+    }
+
+    // Stores `value op= target`-style updates and plain copies into `target`.
+    void assign(uint32_t target, TokenType op, uint32_t value)
+    {
+        ValueType type = module.typeOf(target);
+        if (op == T_ASSIGN)
+        {
+            module.emit(IR_COPY, type, target, value);
+            return;
+        }
+        IrOp arith = binaryOp(op);
+        module.emit(arith, promote(type, module.typeOf(value)), target, target, value);
+    }
+
+    void push(LowerStep step, uint32_t node, uint32_t x = 0, uint32_t y = 0, uint32_t z = 0)
+    {
+        work.push_back({step, node, x, y, z});
+    }
+
+    uint32_t popValue()
+    {
+        uint32_t value = values.back();
+        values.pop_back();
+        return value;
+    }
+
+    // Lowers a variable or literal at once, which spares the common operands
+    // a trip through the work stack. Only for the expression lowered next.
+    bool leaf(uint32_t n)
+    {
+        if (n == NO_NODE)
+            return false;
+        const AstNode &node = (*ast)[n];
+        if (node.kind == N_IDENTIFIER)
+            values.push_back(variable(node.token, VT_INT, false));
+        else if (node.kind == N_LITERAL)
+            values.push_back(literal(node));
+        else
+            return false;
+        return true;
+    }
+
+    // Lowers the expression at `n`, queueing what its operands need; its
+    // result is on the value stack once those steps have run. It never
+    // calls itself, so statements may call it directly.
+    void expression(uint32_t n)
+    {
+        if (n == NO_NODE)
+        {
+            // The parser already reported the malformed expression.
+            values.push_back(module.intConstant(0));
+            return;
+        }
+        const AstNode &node = (*ast)[n];
+        switch (node.kind)
+        {
+        case N_IDENTIFIER:
+            values.push_back(variable(node.token, VT_INT, false));
+            break;
+        case N_LITERAL:
+            values.push_back(literal(node));
+            break;
+        case N_UNARY:
+            if (node.op == T_INCREMENT || node.op == T_DECREMENT)
+            {
+                if (node.a == NO_NODE || (*ast)[node.a].kind != N_IDENTIFIER)
+                {
+                    error(node, string("Operand of ") + tokenSpelling(node.op) + " must be a variable");
+                    push(LOWER_EXPRESSION, node.a);
+                    break;
+                }
+                uint32_t target = variable((*ast)[node.a].token, VT_INT, false);
+                assign(target, node.op, module.intConstant(1));
+                values.push_back(target);
+                break;
+            }
+            push(LOWER_NEGATE, n);
+            if (!leaf(node.a))
+                push(LOWER_EXPRESSION, node.a);
+            break;
+        case N_POSTFIX:
+        {
+            if (node.a == NO_NODE || (*ast)[node.a].kind != N_IDENTIFIER)
+            {
+                error(node, string("Operand of ") + tokenSpelling(node.op) + " must be a variable");
+                push(LOWER_EXPRESSION, node.a);
+                break;
+            }
+            // The value is the variable's before the update.
+            uint32_t target = variable((*ast)[node.a].token, VT_INT, false);
+            ValueType type = module.typeOf(target);
+            uint32_t before = module.temporary(type);
+            module.emit(IR_COPY, type, before, target);
+            assign(target, node.op, module.intConstant(1));
+            values.push_back(before);
+            break;
+        }
+        case N_BINARY:
+            if (node.op == T_AND || node.op == T_OR)
+            {
+                // Materialized as a bool temporary through the branches.
+                uint32_t result = module.temporary(VT_BOOL);
+                uint32_t otherwise = module.newLabel();
+                uint32_t done = module.newLabel();
+                push(LOWER_LOGICAL, n, otherwise, done, result);
+                push(node.op == T_AND ? LOWER_BRANCH_FALSE : LOWER_BRANCH_TRUE, n, otherwise);
+                break;
+            }
+            if (leaf(node.a))
+            {
+                if (leaf(node.b))
+                {
+                    uint32_t right = popValue();
+                    uint32_t left = popValue();
+                    values.push_back(arithmetic(binaryOp(node.op), left, right));
+                    break;
+                }
+                push(LOWER_ARITHMETIC, n);
+                push(LOWER_EXPRESSION, node.b);
+                break;
+            }
+            push(LOWER_ARITHMETIC, n);
+            push(LOWER_EXPRESSION, node.b);
+            push(LOWER_EXPRESSION, node.a);
+            break;
+        case N_TERNARY:
+        {
+            uint32_t otherwise = module.newLabel();
+            uint32_t done = module.newLabel();
+            push(LOWER_TERNARY_THEN, n, otherwise, done);
+            push(LOWER_EXPRESSION, node.b);
+            push(LOWER_BRANCH_FALSE, node.a, otherwise);
+            break;
+        }
+        default:
+            error(node, "Unexpected node in expression");
+            values.push_back(module.intConstant(0));
+            break;
+        }
+    }
+
+    // Jumps to `label` when the condition at `n` is false (or true, with
+    // `whenTrue`), short-circuiting && and ||.
+    void branch(uint32_t n, uint32_t label, bool whenTrue)
+    {
+        LowerStep same = whenTrue ? LOWER_BRANCH_TRUE : LOWER_BRANCH_FALSE;
+        LowerStep opposite = whenTrue ? LOWER_BRANCH_FALSE : LOWER_BRANCH_TRUE;
+        if (isLogical(n, whenTrue ? T_OR : T_AND))
+        {
+            push(same, (*ast)[n].b, label);
+            push(same, (*ast)[n].a, label);
+        }
+        else if (isLogical(n, whenTrue ? T_AND : T_OR))
+        {
+            uint32_t skip = module.newLabel();
+            push(LOWER_LABEL, NO_NODE, skip);
+            push(same, (*ast)[n].b, label);
+            push(opposite, (*ast)[n].a, skip);
+        }
+        else
+        {
+            push(LOWER_BRANCH_ON_VALUE, NO_NODE, label, whenTrue);
+            expression(n);
+        }
+    }
+
+    void statement(uint32_t n)
+    {
+        if (n == NO_NODE)
+            return;
+        const AstNode &node = (*ast)[n];
+        switch (node.kind)
+        {
+        case N_PROGRAM:
+            push(LOWER_STATEMENTS, node.a);
+            break;
+        case N_BLOCK:
+            blockDepth++;
+            push(LOWER_LEAVE_BLOCK, n, shadowed.size());
+            push(LOWER_STATEMENTS, node.a);
+            break;
+        case N_DECLARATION:
+            push(LOWER_DECLARATORS, node.a, valueTypeOf(node.op));
+            break;
+        case N_ASSIGNMENT:
+        {
+            uint32_t target = variable(node.token, VT_INT, false);
+            if (node.op == T_INCREMENT || node.op == T_DECREMENT)
+                assign(target, node.op, module.intConstant(1));
+            else if (node.a != NO_NODE)
+            {
+                push(LOWER_ASSIGN, n, target, node.op);
+                expression(node.a);
+            }
+            break;
+        }
+        case N_IF:
+        {
+            uint32_t otherwise = module.newLabel();
+            push(LOWER_IF_ELSE, n, otherwise);
+            push(LOWER_STATEMENT, node.b);
+            push(LOWER_BRANCH_FALSE, node.a, otherwise);
+            break;
+        }
+        case N_WHILE:
+        {
+            uint32_t top = module.newLabel();
+            uint32_t done = module.newLabel();
+            module.emit(IR_LABEL, VT_INT, top);
+            loops.push_back({done, top});
+            push(LOWER_WHILE_END, n, top, done);
+            push(LOWER_STATEMENT, node.b);
+            push(LOWER_BRANCH_FALSE, node.a, done);
+            break;
+        }
+        case N_FOR:
+            push(LOWER_FOR_LOOP, n);
+            push(LOWER_STATEMENT, node.a);
+            break;
+        case N_RETURN:
+            push(LOWER_RETURN, n);
+            expression(node.a);
+            break;
+        case N_BREAK:
+        case N_CONTINUE:
+            if (loops.empty())
+            {
+                error(node, string(node.kind == N_BREAK ? "break" : "continue") + " outside of a loop");
+                break;
+            }
+            module.emit(IR_JUMP, VT_INT, node.kind == N_BREAK ? loops.back().first : loops.back().second);
+            break;
+        default:
+            error(node, "Unexpected node in statement");
+            break;
+        }
+    }
+
+    // Runs lowering steps until the work stack is back to `base` entries.
+    // Nesting grows these heap stacks rather than the call stack, so any
+    // depth the parser accepted can be lowered.
+    void run(size_t base)
+    {
+        while (work.size() > base)
+        {
+            LowerTask task = work.back();
+            work.pop_back();
+            // Steps that only emit carry no node->
+            const AstNode *node = task.node == NO_NODE ? nullptr : &(*ast)[task.node];
+            switch (task.step)
+            {
+            case LOWER_STATEMENT:
+                statement(task.node);
+                break;
+            case LOWER_STATEMENTS:
+                if (task.node != NO_NODE)
+                {
+                    push(LOWER_STATEMENTS, node->next);
+                    push(LOWER_STATEMENT, task.node);
+                }
+                break;
+            case LOWER_LEAVE_BLOCK:
+                blockDepth--;
+                while (shadowed.size() > task.x)
+                {
+                    variableOfName[shadowed.back().first] = shadowed.back().second;
+                    shadowed.pop_back();
+                }
+                break;
+            case LOWER_DECLARATORS:
+                if (task.node != NO_NODE)
+                {
+                    uint32_t target = variable(node->token, static_cast<ValueType>(task.x), true);
+                    push(LOWER_DECLARATORS, node->next, task.x);
+                    if (node->a != NO_NODE)
+                    {
+                        push(LOWER_ASSIGN, task.node, target, T_ASSIGN);
+                        expression(node->a);
+                    }
+                }
+                break;
+            case LOWER_ASSIGN:
+                assign(task.x, static_cast<TokenType>(task.y), popValue());
+                break;
+            case LOWER_IF_ELSE:
+                if (node->c != NO_NODE)
+                {
+                    uint32_t done = module.newLabel();
+                    module.emit(IR_JUMP, VT_INT, done);
+                    module.emit(IR_LABEL, VT_INT, task.x);
+                    push(LOWER_LABEL, NO_NODE, done);
+                    push(LOWER_STATEMENT, node->c);
+                }
+                else
+                {
+                    module.emit(IR_LABEL, VT_INT, task.x);
+                }
+                break;
+            case LOWER_WHILE_END:
+                loops.pop_back();
+                module.emit(IR_JUMP, VT_INT, task.x);
+                module.emit(IR_LABEL, VT_INT, task.y);
+                break;
+            case LOWER_FOR_LOOP:
+            {
+                const AstNode &step = (*ast)[node->c];
+                uint32_t top = module.newLabel();
+                uint32_t next = module.newLabel();
+                uint32_t done = module.newLabel();
+                module.emit(IR_LABEL, VT_INT, top);
+                loops.push_back({done, next});
+                push(LOWER_FOR_STEP, task.node, top, next, done);
+                push(LOWER_STATEMENT, step.b);
+                if (node->b != NO_NODE)
+                    push(LOWER_BRANCH_FALSE, node->b, done);
+                break;
+            }
+            case LOWER_FOR_STEP:
+                loops.pop_back();
+                module.emit(IR_LABEL, VT_INT, task.y);
+                push(LOWER_LABEL, NO_NODE, task.z);
+                push(LOWER_JUMP, NO_NODE, task.x);
+                push(LOWER_STATEMENTS, (*ast)[node->c].a);
+                break;
+            case LOWER_RETURN:
+                module.emit(IR_RETURN, VT_INT, NO_OPERAND, popValue());
+                break;
+            case LOWER_LABEL:
+                module.emit(IR_LABEL, VT_INT, task.x);
+                break;
+            case LOWER_JUMP:
+                module.emit(IR_JUMP, VT_INT, task.x);
+                break;
+            case LOWER_EXPRESSION:
+                expression(task.node);
+                break;
+            case LOWER_NEGATE:
+            {
+                uint32_t operand = popValue();
+                if (node->op == T_PLUS)
+                {
+                    values.push_back(operand);
+                    break;
+                }
+                ValueType type = promote(module.typeOf(operand), VT_INT);
+                uint32_t temp = module.temporary(type);
+                module.emit(IR_NEG, type, temp, operand);
+                values.push_back(temp);
+                break;
+            }
+            case LOWER_ARITHMETIC:
+            {
+                uint32_t right = popValue();
+                uint32_t left = popValue();
+                values.push_back(arithmetic(binaryOp(node->op), left, right));
+                break;
+            }
+            case LOWER_LOGICAL:
+            {
+                bool isAnd = node->op == T_AND;
+                module.emit(IR_COPY, VT_BOOL, task.z, module.constant(VT_BOOL, isAnd, isAnd));
+                module.emit(IR_JUMP, VT_INT, task.y);
+                module.emit(IR_LABEL, VT_INT, task.x);
+                module.emit(IR_COPY, VT_BOOL, task.z, module.constant(VT_BOOL, !isAnd, !isAnd));
+                module.emit(IR_LABEL, VT_INT, task.y);
+                values.push_back(task.z);
+                break;
+            }
+            case LOWER_TERNARY_THEN:
+            {
+                // The result type is only known after the else arm; the
+                // copy is patched then.
+                uint32_t thenCopy = module.code.size();
+                module.emit(IR_COPY, VT_INT, NO_OPERAND, popValue());
+                module.emit(IR_JUMP, VT_INT, task.y);
+                module.emit(IR_LABEL, VT_INT, task.x);
+                push(LOWER_TERNARY_ELSE, task.node, thenCopy, task.y);
+                push(LOWER_EXPRESSION, node->c);
+                break;
+            }
+            case LOWER_TERNARY_ELSE:
+            {
+                uint32_t elseValue = popValue();
+                IrInstr &thenCopy = module.code[task.x];
+                ValueType type = promote(module.typeOf(thenCopy.a), module.typeOf(elseValue));
+                uint32_t result = module.temporary(type);
+                thenCopy.dest = result;
+                thenCopy.type = type;
+                module.emit(IR_COPY, type, result, elseValue);
+                module.emit(IR_LABEL, VT_INT, task.y);
+                values.push_back(result);
+                break;
+            }
+            case LOWER_BRANCH_FALSE:
+            case LOWER_BRANCH_TRUE:
+                branch(task.node, task.x, task.step == LOWER_BRANCH_TRUE);
+                break;
+            case LOWER_BRANCH_ON_VALUE:
+                module.emit(task.y ? IR_BRANCH_TRUE : IR_BRANCH_FALSE, VT_INT, task.x, popValue());
+                break;
+            }
+        }
+    }
+
+    void lower(uint32_t n)
+    {
+        size_t base = work.size();
+        push(LOWER_STATEMENT, n);
+        run(base);
+    }
+
+public:
+    // Where the tables of a generator that lowered later statements on its
+    // own went in the one that adopted it.
+    struct Placement
+    {
+        vector<uint32_t> variables; // by the part's variable index
+        vector<uint32_t> constants; // by the part's constant index
+        uint32_t temporaryBase;
+        uint32_t labelBase;
+        size_t codeBase;
+    };
+
+    ICGenerator(Diagnostics &diagnostics)
+        : globals(nullptr), firstToken(0), ast(nullptr), tokens(nullptr), diagnostics(diagnostics)
+    {
+    }
+
+    // Appends code for the statement (or whole program) rooted at `root`.
+    void generate(const AstArena &ast, const TokenBuffer &tokens, uint32_t root)
+    {
+        this->ast = &ast;
+        this->tokens = &tokens;
+        if (root != NO_NODE && ast[root].kind == N_PROGRAM)
+        {
+            for (uint32_t n = ast[root].a; n != NO_NODE && !module.full; n = ast[n].next)
+            {
+                module.regions.push_back(module.code.size());
+                lower(n);
+                if (module.full)
+                    tooLarge(tokens.offsets[ast[n].token]);
+            }
+        }
+        else if (!module.full)
+        {
+            module.regions.push_back(module.code.size());
+            lower(root);
+            if (module.full)
+                tooLarge(tokens.offsets[ast[root].token]);
+        }
+    }
+
+    void tooLarge(uint32_t offset)
+    {
+        diagnostics.error(offset, "Program needs more than " + to_string(OPERAND_INDEX_MASK + 1ull) +
+                                      " variables, temporaries or constants");
+    }
+
+    // Makes this generator lower only the part of a program that starts at
+    // token `first`, for adopt() to join to the rest. `globals` has, by
+    // interned name, the token that declares it outside any block and the
+    // declared type; the part uses that type for a global declared before it.
+    void lowerFrom(const vector<pair<uint32_t, ValueType>> &globals, uint32_t first)
+    {
+        this->globals = &globals;
+        this->firstToken = first;
+    }
+
+    // Appends the tables of `part`, which lowered the statements that follow
+    // this generator's, numbered as if this generator had lowered them
+    // itself: the part's globals become the ones already here, and its other
+    // variables, constants, temporaries and labels follow those here in
+    // order. The code is only reserved; relocate() fills it in.
+    void adopt(const ICGenerator &part, Placement &placement)
+    {
+        const IrModule &from = part.module;
+        placement.variables.resize(from.variables.size());
+        for (size_t v = 0; v < from.variables.size(); v++)
+        {
+            // Identifiers hold no '.', so this drops the part's own suffix.
+            string_view text = from.names.get(from.variables[v].name);
+            text = text.substr(0, text.find('.'));
+            uint32_t name = nameOf(text);
+            uint32_t depth = part.variableDepth[v];
+            if (depth == 0 && variableOfName[name] != NO_OPERAND)
+            {
+                placement.variables[v] = variableOfName[name];
+                module.variables[operandIndex(variableOfName[name])].type = from.variables[v].type;
+                continue;
+            }
+            placement.variables[v] = addVariable(name, text, from.variables[v].type, depth);
+            if (depth == 0)
+                variableOfName[name] = placement.variables[v];
+        }
+
+        placement.constants.resize(from.constants.size());
+        for (size_t c = 0; c < from.constants.size(); c++)
+        {
+            const IrConstant &constant = from.constants[c];
+            placement.constants[c] = module.constant(constant.type, constant.i, constant.d);
+        }
+
+        placement.temporaryBase = static_cast<uint32_t>(module.temporaries.size());
+        module.temporaries.insert(module.temporaries.end(), from.temporaries.begin(), from.temporaries.end());
+        if (module.temporaries.size() > OPERAND_INDEX_MASK + 1ull)
+            module.full = true;
+        placement.labelBase = module.labelCount;
+        module.labelCount += from.labelCount;
+        placement.codeBase = module.code.size();
+        for (uint32_t region : from.regions)
+        {
+            module.regions.push_back(static_cast<uint32_t>(placement.codeBase + region));
+        }
+        module.code.resize(module.code.size() + from.code.size());
+    }
+
+    // Copies the code of an adopted part into the space adopt() reserved.
+    // Parts touch disjoint code, so several may be relocated at once.
+    void relocate(const ICGenerator &part, const Placement &placement)
+    {
+        auto operand = [&](uint32_t id)
+        {
+            if (id == NO_OPERAND)
+                return id;
+            switch (operandKind(id))
+            {
+            case OPERAND_VARIABLE: return placement.variables[operandIndex(id)];
+            case OPERAND_TEMPORARY: return makeOperand(OPERAND_TEMPORARY, operandIndex(id) + placement.temporaryBase);
+            default: return placement.constants[operandIndex(id)];
+            }
+        };
+        const vector<IrInstr> &from = part.module.code;
+        for (size_t i = 0; i < from.size(); i++)
+        {
+            IrInstr instr = from[i];
+            if (instr.op == IR_LABEL || instr.op == IR_JUMP || instr.op == IR_BRANCH_FALSE || instr.op == IR_BRANCH_TRUE)
+                instr.dest += placement.labelBase;
+            else
+                instr.dest = operand(instr.dest);
+            instr.a = operand(instr.a);
+            instr.b = operand(instr.b);
+            module.code[placement.codeBase + i] = instr;
+        }
+    }
+
+    IrModule &ir()
+    {
+        return module;
+    }
+
+    const IrModule &ir() const
+    {
+        return module;
+    }
+
+    void printInstructions(ostream &out = cout) const
+    {
+        IrPrinter(module).print(out);
+    }
+
+    void clearInstructions()
+    {
+        module.clearCode();
+    }
+};
+
+// Converts a constant to `type` the way an assignment would. Fails for
+// floating values that do not fit the integer range, which are left unfolded.
+bool convertConstant(const IrConstant &from, ValueType type, IrConstant &to)
+{
+    to.type = type;
+    if (isFloating(type))
+    {
+        double d = isFloating(from.type) ? from.d : static_cast<double>(from.i);
+        to.d = type == VT_FLOAT ? static_cast<double>(static_cast<float>(d)) : d;
+        to.i = 0;
+        return true;
+    }
+    int64_t i = from.i;
+    if (isFloating(from.type))
+    {
+        if (type == VT_BOOL)
+        {
+            i = from.d != 0;
+        }
+        else
+        {
+            if (!(from.d > -2147483649.0 && from.d < 2147483648.0))
+                return false;
+            i = static_cast<int64_t>(from.d);
+        }
+    }
+    switch (type)
+    {
+    case VT_BOOL: to.i = i != 0; break;
+    case VT_CHAR: to.i = static_cast<signed char>(static_cast<uint8_t>(i)); break;
+    default: to.i = static_cast<int32_t>(static_cast<uint32_t>(i)); break;
+    }
+    to.d = static_cast<double>(to.i);
+    return true;
+}
+
+// Evaluates a binary or unary instruction on constants in the operation type.
+// Fails where the result is undefined (division by zero, overflowing INT_MIN / -1).
+bool foldConstant(IrOp op, ValueType type, const IrConstant &left, const IrConstant &right, IrConstant &result)
+{
+    IrConstant a, b;
+    if (!convertConstant(left, type, a) || !convertConstant(right, type, b))
+        return false;
+    if (isFloating(type))
+    {
+        double value;
+        switch (op)
+        {
+        case IR_ADD: value = a.d + b.d; break;
+        case IR_SUB: value = a.d - b.d; break;
+        case IR_MUL: value = a.d * b.d; break;
+        case IR_DIV: value = a.d / b.d; break;
+        case IR_MOD: value = fmod(a.d, b.d); break;
+        case IR_NEG: value = -a.d; break;
+        case IR_EQ: result = {VT_BOOL, a.d == b.d, 0}; return true;
+        case IR_NEQ: result = {VT_BOOL, a.d != b.d, 0}; return true;
+        case IR_LT: result = {VT_BOOL, a.d < b.d, 0}; return true;
+        case IR_LTE: result = {VT_BOOL, a.d <= b.d, 0}; return true;
+        case IR_GT: result = {VT_BOOL, a.d > b.d, 0}; return true;
+        case IR_GTE: result = {VT_BOOL, a.d >= b.d, 0}; return true;
+        default: return false;
+        }
+        return convertConstant({VT_DOUBLE, 0, value}, type, result);
+    }
+    int64_t value;
+    switch (op)
+    {
+    case IR_ADD: value = a.i + b.i; break;
+    case IR_SUB: value = a.i - b.i; break;
+    case IR_MUL: value = a.i * b.i; break;
+    case IR_DIV:
+    case IR_MOD:
+        if (b.i == 0 || (a.i == INT32_MIN && b.i == -1))
+            return false;
+        value = op == IR_DIV ? a.i / b.i : a.i % b.i;
+        break;
+    case IR_NEG: value = -a.i; break;
+    case IR_EQ: value = a.i == b.i; type = VT_BOOL; break;
+    case IR_NEQ: value = a.i != b.i; type = VT_BOOL; break;
+    case IR_LT: value = a.i < b.i; type = VT_BOOL; break;
+    case IR_LTE: value = a.i <= b.i; type = VT_BOOL; break;
+    case IR_GT: value = a.i > b.i; type = VT_BOOL; break;
+    case IR_GTE: value = a.i >= b.i; type = VT_BOOL; break;
+    default: return false;
+    }
+    return convertConstant({VT_INT, value, 0}, type, result);
+}
+
+// Sparse conditional constant propagation over the three-address code. Each
+// top-level statement is analysed as one region: the values of variables flow
+// from one region into the next, while branches and loops are resolved inside
+// the region with a worklist over its basic blocks. Afterwards constants are
+// substituted, folded expressions become copies, branches with a known
+// condition become jumps (or vanish), and unreachable code, unused
+// temporaries and redundant jumps/labels are deleted. The block states are
+// dense, and a loop nest is revisited once per level, so a region whose
+// states or visits outgrow a budget is left as it is, its variables unknown
+// afterwards.
+class IrOptimizer
+{
+private:
+    enum LatticeState : uint8_t
+    {
+        L_UNDEFINED, // no value seen yet (optimistic)
+        L_CONSTANT,
+        L_VARYING,
+    };
+
+    struct LatticeValue
+    {
+        LatticeState state;
+        IrConstant value;
+    };
+
+    struct Block
+    {
+        uint32_t begin;
+        uint32_t end;
+        bool reached;
+        bool queued;
+    };
+
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+    static constexpr size_t STATE_LIMIT = 1 << 25; // lattice values kept for one region
+    static constexpr size_t VISIT_LIMIT = 16;      // analyses of each block, on average
+
+    IrModule *module;
+    vector<LatticeValue> variableValues; // per variable, at the start of the next region
+    bool unreachable;                    // an earlier region never falls through
+
+    // Per-region scratch, reused between regions.
+    vector<uint32_t> variableSlot;
+    vector<uint32_t> temporarySlot;
+    vector<uint32_t> slotOperands;
+    vector<uint32_t> labelBlock;
+    vector<Block> blocks;
+    vector<LatticeValue> blockStates; // blocks.size() + 1 rows of slot values
+    vector<uint32_t> worklist; // a min-heap: blocks run in code order
+    vector<uint32_t> temporaryUses;
+    vector<bool> labelReferenced;
+
+    size_t instructionsIn;
+    size_t instructionsOut;
+    size_t regionsSkipped;
+
+    uint32_t &slotEntry(uint32_t operand)
+    {
+        uint32_t index = operandIndex(operand);
+        vector<uint32_t> &slots = operandKind(operand) == OPERAND_VARIABLE ? variableSlot : temporarySlot;
+        if (index >= slots.size())
+            slots.resize(index + 1, NO_SLOT);
+        return slots[index];
+    }
+
+    void addSlot(uint32_t operand)
+    {
+        if (operand == NO_OPERAND || operandKind(operand) == OPERAND_CONSTANT)
+            return;
+        uint32_t &slot = slotEntry(operand);
+        if (slot == NO_SLOT)
+        {
+            slot = slotOperands.size();
+            slotOperands.push_back(operand);
+        }
+    }
+
+    static bool hasDest(const IrInstr &instr)
+    {
+        return instr.op <= IR_NEG;
+    }
+
+    static bool endsBlock(const IrInstr &instr)
+    {
+        return instr.op == IR_JUMP || instr.op == IR_BRANCH_FALSE || instr.op == IR_BRANCH_TRUE || instr.op == IR_RETURN;
+    }
+
+    LatticeValue *state(uint32_t block)
+    {
+        return blockStates.data() + static_cast<size_t>(block) * slotOperands.size();
+    }
+
+    LatticeValue valueOf(uint32_t operand, const LatticeValue *values)
+    {
+        if (operandKind(operand) == OPERAND_CONSTANT)
+            return {L_CONSTANT, module->constants[operandIndex(operand)]};
+        return values[slotEntry(operand)];
+    }
+
+    // Computes the value an instruction with a destination stores, converted
+    // to the destination's type.
+    LatticeValue evaluate(const IrInstr &instr, const LatticeValue *values)
+    {
+        LatticeValue a = valueOf(instr.a, values);
+        LatticeValue b = instr.b == NO_OPERAND ? a : valueOf(instr.b, values);
+        if (a.state == L_VARYING || b.state == L_VARYING)
+            return {L_VARYING, {}};
+        if (a.state == L_UNDEFINED || b.state == L_UNDEFINED)
+            return {L_UNDEFINED, {}};
+
+        IrConstant result = a.value;
+        if (instr.op != IR_COPY && !foldConstant(instr.op, instr.type, a.value, b.value, result))
+            return {L_VARYING, {}};
+        IrConstant stored;
+        if (!convertConstant(result, module->typeOf(instr.dest), stored))
+            return {L_VARYING, {}};
+        return {L_CONSTANT, stored};
+    }
+
+    static bool isTrue(const IrConstant &value)
+    {
+        return isFloating(value.type) ? value.d != 0 : value.i != 0;
+    }
+
+    static bool sameConstant(const IrConstant &a, const IrConstant &b)
+    {
+        if (a.type != b.type)
+            return false;
+        return isFloating(a.type) ? memcmp(&a.d, &b.d, sizeof(double)) == 0 : a.i == b.i;
+    }
+
+    void flowInto(uint32_t target, const LatticeValue *values)
+    {
+        size_t slots = slotOperands.size();
+        LatticeValue *into = state(target);
+        if (!blocks[target].reached)
+        {
+            blocks[target].reached = true;
+            copy(values, values + slots, into);
+            enqueue(target);
+            return;
+        }
+        bool changed = false;
+        for (size_t i = 0; i < slots; i++)
+        {
+            const LatticeValue &from = values[i];
+            LatticeValue &to = into[i];
+            if (from.state == L_UNDEFINED || to.state == L_VARYING)
+                continue;
+            if (to.state == L_UNDEFINED)
+                to = from;
+            else if (from.state == L_VARYING || !sameConstant(from.value, to.value))
+                to.state = L_VARYING;
+            else
+                continue;
+            changed = true;
+        }
+        if (changed)
+            enqueue(target);
+    }
+
+    // Running the earliest pending block first lets a loop nest settle in
+    // a few sweeps; taking the latest revisits inner loops once per change
+    // to an outer one.
+    void enqueue(uint32_t block)
+    {
+        if (blocks[block].queued)
+            return;
+        blocks[block].queued = true;
+        worklist.push_back(block);
+        push_heap(worklist.begin(), worklist.end(), greater<uint32_t>());
+    }
+
+    // Whether a branch is taken: 0 never, 1 always, 2 either way.
+    int branchOutcome(const IrInstr &instr, const LatticeValue *values)
+    {
+        LatticeValue condition = valueOf(instr.a, values);
+        if (condition.state != L_CONSTANT)
+            return 2;
+        return isTrue(condition.value) == (instr.op == IR_BRANCH_TRUE);
+    }
+
+    // Returns false if the analysis ran over budget.
+    bool analyse(const vector<IrInstr> &code)
+    {
+        size_t slots = slotOperands.size();
+        uint32_t exitBlock = blocks.size() - 1;
+        vector<LatticeValue> current(slots);
+        size_t visits = 0;
+        while (!worklist.empty())
+        {
+            if (++visits > VISIT_LIMIT * blocks.size())
+            {
+                worklist.clear();
+                return false;
+            }
+            pop_heap(worklist.begin(), worklist.end(), greater<uint32_t>());
+            uint32_t b = worklist.back();
+            worklist.pop_back();
+            blocks[b].queued = false;
+            copy(state(b), state(b) + slots, current.begin());
+
+            const Block &block = blocks[b];
+            bool fallsThrough = true;
+            for (uint32_t i = block.begin; i < block.end; i++)
+            {
+                const IrInstr &instr = code[i];
+                if (hasDest(instr))
+                {
+                    current[slotEntry(instr.dest)] = evaluate(instr, current.data());
+                }
+                else if (instr.op == IR_JUMP)
+                {
+                    flowInto(labelBlock[instr.dest], current.data());
+                    fallsThrough = false;
+                }
+                else if (instr.op == IR_BRANCH_FALSE || instr.op == IR_BRANCH_TRUE)
+                {
+                    int outcome = branchOutcome(instr, current.data());
+                    if (outcome != 0)
+                        flowInto(labelBlock[instr.dest], current.data());
+                    fallsThrough = outcome != 1;
+                }
+                else if (instr.op == IR_RETURN)
+                {
+                    fallsThrough = false;
+                }
+            }
+            if (fallsThrough && b != exitBlock)
+                flowInto(b + 1, current.data());
+        }
+        return true;
+    }
+
+    uint32_t constantOperand(const IrConstant &value)
+    {
+        return module->constant(value.type, value.i, value.d);
+    }
+
+    // Replays each reachable block with its entry values and writes the
+    // simplified instructions to `out`.
+    void rewrite(const vector<IrInstr> &code, vector<IrInstr> &out)
+    {
+        size_t slots = slotOperands.size();
+        vector<LatticeValue> current(slots);
+        for (uint32_t b = 0; b + 1 < blocks.size(); b++)
+        {
+            const Block &block = blocks[b];
+            if (!block.reached)
+                continue;
+            copy(state(b), state(b) + slots, current.begin());
+            for (uint32_t i = block.begin; i < block.end; i++)
+            {
+                IrInstr instr = code[i];
+                if (hasDest(instr))
+                {
+                    LatticeValue result = evaluate(instr, current.data());
+                    if (result.state == L_CONSTANT)
+                    {
+                        instr.op = IR_COPY;
+                        instr.type = result.value.type;
+                        instr.a = constantOperand(result.value);
+                        instr.b = NO_OPERAND;
+                    }
+                    else
+                    {
+                        substitute(instr.a, current.data());
+                        substitute(instr.b, current.data());
+                    }
+                    current[slotEntry(instr.dest)] = result;
+                }
+                else if (instr.op == IR_BRANCH_FALSE || instr.op == IR_BRANCH_TRUE)
+                {
+                    int outcome = branchOutcome(instr, current.data());
+                    if (outcome == 0)
+                        continue;
+                    if (outcome == 1)
+                        instr = {IR_JUMP, VT_INT, 0, instr.dest, NO_OPERAND, NO_OPERAND};
+                    else
+                        substitute(instr.a, current.data());
+                }
+                else if (instr.op == IR_RETURN)
+                {
+                    substitute(instr.a, current.data());
+                }
+                out.push_back(instr);
+            }
+        }
+    }
+
+    void substitute(uint32_t &operand, const LatticeValue *values)
+    {
+        if (operand == NO_OPERAND || operandKind(operand) == OPERAND_CONSTANT)
+            return;
+        const LatticeValue &value = values[slotEntry(operand)];
+        if (value.state == L_CONSTANT)
+            operand = constantOperand(value.value);
+    }
+
+    // Removes computations into temporaries nobody reads. Temporaries are
+    // always defined before (in code order) they are used, so one backward
+    // pass sees every use before the definition.
+    void removeDeadTemporaries(vector<IrInstr> &out, size_t begin)
+    {
+        if (temporaryUses.size() < module->temporaries.size())
+            temporaryUses.resize(module->temporaries.size(), 0);
+        for (size_t i = begin; i < out.size(); i++)
+        {
+            countUse(out[i].a, 1);
+            countUse(out[i].b, 1);
+        }
+        size_t keep = out.size();
+        for (size_t i = out.size(); i-- > begin;)
+        {
+            const IrInstr &instr = out[i];
+            if (hasDest(instr) && operandKind(instr.dest) == OPERAND_TEMPORARY &&
+                temporaryUses[operandIndex(instr.dest)] == 0)
+            {
+                countUse(instr.a, -1);
+                countUse(instr.b, -1);
+                continue;
+            }
+            out[--keep] = instr;
+        }
+        out.erase(out.begin() + begin, out.begin() + keep);
+        for (size_t i = begin; i < out.size(); i++)
+        {
+            countUse(out[i].a, 0);
+            countUse(out[i].b, 0);
+        }
+    }
+
+    // Adds `delta` to the use count of a temporary; 0 resets it.
+    void countUse(uint32_t operand, int delta)
+    {
+        if (operand == NO_OPERAND || operandKind(operand) != OPERAND_TEMPORARY)
+            return;
+        uint32_t &uses = temporaryUses[operandIndex(operand)];
+        uses = delta == 0 ? 0 : uses + delta;
+    }
+
+    // Drops jumps and branches to the label that immediately follows, and
+    // labels nothing jumps to any more.
+    void removeRedundantJumps(vector<IrInstr> &out, size_t begin)
+    {
+        size_t keep = begin;
+        for (size_t i = begin; i < out.size(); i++)
+        {
+            if (out[i].op == IR_JUMP || out[i].op == IR_BRANCH_FALSE || out[i].op == IR_BRANCH_TRUE)
+            {
+                size_t next = i + 1;
+                while (next < out.size() && out[next].op == IR_LABEL && out[next].dest != out[i].dest)
+                    next++;
+                if (next < out.size() && out[next].op == IR_LABEL)
+                    continue;
+            }
+            out[keep++] = out[i];
+        }
+        out.resize(keep);
+
+        labelReferenced.resize(module->labelCount);
+        for (size_t i = begin; i < out.size(); i++)
+        {
+            if (out[i].op == IR_JUMP || out[i].op == IR_BRANCH_FALSE || out[i].op == IR_BRANCH_TRUE)
+                labelReferenced[out[i].dest] = true;
+        }
+        keep = begin;
+        for (size_t i = begin; i < out.size(); i++)
+        {
+            if (out[i].op == IR_LABEL && !labelReferenced[out[i].dest])
+                continue;
+            out[keep++] = out[i];
+        }
+        out.resize(keep);
+    }
+
+    // Copies a region unanalysed; whatever it stores is unknown after it.
+    void skipRegion(const vector<IrInstr> &code, size_t begin, size_t end, vector<IrInstr> &out)
+    {
+        regionsSkipped++;
+        out.insert(out.end(), code.begin() + begin, code.begin() + end);
+        if (variableValues.size() < module->variables.size())
+            variableValues.resize(module->variables.size(), {L_VARYING, {}});
+        for (uint32_t operand : slotOperands)
+        {
+            slotEntry(operand) = NO_SLOT;
+            if (operandKind(operand) == OPERAND_VARIABLE)
+                variableValues[operandIndex(operand)] = {L_VARYING, {}};
+        }
+    }
+
+    void optimizeRegion(const vector<IrInstr> &code, size_t begin, size_t end, vector<IrInstr> &out)
+    {
+        if (unreachable)
+            return;
+
+        slotOperands.clear();
+        blocks.clear();
+        if (labelBlock.size() < module->labelCount)
+            labelBlock.resize(module->labelCount);
+        for (size_t i = begin; i < end; i++)
+        {
+            const IrInstr &instr = code[i];
+            if (instr.op == IR_LABEL || blocks.empty() || endsBlock(code[i - 1]))
+            {
+                if (!blocks.empty())
+                    blocks.back().end = i;
+                blocks.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(end), false, false});
+            }
+            if (instr.op == IR_LABEL)
+                labelBlock[instr.dest] = blocks.size() - 1;
+            else if (hasDest(instr))
+                addSlot(instr.dest);
+            addSlot(instr.a);
+            addSlot(instr.b);
+        }
+        // An empty block standing for "falls off the end of the region".
+        blocks.push_back({static_cast<uint32_t>(end), static_cast<uint32_t>(end), false, false});
+
+        size_t slots = slotOperands.size();
+        if (blocks.size() * slots > STATE_LIMIT)
+        {
+            skipRegion(code, begin, end, out);
+            return;
+        }
+        blockStates.assign(blocks.size() * slots, {L_UNDEFINED, {}});
+        vector<LatticeValue> entry(slots, {L_UNDEFINED, {}});
+        for (size_t s = 0; s < slots; s++)
+        {
+            uint32_t operand = slotOperands[s];
+            if (operandKind(operand) == OPERAND_VARIABLE)
+            {
+                uint32_t index = operandIndex(operand);
+                entry[s] = index < variableValues.size() ? variableValues[index] : LatticeValue{L_VARYING, {}};
+            }
+        }
+        flowInto(0, entry.data());
+        if (!analyse(code))
+        {
+            for (Block &block : blocks)
+                block.queued = false;
+            skipRegion(code, begin, end, out);
+            return;
+        }
+
+        size_t start = out.size();
+        rewrite(code, out);
+        removeRedundantJumps(out, start);
+        removeDeadTemporaries(out, start);
+
+        const Block &exit = blocks.back();
+        if (!exit.reached)
+            unreachable = true;
+        if (variableValues.size() < module->variables.size())
+            variableValues.resize(module->variables.size(), {L_VARYING, {}});
+        for (size_t s = 0; s < slots; s++)
+        {
+            uint32_t operand = slotOperands[s];
+            slotEntry(operand) = NO_SLOT;
+            if (exit.reached && operandKind(operand) == OPERAND_VARIABLE)
+            {
+                LatticeValue value = state(blocks.size() - 1)[s];
+                variableValues[operandIndex(operand)] =
+                    value.state == L_CONSTANT ? value : LatticeValue{L_VARYING, {}};
+            }
+        }
+        for (size_t i = start; i < out.size(); i++)
+        {
+            if (out[i].op == IR_JUMP || out[i].op == IR_BRANCH_FALSE || out[i].op == IR_BRANCH_TRUE)
+                labelReferenced[out[i].dest] = false;
+        }
+    }
+
+public:
+    IrOptimizer() : module(nullptr), unreachable(false), instructionsIn(0), instructionsOut(0), regionsSkipped(0) {}
+
+    // Optimizes all code currently in `module`. Variable values carry over to
+    // the next call, so the streaming pipeline can optimize statement by
+    // statement.
+    void optimize(IrModule &module)
+    {
+        this->module = &module;
+        vector<IrInstr> out;
+        out.reserve(module.code.size());
+        vector<uint32_t> regions;
+        for (size_t r = 0; r < module.regions.size(); r++)
+        {
+            size_t begin = module.regions[r];
+            size_t end = r + 1 < module.regions.size() ? module.regions[r + 1] : module.code.size();
+            regions.push_back(out.size());
+            if (end > begin)
+                optimizeRegion(module.code, begin, end, out);
+        }
+        instructionsIn += module.code.size();
+        instructionsOut += out.size();
+        module.code.swap(out);
+        module.regions.swap(regions);
+    }
+
+    void printSummary(ostream &out = cout) const
+    {
+        out << "Optimization removed " << instructionsIn - instructionsOut << " of " << instructionsIn
+             << " instructions" << endl;
+        if (regionsSkipped > 0)
+            out << "Optimization skipped " << regionsSkipped << " statements too large to analyse" << endl;
+    }
+};
+
+// Moves loop-invariant computations out of loops. Each region gets a control
+// flow graph over its basic blocks and a dominator tree, built with the
+// iterative algorithm of Cooper, Harvey and Kennedy. An edge into a block
+// that dominates its source closes a natural loop: that header and every
+// block reaching the edge without passing through it. A computation moves to
+// just before the header of the outermost loop it is invariant in when
+//   - each operand is a constant, a value the loop never stores to, or a
+//     temporary computed by an instruction that moves along with it;
+//   - it is the only store to its temporary, and only the loop reads that;
+//   - it cannot trap, since it now runs even if the loop body never does;
+//   - the loop is only entered by falling into its header, so the code in
+//     front of the header's label is a preheader.
+// Every loop lists its blocks, which for a deep nest adds up quadratically,
+// so a region whose loops list too many is left as it is.
+class LoopOptimizer
+{
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr size_t MEMBER_LIMIT = 1 << 22; // blocks listed by the loops of one region
+
+    struct Block
+    {
+        uint32_t begin;
+        uint32_t end;
+        uint32_t successors[2]; // NONE where there is none
+    };
+
+    struct Loop
+    {
+        uint32_t header;
+        vector<uint32_t> blocks; // in code order, the header first
+        bool preheader;          // only entered by falling into the header
+    };
+
+    IrModule *module;
+
+    // Per-region scratch, reused between regions.
+    vector<Block> blocks;
+    vector<uint32_t> labelBlock;
+    vector<uint32_t> predecessorStart; // predecessors of block b: [start[b], start[b + 1])
+    vector<uint32_t> predecessors;
+    vector<uint32_t> order;      // reachable blocks in reverse postorder
+    vector<uint32_t> orderIndex; // by block, NONE if unreachable
+    vector<uint32_t> idom;
+    vector<uint32_t> treeEnter; // dominator tree preorder and postorder numbers
+    vector<uint32_t> treeLeave;
+    vector<Loop> loops;
+    vector<uint32_t> stores;    // by value: stores inside the current loop
+    vector<uint32_t> storedAt;  // by value: the last of those
+    vector<uint32_t> reads;     // by temporary: reads in the region
+    vector<uint32_t> loopReads; // by temporary: reads inside the current loop
+    vector<uint32_t> invariantIn; // by instruction: innermost loop being checked that it is invariant in
+    vector<uint32_t> hoistTo;     // by instruction: loop to move in front of, NONE to stay
+
+    size_t loopsFound;
+    size_t instructionsHoisted;
+    size_t regionsSkipped;
+
+    static bool hasDest(const IrInstr &instr)
+    {
+        return instr.op <= IR_NEG;
+    }
+
+    static bool endsBlock(const IrInstr &instr)
+    {
+        return instr.op == IR_JUMP || instr.op == IR_BRANCH_FALSE || instr.op == IR_BRANCH_TRUE || instr.op == IR_RETURN;
+    }
+
+    // Variables and temporaries share one index space; NONE for constants.
+    uint32_t valueIndex(uint32_t operand) const
+    {
+        if (operand == NO_OPERAND)
+            return NONE;
+        switch (operandKind(operand))
+        {
+        case OPERAND_VARIABLE: return operandIndex(operand);
+        case OPERAND_TEMPORARY: return module->variables.size() + operandIndex(operand);
+        default: return NONE;
+        }
+    }
+
+    bool dominates(uint32_t a, uint32_t b) const
+    {
+        return treeEnter[a] <= treeEnter[b] && treeLeave[b] <= treeLeave[a];
+    }
+
+    uint32_t intersect(uint32_t a, uint32_t b) const
+    {
+        while (a != b)
+        {
+            while (orderIndex[a] > orderIndex[b])
+                a = idom[a];
+            while (orderIndex[b] > orderIndex[a])
+                b = idom[b];
+        }
+        return a;
+    }
+
+    void buildGraph(const vector<IrInstr> &code, size_t begin, size_t end)
+    {
+        blocks.clear();
+        if (labelBlock.size() < module->labelCount)
+            labelBlock.resize(module->labelCount);
+        for (size_t i = begin; i < end; i++)
+        {
+            if (code[i].op == IR_LABEL || blocks.empty() || endsBlock(code[i - 1]))
+            {
+                if (!blocks.empty())
+                    blocks.back().end = i;
+                blocks.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(end), {NONE, NONE}});
+            }
+            if (code[i].op == IR_LABEL)
+                labelBlock[code[i].dest] = blocks.size() - 1;
+        }
+
+        uint32_t count = blocks.size();
+        predecessorStart.assign(count + 1, 0);
+        for (uint32_t b = 0; b < count; b++)
+        {
+            const IrInstr &last = code[blocks[b].end - 1];
+            uint32_t next = b + 1 < count ? b + 1 : NONE;
+            if (last.op == IR_JUMP)
+                blocks[b].successors[0] = labelBlock[last.dest];
+            else if (last.op == IR_BRANCH_FALSE || last.op == IR_BRANCH_TRUE)
+            {
+                blocks[b].successors[0] = labelBlock[last.dest];
+                blocks[b].successors[1] = next;
+            }
+            else if (last.op != IR_RETURN)
+                blocks[b].successors[0] = next;
+            for (uint32_t s : blocks[b].successors)
+            {
+                if (s != NONE)
+                    predecessorStart[s + 1]++;
+            }
+        }
+        for (uint32_t b = 0; b < count; b++)
+        {
+            predecessorStart[b + 1] += predecessorStart[b];
+        }
+        predecessors.resize(predecessorStart[count]);
+        vector<uint32_t> fill(predecessorStart.begin(), predecessorStart.end() - 1);
+        for (uint32_t b = 0; b < count; b++)
+        {
+            for (uint32_t s : blocks[b].successors)
+            {
+                if (s != NONE)
+                    predecessors[fill[s]++] = b;
+            }
+        }
+    }
+
+    void buildDominators()
+    {
+        uint32_t count = blocks.size();
+        order.clear();
+        orderIndex.assign(count, NONE);
+        vector<pair<uint32_t, uint32_t>> stack{{0, 0}}; // (block, successors visited)
+        orderIndex[0] = 0;
+        while (!stack.empty())
+        {
+            uint32_t b = stack.back().first;
+            if (stack.back().second == 2)
+            {
+                order.push_back(b);
+                stack.pop_back();
+                continue;
+            }
+            uint32_t s = blocks[b].successors[stack.back().second++];
+            if (s != NONE && orderIndex[s] == NONE)
+            {
+                orderIndex[s] = 0;
+                stack.push_back({s, 0});
+            }
+        }
+        reverse(order.begin(), order.end());
+        for (uint32_t k = 0; k < order.size(); k++)
+        {
+            orderIndex[order[k]] = k;
+        }
+
+        idom.assign(count, NONE);
+        idom[0] = 0;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (uint32_t k = 1; k < order.size(); k++)
+            {
+                uint32_t b = order[k];
+                uint32_t chosen = NONE;
+                for (uint32_t p = predecessorStart[b]; p < predecessorStart[b + 1]; p++)
+                {
+                    uint32_t from = predecessors[p];
+                    if (idom[from] != NONE)
+                        chosen = chosen == NONE ? from : intersect(from, chosen);
+                }
+                if (idom[b] != chosen)
+                {
+                    idom[b] = chosen;
+                    changed = true;
+                }
+            }
+        }
+
+        // Number the tree depth-first, so dominance is interval nesting.
+        vector<uint32_t> childStart(count + 1, 0);
+        for (uint32_t b : order)
+        {
+            if (b != 0)
+                childStart[idom[b] + 1]++;
+        }
+        for (uint32_t b = 0; b < count; b++)
+        {
+            childStart[b + 1] += childStart[b];
+        }
+        vector<uint32_t> children(childStart[count]);
+        vector<uint32_t> fill(childStart.begin(), childStart.end() - 1);
+        for (uint32_t b : order)
+        {
+            if (b != 0)
+                children[fill[idom[b]]++] = b;
+        }
+        treeEnter.assign(count, NONE);
+        treeLeave.assign(count, NONE);
+        uint32_t clock = 0;
+        stack.assign(1, {0, childStart[0]});
+        treeEnter[0] = clock++;
+        while (!stack.empty())
+        {
+            uint32_t b = stack.back().first;
+            if (stack.back().second == childStart[b + 1])
+            {
+                treeLeave[b] = clock++;
+                stack.pop_back();
+                continue;
+            }
+            uint32_t child = children[stack.back().second++];
+            treeEnter[child] = clock++;
+            stack.push_back({child, childStart[child]});
+        }
+    }
+
+    // Natural loops, innermost first. Back edges into one header share a loop.
+    // Returns false, with no loops, if they list too many blocks.
+    bool findLoops(const vector<IrInstr> &code)
+    {
+        loops.clear();
+        size_t members = 0;
+        vector<pair<uint32_t, uint32_t>> backEdges; // (header, source)
+        for (uint32_t b : order)
+        {
+            for (uint32_t s : blocks[b].successors)
+            {
+                if (s != NONE && dominates(s, b))
+                    backEdges.push_back({s, b});
+            }
+        }
+        sort(backEdges.begin(), backEdges.end());
+
+        vector<uint32_t> member(blocks.size(), NONE);
+        vector<uint32_t> pending;
+        for (size_t e = 0; e < backEdges.size(); e++)
+        {
+            uint32_t header = backEdges[e].first;
+            if (e == 0 || backEdges[e - 1].first != header)
+            {
+                loops.push_back({header, {header}, true});
+                member[header] = loops.size() - 1;
+            }
+            Loop &loop = loops.back();
+            pending.push_back(backEdges[e].second);
+            while (!pending.empty())
+            {
+                uint32_t b = pending.back();
+                pending.pop_back();
+                if (member[b] == loops.size() - 1)
+                    continue;
+                member[b] = loops.size() - 1;
+                loop.blocks.push_back(b);
+                if (++members > MEMBER_LIMIT)
+                {
+                    loops.clear();
+                    return false;
+                }
+                for (uint32_t p = predecessorStart[b]; p < predecessorStart[b + 1]; p++)
+                {
+                    if (orderIndex[predecessors[p]] != NONE)
+                        pending.push_back(predecessors[p]);
+                }
+            }
+        }
+
+        for (size_t l = 0; l < loops.size(); l++)
+        {
+            Loop &loop = loops[l];
+            sort(loop.blocks.begin(), loop.blocks.end());
+            uint32_t header = loop.header;
+            for (uint32_t p = predecessorStart[header]; p < predecessorStart[header + 1]; p++)
+            {
+                uint32_t from = predecessors[p];
+                if (orderIndex[from] == NONE || binary_search(loop.blocks.begin(), loop.blocks.end(), from))
+                    continue;
+                // Code put in front of the label runs on the fall-through
+                // edge only, so that has to be the one way in.
+                IrOp last = code[blocks[from].end - 1].op;
+                bool jumps = last == IR_JUMP || last == IR_BRANCH_FALSE || last == IR_BRANCH_TRUE;
+                if (from + 1 != header || (jumps && blocks[from].successors[0] == header))
+                    loop.preheader = false;
+            }
+        }
+        stable_sort(loops.begin(), loops.end(), [](const Loop &x, const Loop &y)
+                    { return x.blocks.size() < y.blocks.size(); });
+        return true;
+    }
+
+    static bool mayTrap(const IrInstr &instr, const IrModule &module)
+    {
+        if ((instr.op != IR_DIV && instr.op != IR_MOD) || isFloating(instr.type))
+            return false;
+        if (operandKind(instr.b) != OPERAND_CONSTANT)
+            return true;
+        const IrConstant &divisor = module.constants[operandIndex(instr.b)];
+        int64_t value = isFloating(divisor.type) ? static_cast<int64_t>(divisor.d) : divisor.i;
+        return value == 0 || value == -1;
+    }
+
+    bool invariantOperand(uint32_t operand, uint32_t loop, size_t begin) const
+    {
+        uint32_t value = valueIndex(operand);
+        if (value == NONE || stores[value] == 0)
+            return true;
+        return stores[value] == 1 && invariantIn[storedAt[value] - begin] == loop;
+    }
+
+    // Adds `delta` to the counts of stores and reads inside `loop`.
+    void count(const vector<IrInstr> &code, const Loop &loop, int delta)
+    {
+        uint32_t variables = module->variables.size();
+        for (uint32_t b : loop.blocks)
+        {
+            for (uint32_t i = blocks[b].begin; i < blocks[b].end; i++)
+            {
+                const IrInstr &instr = code[i];
+                if (hasDest(instr))
+                {
+                    uint32_t value = valueIndex(instr.dest);
+                    stores[value] += delta;
+                    storedAt[value] = i;
+                }
+                for (uint32_t operand : {instr.a, instr.b})
+                {
+                    uint32_t value = valueIndex(operand);
+                    if (value != NONE && value >= variables)
+                        loopReads[value - variables] += delta;
+                }
+            }
+        }
+    }
+
+    void markInvariants(const vector<IrInstr> &code, size_t begin)
+    {
+        uint32_t variables = module->variables.size();
+        for (uint32_t l = 0; l < loops.size(); l++)
+        {
+            const Loop &loop = loops[l];
+            count(code, loop, 1);
+            for (uint32_t b : loop.blocks)
+            {
+                for (uint32_t i = blocks[b].begin; i < blocks[b].end; i++)
+                {
+                    const IrInstr &instr = code[i];
+                    if (!hasDest(instr) || operandKind(instr.dest) != OPERAND_TEMPORARY)
+                        continue;
+                    uint32_t value = valueIndex(instr.dest);
+                    if (stores[value] != 1 || loopReads[value - variables] != reads[value - variables] ||
+                        mayTrap(instr, *module) || !invariantOperand(instr.a, l, begin) ||
+                        !invariantOperand(instr.b, l, begin))
+                        continue;
+                    invariantIn[i - begin] = l;
+                    if (loop.preheader)
+                        hoistTo[i - begin] = l;
+                }
+            }
+            count(code, loop, -1);
+        }
+    }
+
+    void optimizeRegion(const vector<IrInstr> &code, size_t begin, size_t end, vector<IrInstr> &out)
+    {
+        buildGraph(code, begin, end);
+        buildDominators();
+        if (!findLoops(code))
+            regionsSkipped++;
+        if (loops.empty())
+        {
+            out.insert(out.end(), code.begin() + begin, code.begin() + end);
+            return;
+        }
+        loopsFound += loops.size();
+
+        uint32_t variables = module->variables.size();
+        stores.resize(variables + module->temporaries.size(), 0);
+        storedAt.resize(stores.size());
+        reads.resize(module->temporaries.size(), 0);
+        loopReads.resize(reads.size(), 0);
+        for (size_t i = begin; i < end; i++)
+        {
+            for (uint32_t operand : {code[i].a, code[i].b})
+            {
+                if (operand != NO_OPERAND && operandKind(operand) == OPERAND_TEMPORARY)
+                    reads[operandIndex(operand)]++;
+            }
+        }
+        invariantIn.assign(end - begin, NONE);
+        hoistTo.assign(end - begin, NONE);
+        markInvariants(code, begin);
+
+        // Each header's hoisted instructions, in code order, go in front of it.
+        vector<pair<uint32_t, uint32_t>> moved; // (header, instruction)
+        for (size_t i = begin; i < end; i++)
+        {
+            if (hoistTo[i - begin] != NONE)
+                moved.push_back({loops[hoistTo[i - begin]].header, static_cast<uint32_t>(i)});
+        }
+        sort(moved.begin(), moved.end());
+        instructionsHoisted += moved.size();
+        size_t next = 0;
+        for (uint32_t b = 0; b < blocks.size(); b++)
+        {
+            for (; next < moved.size() && moved[next].first == b; next++)
+            {
+                out.push_back(code[moved[next].second]);
+            }
+            for (uint32_t i = blocks[b].begin; i < blocks[b].end; i++)
+            {
+                if (hoistTo[i - begin] == NONE)
+                    out.push_back(code[i]);
+            }
+        }
+
+        for (size_t i = begin; i < end; i++)
+        {
+            for (uint32_t operand : {code[i].a, code[i].b})
+            {
+                if (operand != NO_OPERAND && operandKind(operand) == OPERAND_TEMPORARY)
+                    reads[operandIndex(operand)] = 0;
+            }
+        }
+    }
+
+public:
+    LoopOptimizer() : module(nullptr), loopsFound(0), instructionsHoisted(0), regionsSkipped(0) {}
+
+    void optimize(IrModule &module)
+    {
+        this->module = &module;
+        vector<IrInstr> out;
+        out.reserve(module.code.size());
+        vector<uint32_t> regions;
+        for (size_t r = 0; r < module.regions.size(); r++)
+        {
+            size_t begin = module.regions[r];
+            size_t end = r + 1 < module.regions.size() ? module.regions[r + 1] : module.code.size();
+            regions.push_back(out.size());
+            if (end > begin)
+                optimizeRegion(module.code, begin, end, out);
+        }
+        module.code.swap(out);
+        module.regions.swap(regions);
+    }
+
+    void printSummary(ostream &out = cout) const
+    {
+        out << "Loop-invariant code motion hoisted " << instructionsHoisted << " instructions out of "
+            << loopsFound << " loops" << endl;
+        if (regionsSkipped > 0)
+            out << "Loop-invariant code motion skipped " << regionsSkipped << " statements with too many nested loops" << endl;
+    }
+};
+
+// Where linear scan put each value: values are variables (by index) followed
+// by temporaries, and each gets a register of its class or lives in memory.
+struct RegisterAllocation
+{
+    static constexpr int16_t IN_MEMORY = -1;
+
+    vector<int16_t> location;
+    size_t values = 0;       // values that occur in the code
+    size_t peakLive = 0;     // most values live at one instruction
+    size_t spilledInt = 0;   // bool/char/int values that did not get a register
+    size_t spilledFloat = 0; // float/double values that did not get a register
+    unsigned intUsed = 0;    // registers of each class handed out
+    unsigned floatUsed = 0;
+
+    void printSummary(ostream &out = cout) const
+    {
+        out << "Register allocation: " << values << " values, peak " << peakLive << " live, "
+             << spilledInt << " int and " << spilledFloat << " float spilled" << endl;
+    }
+};
+
+// Liveness by live intervals plus linear-scan allocation (Poletto & Sarkar).
+// An interval runs from a value's first to its last occurrence in code order.
+// A variable that occurs inside a loop may carry its value around the back
+// edge, so its interval is widened to the whole loop; temporaries never
+// outlive the expression that made them and need no widening. Variables read
+// before their first assignment must see zero, so unless their first
+// occurrence is an assignment every path goes through, their interval starts
+// at the top of the program, where all registers are still zeroed.
+class LinearScanAllocator
+{
+private:
+    struct Interval
+    {
+        uint32_t value;
+        uint32_t start;
+        uint32_t end;
+    };
+
+    // The loops by where they start, as a max tree over their ends plus one
+    // (0 where none starts), so finding the loops around an occurrence does
+    // not cost a pass over every loop body.
+    struct LoopTree
+    {
+        uint32_t leaves = 1;
+        vector<uint32_t> ends;
+
+        explicit LoopTree(size_t positions)
+        {
+            while (leaves < positions)
+                leaves *= 2;
+            ends.assign(2 * leaves, 0);
+        }
+
+        void add(uint32_t first, uint32_t last)
+        {
+            uint32_t i = leaves + first;
+            ends[i] = max(ends[i], last + 1);
+            for (i /= 2; i > 0; i /= 2)
+                ends[i] = max(ends[2 * i], ends[2 * i + 1]);
+        }
+
+        // The furthest end plus one of the loops starting in [lo, hi].
+        uint32_t furthest(uint32_t lo, uint32_t hi) const
+        {
+            uint32_t best = 0;
+            for (lo += leaves, hi += leaves + 1; lo < hi; lo /= 2, hi /= 2)
+            {
+                if (lo & 1)
+                    best = max(best, ends[lo++]);
+                if (hi & 1)
+                    best = max(best, ends[--hi]);
+            }
+            return best;
+        }
+
+        // The first start in [lo, hi] of a loop that reaches past `position`.
+        uint32_t leftmost(uint32_t lo, uint32_t hi, uint32_t position, uint32_t node, uint32_t from, uint32_t to) const
+        {
+            if (to < lo || from > hi || ends[node] <= position)
+                return UINT32_MAX;
+            if (node >= leaves)
+                return from;
+            uint32_t middle = from + (to - from) / 2;
+            uint32_t left = leftmost(lo, hi, position, 2 * node, from, middle);
+            return left != UINT32_MAX ? left : leftmost(lo, hi, position, 2 * node + 1, middle + 1, to);
+        }
+    };
+
+    const IrModule &module;
+    unsigned intRegisters;
+    unsigned floatRegisters;
+
+    uint32_t valueOf(uint32_t operand) const
+    {
+        uint32_t index = operandIndex(operand);
+        return operandKind(operand) == OPERAND_TEMPORARY ? module.variables.size() + index : index;
+    }
+
+    bool isFloatingValue(uint32_t value) const
+    {
+        size_t variables = module.variables.size();
+        return isFloating(value < variables ? module.variables[value].type : module.temporaries[value - variables]);
+    }
+
+    template <typename Visit>
+    static void forEachValue(const IrInstr &instr, Visit visit)
+    {
+        if (instr.op > IR_NEG && instr.op != IR_BRANCH_FALSE && instr.op != IR_BRANCH_TRUE && instr.op != IR_RETURN)
+            return;
+        if (instr.op <= IR_NEG)
+            visit(instr.dest);
+        if (instr.a != NO_OPERAND && operandKind(instr.a) != OPERAND_CONSTANT)
+            visit(instr.a);
+        if (instr.b != NO_OPERAND && operandKind(instr.b) != OPERAND_CONSTANT)
+            visit(instr.b);
+    }
+
+    vector<Interval> buildIntervals() const
+    {
+        const vector<IrInstr> &code = module.code;
+        size_t valueCount = module.variables.size() + module.temporaries.size();
+        vector<uint32_t> start(valueCount, UINT32_MAX);
+        vector<uint32_t> end(valueCount, 0);
+        vector<uint32_t> labelPosition(module.labelCount, UINT32_MAX);
+        LoopTree loops(code.size());
+        vector<bool> firstIsDefinition(module.variables.size());
+        vector<int32_t> jumpsOver(code.size() + 1, 0); // difference array of jumps skipping each position
+
+        for (uint32_t i = 0; i < code.size(); i++)
+        {
+            const IrInstr &instr = code[i];
+            if (instr.op == IR_LABEL)
+                labelPosition[instr.dest] = i;
+            else if ((instr.op == IR_JUMP || instr.op == IR_BRANCH_FALSE || instr.op == IR_BRANCH_TRUE) &&
+                     labelPosition[instr.dest] != UINT32_MAX)
+                loops.add(labelPosition[instr.dest], i);
+            forEachValue(instr, [&](uint32_t operand)
+                         {
+                uint32_t value = valueOf(operand);
+                if (start[value] == UINT32_MAX && operandKind(operand) == OPERAND_VARIABLE)
+                    firstIsDefinition[value] = instr.op <= IR_NEG && operand == instr.dest && instr.a != operand && instr.b != operand;
+                start[value] = min(start[value], i);
+                end[value] = max(end[value], i); });
+        }
+
+        // Any jump, forward or back, makes the positions strictly between its
+        // source and target conditional.
+        for (uint32_t i = 0; i < code.size(); i++)
+        {
+            const IrInstr &instr = code[i];
+            if (instr.op != IR_JUMP && instr.op != IR_BRANCH_FALSE && instr.op != IR_BRANCH_TRUE)
+                continue;
+            uint32_t target = labelPosition[instr.dest];
+            jumpsOver[min(i, target) + 1]++;
+            jumpsOver[max(i, target)]--;
+        }
+        for (uint32_t i = 1; i < code.size(); i++)
+        {
+            jumpsOver[i] += jumpsOver[i - 1];
+        }
+        for (uint32_t value = 0; value < module.variables.size(); value++)
+        {
+            if (start[value] != UINT32_MAX && (!firstIsDefinition[value] || jumpsOver[start[value]] != 0))
+                start[value] = 0;
+        }
+
+        // Every occurrence widens its value to the loops around it: the
+        // union of those is the outermost start and the furthest end.
+        for (uint32_t i = 0; i < code.size(); i++)
+        {
+            forEachValue(code[i], [&](uint32_t operand)
+                         {
+                uint32_t value = valueOf(operand);
+                // A temporary only lives around a loop if it was computed
+                // before it, as hoisted ones are.
+                uint32_t lo = operandKind(operand) == OPERAND_TEMPORARY ? start[value] + 1 : 0;
+                if (lo > i)
+                    return;
+                uint32_t reach = loops.furthest(lo, i);
+                if (reach <= i)
+                    return;
+                start[value] = min(start[value], loops.leftmost(lo, i, i, 1, 0, loops.leaves - 1));
+                end[value] = max(end[value], reach - 1); });
+        }
+
+        vector<Interval> intervals;
+        for (uint32_t value = 0; value < valueCount; value++)
+        {
+            if (start[value] != UINT32_MAX)
+                intervals.push_back({value, start[value], end[value]});
+        }
+        sort(intervals.begin(), intervals.end(), [](const Interval &x, const Interval &y)
+             { return x.start < y.start; });
+        return intervals;
+    }
+
+public:
+    LinearScanAllocator(const IrModule &module, unsigned intRegisters, unsigned floatRegisters)
+        : module(module), intRegisters(intRegisters), floatRegisters(floatRegisters) {}
+
+    RegisterAllocation allocate() const
+    {
+        RegisterAllocation result;
+        result.location.assign(module.variables.size() + module.temporaries.size(), RegisterAllocation::IN_MEMORY);
+        vector<Interval> intervals = buildIntervals();
+        result.values = intervals.size();
+
+        // Active intervals per class ordered by end, with the free registers.
+        set<pair<uint32_t, uint32_t>> active[2];
+        vector<int16_t> freeRegisters[2];
+        for (int r = intRegisters - 1; r >= 0; r--)
+            freeRegisters[0].push_back(r);
+        for (int r = floatRegisters - 1; r >= 0; r--)
+            freeRegisters[1].push_back(r);
+        size_t spilled[2] = {0, 0};
+        unsigned used[2] = {0, 0};
+        priority_queue<uint32_t, vector<uint32_t>, greater<uint32_t>> liveEnds;
+
+        for (const Interval &interval : intervals)
+        {
+            // An operand read by the instruction that starts this interval has
+            // already been loaded, so its register may be reused for the result.
+            while (!liveEnds.empty() && liveEnds.top() < interval.start)
+                liveEnds.pop();
+            liveEnds.push(interval.end);
+            result.peakLive = max(result.peakLive, liveEnds.size());
+
+            int kind = isFloatingValue(interval.value) ? 1 : 0;
+            set<pair<uint32_t, uint32_t>> &running = active[kind];
+            while (!running.empty() && running.begin()->first <= interval.start)
+            {
+                freeRegisters[kind].push_back(result.location[running.begin()->second]);
+                running.erase(running.begin());
+            }
+
+            if (!freeRegisters[kind].empty())
+            {
+                int16_t reg = freeRegisters[kind].back();
+                freeRegisters[kind].pop_back();
+                result.location[interval.value] = reg;
+                used[kind] = max<unsigned>(used[kind], reg + 1);
+                running.insert({interval.end, interval.value});
+                continue;
+            }
+
+            spilled[kind]++;
+            if (running.empty())
+                continue;
+            // Spill whichever of the current and the active intervals ends last.
+            auto last = prev(running.end());
+            if (last->first > interval.end)
+            {
+                result.location[interval.value] = result.location[last->second];
+                result.location[last->second] = RegisterAllocation::IN_MEMORY;
+                running.erase(last);
+                running.insert({interval.end, interval.value});
+            }
+        }
+
+        result.spilledInt = spilled[0];
+        result.spilledFloat = spilled[1];
+        result.intUsed = used[0];
+        result.floatUsed = used[1];
+        return result;
+    }
+};
+
+// Register bytecode for the virtual machine. Every operand is a slot in one
+// flat array: variables first (indexed by their IR variable id), then
+// temporaries, constants and a few scratch slots for conversions. Int-like
+// values (bool, char, int) are kept normalized in `i`, floating values in `d`.
+enum BcOp : uint8_t
+{
+    BC_MOVE,
+    BC_I2C,
+    BC_I2B,
+    BC_I2F,
+    BC_I2D,
+    BC_D2I,
+    BC_D2C,
+    BC_D2B,
+    BC_D2F,
+    BC_ADD_I,
+    BC_SUB_I,
+    BC_MUL_I,
+    BC_DIV_I,
+    BC_MOD_I,
+    BC_NEG_I,
+    BC_ADD_F,
+    BC_SUB_F,
+    BC_MUL_F,
+    BC_DIV_F,
+    BC_MOD_F,
+    BC_ADD_D,
+    BC_SUB_D,
+    BC_MUL_D,
+    BC_DIV_D,
+    BC_MOD_D,
+    BC_NEG_D,
+    BC_EQ_I,
+    BC_NEQ_I,
+    BC_LT_I,
+    BC_LTE_I,
+    BC_GT_I,
+    BC_GTE_I,
+    BC_EQ_D,
+    BC_NEQ_D,
+    BC_LT_D,
+    BC_LTE_D,
+    BC_GT_D,
+    BC_GTE_D,
+    BC_JUMP,        // goto dest
+    BC_JUMP_FALSE_I, // if !a.i goto dest
+    BC_JUMP_TRUE_I,
+    BC_JUMP_FALSE_D,
+    BC_JUMP_TRUE_D,
+    BC_RETURN,      // return a.i
+    BC_HALT,        // end of program, returns 0
+    BC_OP_COUNT,
+};
+
+union VmValue
+{
+    int64_t i;
+    double d;
+};
+
+struct BcInstr
+{
+    const void *handler; // filled in by VirtualMachine (direct threading)
+    uint32_t dest;
+    uint32_t a;
+    uint32_t b;
+    BcOp op;
+};
+
+struct Bytecode
+{
+    vector<BcInstr> code;
+    vector<VmValue> slots; // initial slot values: zeroed variables, loaded constants
+    bool threaded = false;
+};
+
+// Lowers IR to bytecode, making every implicit conversion an explicit
+// instruction so the interpreter never inspects types.
+class BytecodeGenerator
+{
+private:
+    const IrModule &module;
+    Bytecode program;
+    uint32_t temporaryBase;
+    uint32_t constantBase;
+    uint32_t scratchBase;
+    vector<uint32_t> labelTarget;
+    vector<size_t> jumps;
+
+    static bool isIntLike(ValueType type)
+    {
+        return !isFloating(type);
+    }
+
+    uint32_t slot(uint32_t operand) const
+    {
+        uint32_t index = operandIndex(operand);
+        switch (operandKind(operand))
+        {
+        case OPERAND_VARIABLE: return index;
+        case OPERAND_TEMPORARY: return temporaryBase + index;
+        default: return constantBase + index;
+        }
+    }
+
+    void emit(BcOp op, uint32_t dest, uint32_t a = 0, uint32_t b = 0)
+    {
+        program.code.push_back({nullptr, dest, a, b, op});
+    }
+
+    // The instruction converting a `from` value into a `to` value, or
+    // BC_OP_COUNT when the representation is already right.
+    static BcOp conversion(ValueType from, ValueType to)
+    {
+        if (from == to)
+            return BC_OP_COUNT;
+        if (isIntLike(from))
+        {
+            switch (to)
+            {
+            case VT_BOOL: return BC_I2B;
+            case VT_CHAR: return from == VT_BOOL ? BC_OP_COUNT : BC_I2C;
+            case VT_INT: return BC_OP_COUNT;
+            case VT_FLOAT: return BC_I2F;
+            case VT_DOUBLE: return BC_I2D;
+            }
+        }
+        switch (to)
+        {
+        case VT_BOOL: return BC_D2B;
+        case VT_CHAR: return BC_D2C;
+        case VT_INT: return BC_D2I;
+        case VT_FLOAT: return from == VT_DOUBLE ? BC_D2F : BC_OP_COUNT;
+        case VT_DOUBLE: return BC_OP_COUNT;
+        }
+        return BC_OP_COUNT;
+    }
+
+    // The slot holding `operand` as a `type` value, converting into the
+    // given scratch slot if needed.
+    uint32_t operandAs(uint32_t operand, ValueType type, uint32_t scratch)
+    {
+        BcOp convert = conversion(module.typeOf(operand), type);
+        if (convert == BC_OP_COUNT)
+            return slot(operand);
+        emit(convert, scratchBase + scratch, slot(operand));
+        return scratchBase + scratch;
+    }
+
+    static BcOp arithmetic(IrOp op, ValueType type)
+    {
+        int offset = op - IR_ADD;
+        if (op >= IR_EQ && op <= IR_GTE)
+            return static_cast<BcOp>((isFloating(type) ? BC_EQ_D : BC_EQ_I) + (op - IR_EQ));
+        if (op == IR_NEG)
+            return isFloating(type) ? BC_NEG_D : BC_NEG_I;
+        switch (type)
+        {
+        case VT_FLOAT: return static_cast<BcOp>(BC_ADD_F + offset);
+        case VT_DOUBLE: return static_cast<BcOp>(BC_ADD_D + offset);
+        default: return static_cast<BcOp>(BC_ADD_I + offset);
+        }
+    }
+
+    void lower(const IrInstr &instr)
+    {
+        switch (instr.op)
+        {
+        case IR_LABEL:
+            labelTarget[instr.dest] = program.code.size();
+            break;
+        case IR_JUMP:
+            jumps.push_back(program.code.size());
+            emit(BC_JUMP, instr.dest);
+            break;
+        case IR_BRANCH_FALSE:
+        case IR_BRANCH_TRUE:
+        {
+            bool floating = isFloating(module.typeOf(instr.a));
+            BcOp op = instr.op == IR_BRANCH_FALSE ? (floating ? BC_JUMP_FALSE_D : BC_JUMP_FALSE_I)
+                                                  : (floating ? BC_JUMP_TRUE_D : BC_JUMP_TRUE_I);
+            jumps.push_back(program.code.size());
+            emit(op, instr.dest, slot(instr.a));
+            break;
+        }
+        case IR_RETURN:
+            emit(BC_RETURN, 0, operandAs(instr.a, VT_INT, 0));
+            break;
+        case IR_COPY:
+        {
+            BcOp convert = conversion(module.typeOf(instr.a), module.typeOf(instr.dest));
+            emit(convert == BC_OP_COUNT ? BC_MOVE : convert, slot(instr.dest), slot(instr.a));
+            break;
+        }
+        default:
+        {
+            uint32_t a = operandAs(instr.a, instr.type, 0);
+            uint32_t b = instr.b == NO_OPERAND ? a : operandAs(instr.b, instr.type, 1);
+            ValueType resultType = instr.op >= IR_EQ && instr.op <= IR_GTE ? VT_BOOL : instr.type;
+            BcOp store = conversion(resultType, module.typeOf(instr.dest));
+            if (store == BC_OP_COUNT)
+            {
+                emit(arithmetic(instr.op, instr.type), slot(instr.dest), a, b);
+            }
+            else
+            {
+                emit(arithmetic(instr.op, instr.type), scratchBase + 2, a, b);
+                emit(store, slot(instr.dest), scratchBase + 2);
+            }
+            break;
+        }
+        }
+    }
+
+public:
+    BytecodeGenerator(const IrModule &module) : module(module)
+    {
+        temporaryBase = module.variables.size();
+        constantBase = temporaryBase + module.temporaries.size();
+        scratchBase = constantBase + module.constants.size();
+    }
+
+    Bytecode generate()
+    {
+        program = Bytecode();
+        // All-zero bits are 0 and 0.0 alike, so variables start out zeroed.
+        program.slots.assign(scratchBase + 3, VmValue{0});
+        for (size_t c = 0; c < module.constants.size(); c++)
+        {
+            const IrConstant &constant = module.constants[c];
+            VmValue &value = program.slots[constantBase + c];
+            if (isFloating(constant.type))
+                value.d = constant.d;
+            else
+                value.i = constant.i;
+        }
+
+        labelTarget.assign(module.labelCount, 0);
+        jumps.clear();
+        program.code.reserve(module.code.size() + 1);
+        for (const IrInstr &instr : module.code)
+        {
+            lower(instr);
+        }
+        emit(BC_HALT, 0);
+        for (size_t j : jumps)
+        {
+            program.code[j].dest = labelTarget[program.code[j].dest];
+        }
+        return move(program);
+    }
+};
+
+struct VmResult
+{
+    bool ok;
+    int64_t value;     // the returned value, 0 if the program ran off its end
+    uint64_t executed; // instructions dispatched
+};
+
+// A direct-threaded interpreter: each instruction holds the address of its
+// handler and every handler jumps straight to the next one.
+class VirtualMachine
+{
+private:
+    vector<VmValue> slots;
+    ostream &diag;
+
+    static int64_t wrapInt(int64_t value)
+    {
+        return static_cast<int32_t>(static_cast<uint32_t>(value));
+    }
+
+    static int64_t truncate(double value)
+    {
+        // Out-of-range values give INT_MIN, as cvttsd2si does.
+        if (!(value > -2147483649.0 && value < 2147483648.0))
+            return INT32_MIN;
+        return static_cast<int64_t>(value);
+    }
+
+    static double roundFloat(double value)
+    {
+        return static_cast<float>(value);
+    }
+
+public:
+    VirtualMachine(ostream &diag = cerr) : diag(diag) {}
+
+    VmResult run(Bytecode &program)
+    {
+        static const void *const handlers[BC_OP_COUNT] = {
+            &&op_MOVE, &&op_I2C, &&op_I2B, &&op_I2F, &&op_I2D, &&op_D2I, &&op_D2C, &&op_D2B, &&op_D2F,
+            &&op_ADD_I, &&op_SUB_I, &&op_MUL_I, &&op_DIV_I, &&op_MOD_I, &&op_NEG_I,
+            &&op_ADD_F, &&op_SUB_F, &&op_MUL_F, &&op_DIV_F, &&op_MOD_F,
+            &&op_ADD_D, &&op_SUB_D, &&op_MUL_D, &&op_DIV_D, &&op_MOD_D, &&op_NEG_D,
+            &&op_EQ_I, &&op_NEQ_I, &&op_LT_I, &&op_LTE_I, &&op_GT_I, &&op_GTE_I,
+            &&op_EQ_D, &&op_NEQ_D, &&op_LT_D, &&op_LTE_D, &&op_GT_D, &&op_GTE_D,
+            &&op_JUMP, &&op_JUMP_FALSE_I, &&op_JUMP_TRUE_I, &&op_JUMP_FALSE_D, &&op_JUMP_TRUE_D,
+            &&op_RETURN, &&op_HALT,
+        };
+        if (!program.threaded)
+        {
+            for (BcInstr &instr : program.code)
+            {
+                instr.handler = handlers[instr.op];
+            }
+            program.threaded = true;
+        }
+
+        slots = program.slots;
+        VmValue *s = slots.data();
+        const BcInstr *code = program.code.data();
+        const BcInstr *ip = code;
+        uint64_t executed = 0;
+
+#define VM_DISPATCH()            \
+    do                           \
+    {                            \
+        executed++;              \
+        goto *ip->handler;       \
+    } while (0)
+#define VM_NEXT() \
+    ip++;         \
+    VM_DISPATCH()
+#define VM_INT_OP(name, expr)                                  \
+    op_##name:                                                 \
+    s[ip->dest].i = wrapInt(s[ip->a].i expr s[ip->b].i);       \
+    VM_NEXT();
+#define VM_FLOAT_OP(name, expr)                                \
+    op_##name:                                                 \
+    s[ip->dest].d = roundFloat(s[ip->a].d expr s[ip->b].d);    \
+    VM_NEXT();
+#define VM_DOUBLE_OP(name, expr)                               \
+    op_##name:                                                 \
+    s[ip->dest].d = s[ip->a].d expr s[ip->b].d;                \
+    VM_NEXT();
+#define VM_COMPARE_OP(name, field, expr)                       \
+    op_##name:                                                 \
+    s[ip->dest].i = s[ip->a].field expr s[ip->b].field;        \
+    VM_NEXT();
+
+        VM_DISPATCH();
+
+    op_MOVE:
+        s[ip->dest] = s[ip->a];
+        VM_NEXT();
+    op_I2C:
+        s[ip->dest].i = static_cast<signed char>(static_cast<uint8_t>(s[ip->a].i));
+        VM_NEXT();
+    op_I2B:
+        s[ip->dest].i = s[ip->a].i != 0;
+        VM_NEXT();
+    op_I2F:
+        s[ip->dest].d = roundFloat(static_cast<double>(s[ip->a].i));
+        VM_NEXT();
+    op_I2D:
+        s[ip->dest].d = static_cast<double>(s[ip->a].i);
+        VM_NEXT();
+    op_D2I:
+        s[ip->dest].i = truncate(s[ip->a].d);
+        VM_NEXT();
+    op_D2C:
+        s[ip->dest].i = static_cast<signed char>(static_cast<uint8_t>(truncate(s[ip->a].d)));
+        VM_NEXT();
+    op_D2B:
+        s[ip->dest].i = s[ip->a].d != 0;
+        VM_NEXT();
+    op_D2F:
+        s[ip->dest].d = roundFloat(s[ip->a].d);
+        VM_NEXT();
+
+        VM_INT_OP(ADD_I, +)
+        VM_INT_OP(SUB_I, -)
+        VM_INT_OP(MUL_I, *)
+    op_DIV_I:
+        if (s[ip->b].i == 0)
+            goto divisionByZero;
+        s[ip->dest].i = wrapInt(s[ip->a].i / s[ip->b].i);
+        VM_NEXT();
+    op_MOD_I:
+        if (s[ip->b].i == 0)
+            goto divisionByZero;
+        s[ip->dest].i = s[ip->a].i % s[ip->b].i;
+        VM_NEXT();
+    op_NEG_I:
+        s[ip->dest].i = wrapInt(-s[ip->a].i);
+        VM_NEXT();
+
+        VM_FLOAT_OP(ADD_F, +)
+        VM_FLOAT_OP(SUB_F, -)
+        VM_FLOAT_OP(MUL_F, *)
+        VM_FLOAT_OP(DIV_F, /)
+    op_MOD_F:
+        s[ip->dest].d = roundFloat(fmod(s[ip->a].d, s[ip->b].d));
+        VM_NEXT();
+
+        VM_DOUBLE_OP(ADD_D, +)
+        VM_DOUBLE_OP(SUB_D, -)
+        VM_DOUBLE_OP(MUL_D, *)
+        VM_DOUBLE_OP(DIV_D, /)
+    op_MOD_D:
+        s[ip->dest].d = fmod(s[ip->a].d, s[ip->b].d);
+        VM_NEXT();
+    op_NEG_D:
+        s[ip->dest].d = -s[ip->a].d;
+        VM_NEXT();
+
+        VM_COMPARE_OP(EQ_I, i, ==)
+        VM_COMPARE_OP(NEQ_I, i, !=)
+        VM_COMPARE_OP(LT_I, i, <)
+        VM_COMPARE_OP(LTE_I, i, <=)
+        VM_COMPARE_OP(GT_I, i, >)
+        VM_COMPARE_OP(GTE_I, i, >=)
+        VM_COMPARE_OP(EQ_D, d, ==)
+        VM_COMPARE_OP(NEQ_D, d, !=)
+        VM_COMPARE_OP(LT_D, d, <)
+        VM_COMPARE_OP(LTE_D, d, <=)
+        VM_COMPARE_OP(GT_D, d, >)
+        VM_COMPARE_OP(GTE_D, d, >=)
+
+    op_JUMP:
+        ip = code + ip->dest;
+        VM_DISPATCH();
+    op_JUMP_FALSE_I:
+        ip = s[ip->a].i ? ip + 1 : code + ip->dest;
+        VM_DISPATCH();
+    op_JUMP_TRUE_I:
+        ip = s[ip->a].i ? code + ip->dest : ip + 1;
+        VM_DISPATCH();
+    op_JUMP_FALSE_D:
+        ip = s[ip->a].d != 0 ? ip + 1 : code + ip->dest;
+        VM_DISPATCH();
+    op_JUMP_TRUE_D:
+        ip = s[ip->a].d != 0 ? code + ip->dest : ip + 1;
+        VM_DISPATCH();
+
+    op_RETURN:
+        return {true, s[ip->a].i, executed};
+    op_HALT:
+        return {true, 0, executed};
+
+    divisionByZero:
+        diag << "Runtime error: Division by zero" << endl;
+        return {false, 0, executed};
+
+#undef VM_DISPATCH
+#undef VM_NEXT
+#undef VM_INT_OP
+#undef VM_FLOAT_OP
+#undef VM_DOUBLE_OP
+#undef VM_COMPARE_OP
+    }
+};
+
+// Registers the allocator may hand out. %eax, %ecx, %edx, %xmm0 and %xmm1 are
+// kept free as scratch for the instruction being lowered.
+const char *const ASM_INT_REGISTERS[] = {"%ebx", "%r12d", "%r13d", "%r14d", "%r15d", "%esi",
+                                         "%edi", "%r8d", "%r9d", "%r10d", "%r11d"};
+const char *const ASM_INT_REGISTERS_64[] = {"%rbx", "%r12", "%r13", "%r14", "%r15", "%rsi",
+                                            "%rdi", "%r8", "%r9", "%r10", "%r11"};
+const unsigned ASM_INT_REGISTER_COUNT = 11;
+const unsigned ASM_CALLEE_SAVED_COUNT = 5; // the first five above
+const unsigned ASM_FLOAT_REGISTER_COUNT = 14; // %xmm2 - %xmm15
+
+// Emits x86-64 System V assembly (GNU as, AT&T syntax) for an IR module.
+// Values the register allocator placed live in registers, the rest in a
+// zeroed static slot array. Each instruction loads its operands into
+// %eax/%ecx or %xmm0/%xmm1, computes in the operation type and stores the
+// result converted to the destination type, with the same conversions as the
+// bytecode VM. `return` leaves main with the value as the process exit status.
+class AsmGenerator
+{
+private:
+    const IrModule &module;
+    const RegisterAllocation &allocation;
+    ostream &out;
+    uint32_t localLabels;
+    vector<uint8_t> floatingConstants; // per constant: bit 0 float needed, bit 1 double needed
+
+    string slotAddress(uint32_t operand) const
+    {
+        size_t slot = operandIndex(operand);
+        if (operandKind(operand) == OPERAND_TEMPORARY)
+            slot += module.variables.size();
+        int16_t reg = allocation.location[slot];
+        if (reg != RegisterAllocation::IN_MEMORY)
+        {
+            if (isFloating(module.typeOf(operand)))
+                return "%xmm" + to_string(reg + 2);
+            return ASM_INT_REGISTERS[reg];
+        }
+        return "slots+" + to_string(slot * 8) + "(%rip)";
+    }
+
+    // Caller-saved allocated registers are clobbered by calls into libm.
+    void saveAroundCall(bool save)
+    {
+        unsigned slot = 0;
+        for (unsigned r = ASM_CALLEE_SAVED_COUNT; r < allocation.intUsed; r++, slot++)
+        {
+            string area = "callSave+" + to_string(slot * 8) + "(%rip)";
+            out << "\tmovq\t" << (save ? ASM_INT_REGISTERS_64[r] : area) << ", "
+                << (save ? area : ASM_INT_REGISTERS_64[r]) << '\n';
+        }
+        for (unsigned r = 0; r < allocation.floatUsed; r++, slot++)
+        {
+            string area = "callSave+" + to_string(slot * 8) + "(%rip)";
+            string reg = "%xmm" + to_string(r + 2);
+            out << "\tmovsd\t" << (save ? reg : area) << ", " << (save ? area : reg) << '\n';
+        }
+    }
+
+    string constantLabel(uint32_t operand, ValueType type)
+    {
+        uint32_t index = operandIndex(operand);
+        floatingConstants[index] |= type == VT_FLOAT ? 1 : 2;
+        return (type == VT_FLOAT ? ".LCf" : ".LCd") + to_string(index) + "(%rip)";
+    }
+
+    string newLabel()
+    {
+        return ".LX" + to_string(localLabels++);
+    }
+
+    static const char *suffix(ValueType type)
+    {
+        return type == VT_FLOAT ? "ss" : "sd";
+    }
+
+    // Loads an operand as a 32-bit int (truncating floating values).
+    void loadInt(uint32_t operand, const char *reg)
+    {
+        ValueType type = module.typeOf(operand);
+        if (operandKind(operand) == OPERAND_CONSTANT)
+        {
+            IrConstant value;
+            if (!convertConstant(module.constants[operandIndex(operand)], VT_INT, value))
+                value.i = INT32_MIN;
+            out << "\tmovl\t$" << value.i << ", " << reg << '\n';
+        }
+        else if (isFloating(type))
+        {
+            out << "\tcvtt" << suffix(type) << "2si\t" << slotAddress(operand) << ", " << reg << '\n';
+        }
+        else
+        {
+            out << "\tmovl\t" << slotAddress(operand) << ", " << reg << '\n';
+        }
+    }
+
+    // Loads an operand as a float or double value.
+    void loadFloating(uint32_t operand, ValueType type, const char *reg)
+    {
+        ValueType from = module.typeOf(operand);
+        if (operandKind(operand) == OPERAND_CONSTANT)
+            out << "\tmov" << suffix(type) << '\t' << constantLabel(operand, type) << ", " << reg << '\n';
+        else if (!isFloating(from))
+            out << "\tpxor\t" << reg << ", " << reg << "\n\tcvtsi2" << suffix(type) << "l\t" << slotAddress(operand)
+                << ", " << reg << '\n';
+        else if (from != type)
+            out << "\tcvt" << suffix(from) << '2' << suffix(type) << '\t' << slotAddress(operand) << ", " << reg << '\n';
+        else
+            out << "\tmov" << suffix(type) << '\t' << slotAddress(operand) << ", " << reg << '\n';
+    }
+
+    // Stores the int-like value in %eax into `dest`.
+    void storeInt(uint32_t dest)
+    {
+        ValueType type = module.typeOf(dest);
+        switch (type)
+        {
+        case VT_CHAR:
+            out << "\tmovsbl\t%al, %eax\n";
+            break;
+        case VT_BOOL:
+            out << "\ttestl\t%eax, %eax\n\tsetne\t%al\n\tmovzbl\t%al, %eax\n";
+            break;
+        case VT_FLOAT:
+        case VT_DOUBLE:
+            out << "\tpxor\t%xmm0, %xmm0\n\tcvtsi2" << suffix(type) << "l\t%eax, %xmm0\n";
+            out << "\tmov" << suffix(type) << "\t%xmm0, " << slotAddress(dest) << '\n';
+            return;
+        default:
+            break;
+        }
+        out << "\tmovl\t%eax, " << slotAddress(dest) << '\n';
+    }
+
+    // Stores the `type` value in %xmm0 into `dest`.
+    void storeFloating(ValueType type, uint32_t dest)
+    {
+        ValueType to = module.typeOf(dest);
+        if (isFloating(to))
+        {
+            if (to != type)
+                out << "\tcvt" << suffix(type) << '2' << suffix(to) << "\t%xmm0, %xmm0\n";
+            out << "\tmov" << suffix(to) << "\t%xmm0, " << slotAddress(dest) << '\n';
+            return;
+        }
+        if (to == VT_BOOL)
+        {
+            // Non-zero and NaN are true.
+            out << "\txorps\t%xmm1, %xmm1\n\tucomi" << suffix(type) << "\t%xmm1, %xmm0\n"
+                << "\tsetne\t%al\n\tsetp\t%cl\n\torb\t%cl, %al\n\tmovzbl\t%al, %eax\n";
+        }
+        else
+        {
+            out << "\tcvtt" << suffix(type) << "2si\t%xmm0, %eax\n";
+        }
+        storeInt(dest);
+    }
+
+    static const char *intOp(IrOp op)
+    {
+        switch (op)
+        {
+        case IR_ADD: return "addl";
+        case IR_SUB: return "subl";
+        default: return "imull";
+        }
+    }
+
+    static const char *condition(IrOp op)
+    {
+        switch (op)
+        {
+        case IR_EQ: return "e";
+        case IR_NEQ: return "ne";
+        case IR_LT: return "l";
+        case IR_LTE: return "le";
+        case IR_GT: return "g";
+        default: return "ge";
+        }
+    }
+
+    void intDivision(IrOp op)
+    {
+        string divide = newLabel();
+        string done = newLabel();
+        out << "\ttestl\t%ecx, %ecx\n\tje\t.Ldivzero\n";
+        // INT_MIN / -1 traps in idiv; x / -1 is -x (wrapping) and x % -1 is 0.
+        out << "\tcmpl\t$-1, %ecx\n\tjne\t" << divide << '\n';
+        out << (op == IR_DIV ? "\tnegl\t%eax\n" : "\txorl\t%eax, %eax\n");
+        out << "\tjmp\t" << done << '\n' << divide << ":\n\tcltd\n\tidivl\t%ecx\n";
+        if (op == IR_MOD)
+            out << "\tmovl\t%edx, %eax\n";
+        out << done << ":\n";
+    }
+
+    void floatingCompare(IrOp op, ValueType type)
+    {
+        const char *s = suffix(type);
+        switch (op)
+        {
+        case IR_EQ:
+            out << "\tucomi" << s << "\t%xmm1, %xmm0\n\tsete\t%al\n\tsetnp\t%cl\n\tandb\t%cl, %al\n";
+            break;
+        case IR_NEQ:
+            out << "\tucomi" << s << "\t%xmm1, %xmm0\n\tsetne\t%al\n\tsetp\t%cl\n\torb\t%cl, %al\n";
+            break;
+        // Unordered compares set CF, so above/above-or-equal are false for NaN.
+        case IR_LT:
+            out << "\tucomi" << s << "\t%xmm0, %xmm1\n\tseta\t%al\n";
+            break;
+        case IR_LTE:
+            out << "\tucomi" << s << "\t%xmm0, %xmm1\n\tsetae\t%al\n";
+            break;
+        case IR_GT:
+            out << "\tucomi" << s << "\t%xmm1, %xmm0\n\tseta\t%al\n";
+            break;
+        default:
+            out << "\tucomi" << s << "\t%xmm1, %xmm0\n\tsetae\t%al\n";
+            break;
+        }
+        out << "\tmovzbl\t%al, %eax\n";
+    }
+
+    void floatingArithmetic(IrOp op, ValueType type)
+    {
+        const char *s = suffix(type);
+        switch (op)
+        {
+        case IR_ADD: out << "\tadd" << s << "\t%xmm1, %xmm0\n"; break;
+        case IR_SUB: out << "\tsub" << s << "\t%xmm1, %xmm0\n"; break;
+        case IR_MUL: out << "\tmul" << s << "\t%xmm1, %xmm0\n"; break;
+        case IR_DIV: out << "\tdiv" << s << "\t%xmm1, %xmm0\n"; break;
+        case IR_NEG:
+            out << "\txorp" << (type == VT_FLOAT ? 's' : 'd') << '\t'
+                << (type == VT_FLOAT ? ".LCsignf" : ".LCsignd") << "(%rip), %xmm0\n";
+            break;
+        default:
+            if (type == VT_FLOAT)
+                out << "\tcvtss2sd\t%xmm0, %xmm0\n\tcvtss2sd\t%xmm1, %xmm1\n";
+            saveAroundCall(true);
+            out << "\tcall\tfmod@PLT\n";
+            saveAroundCall(false);
+            if (type == VT_FLOAT)
+                out << "\tcvtsd2ss\t%xmm0, %xmm0\n";
+            break;
+        }
+    }
+
+    void lower(const IrInstr &instr)
+    {
+        switch (instr.op)
+        {
+        case IR_LABEL:
+            out << ".L" << instr.dest << ":\n";
+            break;
+        case IR_JUMP:
+            out << "\tjmp\t.L" << instr.dest << '\n';
+            break;
+        case IR_BRANCH_FALSE:
+        case IR_BRANCH_TRUE:
+        {
+            ValueType type = module.typeOf(instr.a);
+            bool onTrue = instr.op == IR_BRANCH_TRUE;
+            if (!isFloating(type))
+            {
+                loadInt(instr.a, "%eax");
+                out << "\ttestl\t%eax, %eax\n\t" << (onTrue ? "jne" : "je") << "\t.L" << instr.dest << '\n';
+                break;
+            }
+            loadFloating(instr.a, type, "%xmm0");
+            out << "\txorps\t%xmm1, %xmm1\n\tucomi" << suffix(type) << "\t%xmm1, %xmm0\n";
+            if (onTrue)
+            {
+                out << "\tjne\t.L" << instr.dest << "\n\tjp\t.L" << instr.dest << '\n';
+            }
+            else
+            {
+                string skip = newLabel();
+                out << "\tjp\t" << skip << "\n\tje\t.L" << instr.dest << '\n' << skip << ":\n";
+            }
+            break;
+        }
+        case IR_RETURN:
+            loadInt(instr.a, "%eax");
+            out << "\tjmp\t.Lreturn\n";
+            break;
+        case IR_COPY:
+        {
+            ValueType from = module.typeOf(instr.a);
+            if (isFloating(from))
+            {
+                loadFloating(instr.a, from, "%xmm0");
+                storeFloating(from, instr.dest);
+            }
+            else
+            {
+                loadInt(instr.a, "%eax");
+                storeInt(instr.dest);
+            }
+            break;
+        }
+        default:
+        {
+            bool compare = instr.op >= IR_EQ && instr.op <= IR_GTE;
+            if (isFloating(instr.type))
+            {
+                loadFloating(instr.a, instr.type, "%xmm0");
+                if (instr.b != NO_OPERAND)
+                    loadFloating(instr.b, instr.type, "%xmm1");
+                if (compare)
+                {
+                    floatingCompare(instr.op, instr.type);
+                    storeInt(instr.dest);
+                }
+                else
+                {
+                    floatingArithmetic(instr.op, instr.type);
+                    storeFloating(instr.type, instr.dest);
+                }
+                break;
+            }
+            loadInt(instr.a, "%eax");
+            if (instr.b != NO_OPERAND)
+                loadInt(instr.b, "%ecx");
+            if (compare)
+                out << "\tcmpl\t%ecx, %eax\n\tset" << condition(instr.op) << "\t%al\n\tmovzbl\t%al, %eax\n";
+            else if (instr.op == IR_NEG)
+                out << "\tnegl\t%eax\n";
+            else if (instr.op == IR_DIV || instr.op == IR_MOD)
+                intDivision(instr.op);
+            else
+                out << '\t' << intOp(instr.op) << "\t%ecx, %eax\n";
+            storeInt(instr.dest);
+            break;
+        }
+        }
+    }
+
+public:
+    AsmGenerator(const IrModule &module, const RegisterAllocation &allocation, ostream &out)
+        : module(module), allocation(allocation), out(out), localLabels(0) {}
+
+    void generate()
+    {
+        floatingConstants.assign(module.constants.size(), 0);
+
+        out << "\t.text\n\t.globl\tmain\n\t.type\tmain, @function\nmain:\n"
+            << "\tpushq\t%rbp\n\tmovq\t%rsp, %rbp\n";
+        for (unsigned r = 0; r < ASM_CALLEE_SAVED_COUNT; r++)
+        {
+            out << "\tpushq\t" << ASM_INT_REGISTERS_64[r] << '\n';
+        }
+        out << "\tsubq\t$8, %rsp\n";
+        // Variables start out as zero, in registers as in memory.
+        for (unsigned r = 0; r < allocation.intUsed; r++)
+        {
+            out << "\txorl\t" << ASM_INT_REGISTERS[r] << ", " << ASM_INT_REGISTERS[r] << '\n';
+        }
+        for (unsigned r = 0; r < allocation.floatUsed; r++)
+        {
+            out << "\tpxor\t%xmm" << r + 2 << ", %xmm" << r + 2 << '\n';
+        }
+        for (const IrInstr &instr : module.code)
+        {
+            lower(instr);
+        }
+        out << "\txorl\t%eax, %eax\n.Lreturn:\n\taddq\t$8, %rsp\n";
+        for (unsigned r = ASM_CALLEE_SAVED_COUNT; r-- > 0;)
+        {
+            out << "\tpopq\t" << ASM_INT_REGISTERS_64[r] << '\n';
+        }
+        out << "\tpopq\t%rbp\n\tret\n"
+            << ".Ldivzero:\n\tmovl\t$2, %edi\n\tleaq\t.Ldivmsg(%rip), %rsi\n\tmovl\t$32, %edx\n"
+            << "\tcall\twrite@PLT\n\tmovl\t$1, %edi\n\tcall\t_exit@PLT\n"
+            << "\t.size\tmain, .-main\n\n";
+
+        out << "\t.section\t.rodata\n\t.align\t16\n"
+            << ".LCsignd:\n\t.quad\t0x8000000000000000, 0\n"
+            << ".LCsignf:\n\t.long\t0x80000000, 0, 0, 0\n";
+        for (size_t c = 0; c < floatingConstants.size(); c++)
+        {
+            IrConstant value;
+            if (floatingConstants[c] & 1)
+            {
+                convertConstant(module.constants[c], VT_FLOAT, value);
+                float single = static_cast<float>(value.d);
+                uint32_t bits;
+                memcpy(&bits, &single, sizeof(bits));
+                out << "\t.align\t4\n.LCf" << c << ":\n\t.long\t" << bits << '\n';
+            }
+            if (floatingConstants[c] & 2)
+            {
+                convertConstant(module.constants[c], VT_DOUBLE, value);
+                uint64_t bits;
+                memcpy(&bits, &value.d, sizeof(bits));
+                out << "\t.align\t8\n.LCd" << c << ":\n\t.quad\t" << bits << '\n';
+            }
+        }
+        out << ".Ldivmsg:\n\t.ascii\t\"Runtime error: Division by zero\\n\"\n\n";
+
+        size_t slots = module.variables.size() + module.temporaries.size();
+        out << "\t.local\tslots\n\t.comm\tslots, " << max<size_t>(slots, 1) * 8 << ", 16\n"
+            << "\t.local\tcallSave\n\t.comm\tcallSave, " << (ASM_INT_REGISTER_COUNT + ASM_FLOAT_REGISTER_COUNT) * 8
+            << ", 16\n\t.section\t.note.GNU-stack,\"\",@progbits\n";
+    }
+};
+
+// A fixed set of worker threads running batches of indexed tasks. Each worker
+// owns a deque seeded with a contiguous share of the batch; it takes work from
+// the back of its own deque and, once that is empty, steals from the front of
+// the others, so uneven task sizes even out without a central queue.
+class ThreadPool
+{
+private:
+    struct WorkQueue
+    {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+
+    vector<thread> workers;
+    vector<unique_ptr<WorkQueue>> queues;
+    function<void(size_t)> task;
+    mutex lock;
+    condition_variable wake;
+    condition_variable idle;
+    uint64_t generation;
+    size_t pending;
+    bool stopping;
+
+    bool take(size_t self, size_t &index)
+    {
+        {
+            WorkQueue &own = *queues[self];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty())
+            {
+                index = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++)
+        {
+            WorkQueue &victim = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                index = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t self)
+    {
+        uint64_t seen = 0;
+        while (true)
+        {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&]
+                          { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+            size_t index;
+            while (take(self, index))
+            {
+                task(index);
+                lock_guard<mutex> guard(lock);
+                if (--pending == 0)
+                    idle.notify_all();
+            }
+        }
+    }
+
+public:
+    ThreadPool(unsigned threads) : generation(0), pending(0), stopping(false)
+    {
+        threads = max(threads, 1u);
+        for (unsigned i = 0; i < threads; i++)
+        {
+            queues.emplace_back(new WorkQueue());
+        }
+        for (unsigned i = 0; i < threads; i++)
+        {
+            workers.emplace_back(&ThreadPool::work, this, i);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    size_t size() const
+    {
+        return workers.size();
+    }
+
+    // Starts running fn(0) ... fn(count - 1) and returns immediately.
+    void start(size_t count, function<void(size_t)> fn)
+    {
+        wait();
+        task = move(fn);
+        size_t share = (count + queues.size() - 1) / queues.size();
+        for (size_t q = 0; q < queues.size(); q++)
+        {
+            lock_guard<mutex> guard(queues[q]->lock);
+            for (size_t i = q * share; i < min(count, (q + 1) * share); i++)
+            {
+                queues[q]->tasks.push_back(i);
+            }
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            pending = count;
+            generation++;
+        }
+        wake.notify_all();
+    }
+
+    void wait()
+    {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [&]
+                  { return pending == 0; });
+    }
+};
+
+// Lexes one large input on a thread pool. The input is cut at line starts
+// into chunks, and each chunk is lexed on its own as if nothing were open
+// where it begins. Then, in order, a chunk whose start really lies inside a
+// comment, literal or run of spaces of the chunk before is re-lexed from
+// where that one stopped, but only until a token starts where a speculative
+// one did: lexing depends on nothing but the position, so the rest of the
+// chunk is right as it is. Strings get their ids in stream order and errors
+// are reported in source order, so the result is exactly what
+// Lexer::tokenize() returns.
+class ParallelLexer
+{
+private:
+    struct Chunk
+    {
+        size_t begin; // the chunk's tokens start in [begin, end)
+        size_t end;
+        size_t stop; // where lexing stopped, at or after end
+        TokenBuffer tokens;
+        Diagnostics errors;
+        TokenBuffer seam; // re-lexed tokens that replace tokens[0, kept)
+        Diagnostics seamErrors;
+        size_t kept;        // first speculative token in the result
+        size_t errorsAfter; // first offset of a speculative error in the result
+        vector<uint32_t> ids; // pool id in `tokens` -> id in the result
+        vector<uint32_t> seamIds;
+        size_t out; // index of the chunk's first token in the result
+    };
+
+    static constexpr size_t CHUNK_BYTES = 1 << 20;
+
+    ThreadPool &pool;
+
+    // Re-lexes the start of a chunk from `resume`, where the chunk before it
+    // really stopped, and returns where this one really stops.
+    static size_t mend(string_view source, Chunk &chunk, size_t resume)
+    {
+        const TokenArray<uint32_t> &offsets = chunk.tokens.offsets;
+        size_t next = lower_bound(offsets.begin(), offsets.end(), resume) - offsets.begin();
+        Lexer lexer(source, chunk.seamErrors);
+        lexer.seek(resume);
+        lexer.stopAt(chunk.end);
+        while (lexer.lexToken(chunk.seam))
+        {
+            uint32_t at = chunk.seam.offsets.back();
+            while (next < offsets.size() && offsets[next] < at)
+                next++;
+            if (next < offsets.size() && offsets[next] == at)
+            {
+                // In step again: the seam keeps its copy of this token.
+                chunk.kept = next + 1;
+                chunk.errorsAfter = at + 1;
+                return chunk.stop;
+            }
+        }
+        chunk.kept = offsets.size();
+        chunk.errorsAfter = SIZE_MAX;
+        return lexer.offset();
+    }
+
+    // Interns the strings used by tokens[first...] into `strings` in order
+    // of first use and maps their ids in `tokens` to the new ones.
+    static void assignIds(const TokenBuffer &tokens, size_t first, StringPool &strings, vector<uint32_t> &ids)
+    {
+        ids.assign(tokens.strings.size(), TokenBuffer::NO_VALUE);
+        if (first == 0)
+        {
+            // The pool was filled by exactly these tokens, so its ids are
+            // already in order of first use.
+            for (uint32_t id = 0; id < ids.size(); id++)
+            {
+                ids[id] = strings.intern(tokens.strings.get(id));
+            }
+            return;
+        }
+        for (size_t i = first; i < tokens.size(); i++)
+        {
+            uint32_t value = tokens.values[i];
+            if (value != TokenBuffer::NO_VALUE && ids[value] == TokenBuffer::NO_VALUE)
+                ids[value] = strings.intern(tokens.strings.get(value));
+        }
+    }
+
+    static void copyTokens(const TokenBuffer &from, size_t first, const vector<uint32_t> &ids, TokenBuffer &to, size_t out)
+    {
+        size_t count = from.size() - first;
+        copy(from.types.begin() + first, from.types.end(), to.types.begin() + out);
+        copy(from.offsets.begin() + first, from.offsets.end(), to.offsets.begin() + out);
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t value = from.values[first + i];
+            to.values[out + i] = value == TokenBuffer::NO_VALUE ? value : ids[value];
+        }
+    }
+
+public:
+    // Inputs smaller than this are lexed on the calling thread.
+    static constexpr size_t MIN_BYTES = 2 * CHUNK_BYTES;
+
+    ParallelLexer(ThreadPool &pool) : pool(pool) {}
+
+    TokenBuffer tokenize(string_view source, Diagnostics &diagnostics)
+    {
+        size_t count = min(pool.size() * 4, source.size() / CHUNK_BYTES);
+        if (count < 2 || source.size() > UINT32_MAX)
+            return Lexer(source, diagnostics).tokenize();
+
+        vector<Chunk> chunks(count);
+        size_t begin = 0;
+        for (size_t c = 0; c < count; c++)
+        {
+            size_t end = source.size();
+            if (c + 1 < count)
+            {
+                const char *at = source.data() + max(begin, source.size() / count * (c + 1));
+                const char *newline = static_cast<const char *>(memchr(at, '\n', source.data() + source.size() - at));
+                end = newline ? newline - source.data() + 1 : source.size();
+            }
+            chunks[c].begin = begin;
+            chunks[c].end = end;
+            begin = end;
+        }
+
+        pool.start(count, [&](size_t c)
+                   {
+            Chunk &chunk = chunks[c];
+            chunk.tokens.types.reserve((chunk.end - chunk.begin) / 4);
+            chunk.tokens.offsets.reserve((chunk.end - chunk.begin) / 4);
+            chunk.tokens.values.reserve((chunk.end - chunk.begin) / 4);
+            Lexer lexer(source, chunk.errors);
+            lexer.seek(chunk.begin);
+            lexer.stopAt(chunk.end);
+            while (lexer.lexToken(chunk.tokens))
+            {
+            }
+            chunk.stop = lexer.offset(); });
+        pool.wait();
+
+        TokenBuffer tokens;
+        size_t resume = 0;
+        size_t total = 0;
+        for (Chunk &chunk : chunks)
+        {
+            if (resume == chunk.begin)
+            {
+                chunk.kept = 0;
+                chunk.errorsAfter = 0;
+                resume = chunk.stop;
+            }
+            else
+            {
+                resume = mend(source, chunk, resume);
+            }
+            assignIds(chunk.seam, 0, tokens.strings, chunk.seamIds);
+            assignIds(chunk.tokens, chunk.kept, tokens.strings, chunk.ids);
+            chunk.out = total;
+            total += chunk.seam.size() + chunk.tokens.size() - chunk.kept;
+        }
+
+        tokens.types.resize(total);
+        tokens.offsets.resize(total);
+        tokens.values.resize(total);
+        pool.start(count, [&](size_t c)
+                   {
+            Chunk &chunk = chunks[c];
+            copyTokens(chunk.seam, 0, chunk.seamIds, tokens, chunk.out);
+            copyTokens(chunk.tokens, chunk.kept, chunk.ids, tokens, chunk.out + chunk.seam.size()); });
+        pool.wait();
+        tokens.push(T_EOF, source.size(), TokenBuffer::NO_VALUE);
+
+        for (const Chunk &chunk : chunks)
+        {
+            for (const Diagnostic &error : chunk.seamErrors.all())
+            {
+                diagnostics.error(error.offset, error.message);
+            }
+            for (const Diagnostic &error : chunk.errors.all())
+            {
+                if (error.offset >= chunk.errorsAfter)
+                    diagnostics.error(error.offset, error.message);
+            }
+        }
+        return tokens;
+    }
+};
+
+// Parses and lowers a program's top-level statements on a thread pool. A
+// pre-pass cuts the token stream between top-level statements into ranges,
+// and each range is parsed into its own arena with its names logged rather
+// than checked. If every range parsed cleanly and ended where the next one
+// begins, the logs are replayed in order over one symbol table, which
+// reports duplicate and undeclared names exactly as the sequential parser
+// would. The ranges are then lowered to IR on their own as well and adopted
+// in order, so the module is the one ICGenerator builds for the whole tree.
+class ParallelParser
+{
+private:
+    struct Range
+    {
+        size_t begin; // whole top-level statements in tokens [begin, end)
+        size_t end;
+        unique_ptr<Parser> parser; // owns the range's arena
+        uint32_t program;
+        vector<NameUse> names;
+        Diagnostics errors;
+        unique_ptr<ICGenerator> icg;
+        ICGenerator::Placement placement;
+    };
+
+    static constexpr size_t RANGE_TOKENS = 1 << 15;
+
+    ThreadPool &pool;
+    const TokenBuffer &tokens;
+    uint32_t maxDepth;
+    vector<Range> ranges;
+    SymbolTable symbolTable;
+    vector<pair<uint32_t, ValueType>> globals; // by name id: declaring token outside blocks, type
+
+    // Cuts the tokens into about `count` ranges. A top-level statement ends
+    // at a ';' or '}' outside all braces and parentheses that no 'else'
+    // follows. In a broken program that guess can be wrong, which parse()
+    // notices.
+    void cut(size_t count)
+    {
+        size_t last = tokens.size() - 1; // the end of input
+        size_t begin = 0;
+        int braces = 0;
+        int parens = 0;
+        ranges.reserve(count);
+        for (size_t i = 0; i < last && ranges.size() + 1 < count; i++)
+        {
+            TokenType type = tokens.types[i];
+            if (type == T_LBRACE)
+                braces++;
+            else if (type == T_RBRACE)
+                braces--;
+            else if (type == T_LPAREN)
+                parens++;
+            else if (type == T_RPAREN)
+                parens--;
+            if ((type == T_SEMICOLON || type == T_RBRACE) && braces == 0 && parens == 0 &&
+                tokens.types[i + 1] != T_ELSE && i + 1 >= last / count * (ranges.size() + 1))
+            {
+                ranges.emplace_back();
+                ranges.back().begin = begin;
+                ranges.back().end = i + 1;
+                begin = i + 1;
+            }
+        }
+        ranges.emplace_back();
+        ranges.back().begin = begin;
+        ranges.back().end = last;
+    }
+
+public:
+    // Programs with fewer tokens are parsed on the calling thread.
+    static constexpr size_t MIN_TOKENS = 2 * RANGE_TOKENS;
+
+    ParallelParser(ThreadPool &pool, const TokenBuffer &tokens, uint32_t maxDepth = 0)
+        : pool(pool), tokens(tokens), maxDepth(maxDepth)
+    {
+    }
+
+    // False, with nothing reported, if the program is too small to split or
+    // has a syntax error; Parser::parseProgram() then has to parse it.
+    // Otherwise name errors are reported to `diagnostics`.
+    bool parse(Diagnostics &diagnostics)
+    {
+        size_t count = min(pool.size() * 4, tokens.size() / RANGE_TOKENS);
+        if (count < 2 || tokens.size() > UINT32_MAX)
+            return false;
+        cut(count);
+
+        pool.start(ranges.size(), [&](size_t r)
+                   {
+            Range &range = ranges[r];
+            range.parser.reset(new Parser(tokens, range.errors));
+            Parser &parser = *range.parser;
+            if (maxDepth)
+                parser.setMaxDepth(maxDepth);
+            parser.logNames(&range.names);
+            parser.seek(range.begin);
+            range.program = parser.tree().allocate(N_PROGRAM, T_EOF, static_cast<uint32_t>(range.begin));
+            NodeList statements;
+            while (parser.position() < range.end)
+            {
+                statements.append(parser.tree(), parser.parseTopLevelStatement());
+            }
+            parser.tree()[range.program].a = statements.head; });
+        pool.wait();
+        for (const Range &range : ranges)
+        {
+            if (!range.errors.empty() || range.parser->position() != range.end)
+            {
+                ranges.clear();
+                return false;
+            }
+        }
+
+        globals.assign(tokens.strings.size(), {UINT32_MAX, VT_INT});
+        size_t depth = 0;
+        for (const Range &range : ranges)
+        {
+            for (NameUse use : range.names)
+            {
+                uint32_t name = tokens.values[use.token];
+                switch (use.kind)
+                {
+                case SCOPE_ENTERED:
+                    symbolTable.enterScope();
+                    depth++;
+                    break;
+                case SCOPE_LEFT:
+                    symbolTable.leaveScope();
+                    depth--;
+                    break;
+                case NAME_DECLARED:
+                    if (!symbolTable.declare(name, use.type))
+                        diagnostics.error(tokens.offsets[use.token],
+                                          "Identifier '" + string(tokens.text(use.token)) + "' already declared");
+                    else if (depth == 0)
+                        globals[name] = {use.token, valueTypeOf(use.type)};
+                    break;
+                case NAME_USED:
+                    if (!symbolTable.exists(name))
+                        diagnostics.error(tokens.offsets[use.token],
+                                          "Identifier '" + string(tokens.text(use.token)) + "' not declared");
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Lowers the parsed program into `icg`, which must be fresh. Only called
+    // when parse() reported nothing.
+    void generate(ICGenerator &icg, Diagnostics &diagnostics)
+    {
+        pool.start(ranges.size(), [&](size_t r)
+                   {
+            Range &range = ranges[r];
+            range.icg.reset(new ICGenerator(range.errors));
+            range.icg->lowerFrom(globals, static_cast<uint32_t>(range.begin));
+            range.icg->generate(range.parser->tree(), tokens, range.program); });
+        pool.wait();
+        for (const Range &range : ranges)
+        {
+            for (const Diagnostic &error : range.errors.all())
+            {
+                diagnostics.error(error.offset, error.message);
+            }
+        }
+        if (!diagnostics.empty())
+            return;
+
+        size_t instructions = 0;
+        for (const Range &range : ranges)
+        {
+            instructions += range.icg->ir().code.size();
+        }
+        icg.ir().code.reserve(instructions);
+        for (Range &range : ranges)
+        {
+            icg.adopt(*range.icg, range.placement);
+            if (icg.ir().full)
+            {
+                icg.tooLarge(tokens.offsets[range.begin]);
+                return;
+            }
+        }
+        pool.start(ranges.size(), [&](size_t r)
+                   {
+            icg.relocate(*ranges[r].icg, ranges[r].placement);
+            ranges[r].icg.reset(); });
+        pool.wait();
+    }
+
+    const SymbolTable &symbols() const
+    {
+        return symbolTable;
+    }
+
+    // Counted like the sequential parser's tree, with one program node.
+    size_t nodeCount() const
+    {
+        size_t nodes = 1;
+        for (const Range &range : ranges)
+        {
+            nodes += range.parser->tree().size() - 1;
+        }
+        return nodes;
+    }
+
+    void printAst(ostream &out) const
+    {
+        for (const Range &range : ranges)
+        {
+            AstPrinter(range.parser->tree(), tokens, out).print(range.program);
+        }
+    }
+};
+
+// Heap use of the calling thread. Only the command-line build replaces
+// operator new to update these, so in the library they stay at zero.
+thread_local uint64_t allocationCount = 0;
+thread_local uint64_t allocationBytes = 0; // as requested
+thread_local int64_t heapInUse = 0;        // usable bytes, counted while heapTracking is set
+thread_local int64_t heapPeak = 0;
+bool heapTracking = false;
+
+double threadCpuSeconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void writeJsonString(ostream &out, string_view text)
+{
+    out << '"';
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        }
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+// Complete ("X") events in the Chrome trace format, for chrome://tracing or
+// Perfetto. Threads are numbered in the order they first record an event.
+class TraceLog
+{
+private:
+    struct Event
+    {
+        string name;
+        double start; // microseconds since the log was created
+        double duration;
+        uint32_t thread;
+    };
+
+    mutex lock;
+    vector<Event> events;
+    map<thread::id, uint32_t> threads;
+    chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+public:
+    void record(const char *name, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end)
+    {
+        lock_guard<mutex> guard(lock);
+        uint32_t thread = threads.emplace(this_thread::get_id(), threads.size() + 1).first->second;
+        events.push_back({name, chrono::duration<double, micro>(start - epoch).count(),
+                          chrono::duration<double, micro>(end - start).count(), thread});
+    }
+
+    void write(ostream &out)
+    {
+        lock_guard<mutex> guard(lock);
+        out.setf(ios::fixed);
+        out.precision(3);
+        out << "{\"traceEvents\": [\n";
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            const Event &event = events[i];
+            out << "  {\"name\": ";
+            writeJsonString(out, event.name);
+            out << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread << ", \"ts\": " << event.start
+                << ", \"dur\": " << event.duration << "}" << (i + 1 < events.size() ? "," : "") << '\n';
+        }
+        out << "]}\n";
+    }
+};
+
+// Set by the driver for --trace.
+TraceLog *traceLog = nullptr;
+
+struct PhaseStats
+{
+    const char *name;
+    double wallSeconds;
+    double cpuSeconds; // of the compiling thread
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+    int64_t peakBytes; // heap high-water mark above where the phase started
+};
+
+// Everything --stats reports about one compile.
+struct CompileStats
+{
+    vector<PhaseStats> phases;
+    size_t sourceBytes = 0;
+    array<uint32_t, T_EOF + 1> tokenCounts{};
+    size_t internedStrings = 0; // distinct identifiers, keywords and literals
+    size_t symbols = 0;         // distinct names declared
+    size_t declarations = 0;
+    size_t deepestScope = 0;
+    size_t symbolSlots = 0; // symbol table size, indexed by interned id
+    size_t astNodes = 0;
+    size_t irInstructions = 0; // after optimization when it ran
+    size_t irTemporaries = 0;
+    size_t irVariables = 0;
+    size_t irConstants = 0;
+
+    size_t tokens() const
+    {
+        size_t total = 0;
+        for (uint32_t count : tokenCounts)
+        {
+            total += count;
+        }
+        return total;
+    }
+
+    void print(ostream &out) const
+    {
+        out << "phase          wall ms     cpu ms  allocations   alloc bytes    peak bytes\n";
+        PhaseStats total = {"total", 0, 0, 0, 0, 0};
+        for (const PhaseStats &phase : phases)
+        {
+            printPhase(out, phase);
+            total.wallSeconds += phase.wallSeconds;
+            total.cpuSeconds += phase.cpuSeconds;
+            total.allocations += phase.allocations;
+            total.allocatedBytes += phase.allocatedBytes;
+            total.peakBytes = max(total.peakBytes, phase.peakBytes);
+        }
+        printPhase(out, total);
+        out << "(counted on the compiling thread; instrumented compiles lex and parse on one thread)\n";
+
+        out << "source: " << sourceBytes << " bytes, " << tokens() << " tokens\n"
+            << "tokens by type:";
+        for (size_t type = 0; type < tokenCounts.size(); type++)
+        {
+            if (tokenCounts[type])
+                out << ' ' << TOKEN_TYPE_NAMES[type] << '=' << tokenCounts[type];
+        }
+        out << "\nsymbols: " << symbols << " names in " << declarations << " declarations, scopes nested "
+            << deepestScope << " deep, " << symbolSlots << " table slots (load factor "
+            << (symbolSlots ? static_cast<double>(symbols) / symbolSlots : 0) << "), " << internedStrings
+            << " interned strings\n"
+            << "ast: " << astNodes << " nodes\n"
+            << "ir: " << irInstructions << " instructions, " << irTemporaries << " temporaries, " << irVariables
+            << " variables, " << irConstants << " constants\n";
+    }
+
+    void printJson(ostream &out) const
+    {
+        out << "{\"source_bytes\": " << sourceBytes << ", \"tokens\": " << tokens() << ",\n   \"phases\": [";
+        for (size_t i = 0; i < phases.size(); i++)
+        {
+            const PhaseStats &phase = phases[i];
+            out << (i ? ", " : "") << "{\"name\": \"" << phase.name << "\", \"wall_seconds\": " << phase.wallSeconds
+                << ", \"cpu_seconds\": " << phase.cpuSeconds << ", \"allocations\": " << phase.allocations
+                << ", \"allocated_bytes\": " << phase.allocatedBytes << ", \"peak_bytes\": " << phase.peakBytes
+                << "}";
+        }
+        out << "],\n   \"token_counts\": {";
+        bool first = true;
+        for (size_t type = 0; type < tokenCounts.size(); type++)
+        {
+            if (!tokenCounts[type])
+                continue;
+            out << (first ? "" : ", ") << "\"" << TOKEN_TYPE_NAMES[type] << "\": " << tokenCounts[type];
+            first = false;
+        }
+        out << "},\n   \"symbols\": " << symbols << ", \"declarations\": " << declarations
+            << ", \"deepest_scope\": " << deepestScope << ", \"symbol_slots\": " << symbolSlots
+            << ", \"interned_strings\": " << internedStrings
+            << ", \"ast_nodes\": " << astNodes << ",\n   \"ir_instructions\": " << irInstructions
+            << ", \"ir_temporaries\": " << irTemporaries << ", \"ir_variables\": " << irVariables
+            << ", \"ir_constants\": " << irConstants << "}";
+    }
+
+private:
+    static void printPhase(ostream &out, const PhaseStats &phase)
+    {
+        char line[128];
+        snprintf(line, sizeof(line), "%-10s %11.3f %10.3f %12llu %13llu %13lld\n", phase.name,
+                 phase.wallSeconds * 1e3, phase.cpuSeconds * 1e3, static_cast<unsigned long long>(phase.allocations),
+                 static_cast<unsigned long long>(phase.allocatedBytes), static_cast<long long>(phase.peakBytes));
+        out << line;
+    }
+};
+
+// Accounts the enclosing scope as one phase in `stats` and the trace log.
+// When neither is enabled it costs two null checks.
+class PhaseScope
+{
+private:
+    CompileStats *stats;
+    const char *name;
+    chrono::steady_clock::time_point start;
+    double cpuStart = 0;
+    uint64_t allocationsStart = 0;
+    uint64_t bytesStart = 0;
+    int64_t heapStart = 0;
+
+public:
+    // `name` must outlive the scope.
+    PhaseScope(CompileStats *stats, const char *name) : stats(stats), name(name)
+    {
+        if (!stats && !traceLog)
+            return;
+        if (stats)
+        {
+            cpuStart = threadCpuSeconds();
+            allocationsStart = allocationCount;
+            bytesStart = allocationBytes;
+            heapStart = heapInUse;
+            heapPeak = heapInUse;
+        }
+        start = chrono::steady_clock::now();
+    }
+
+    ~PhaseScope()
+    {
+        if (!stats && !traceLog)
+            return;
+        auto end = chrono::steady_clock::now();
+        if (stats)
+        {
+            stats->phases.push_back({name, chrono::duration<double>(end - start).count(),
+                                     threadCpuSeconds() - cpuStart, allocationCount - allocationsStart,
+                                     allocationBytes - bytesStart, heapPeak - heapStart});
+        }
+        if (traceLog)
+            traceLog->record(name, start, end);
+    }
+};
+
+// compile() with optional instrumentation; `stats` may be null.
+CompileResult compile(string_view source, const CompileOptions &options, CompileStats *stats)
+{
+    CompileResult result;
+    Diagnostics diagnostics(source);
+
+    // The allocation counters and phase events only see the calling thread,
+    // so an instrumented compile does all of its work there.
+    bool instrumented = stats || traceLog;
+    unsigned lexThreads = instrumented ? 1 : options.lexThreads;
+    unsigned parseThreads = instrumented ? 1 : options.parseThreads;
+
+    TokenBuffer tokens;
+    {
+        PhaseScope phase(stats, "lex");
+        if (lexThreads > 1 && source.size() >= ParallelLexer::MIN_BYTES)
+        {
+            ThreadPool pool(lexThreads);
+            tokens = ParallelLexer(pool).tokenize(source, diagnostics);
+        }
+        else
+        {
+            tokens = Lexer(source, diagnostics).tokenize();
+        }
+    }
+
+    Parser parser(tokens, diagnostics);
+    if (options.maxDepth)
+        parser.setMaxDepth(options.maxDepth);
+    unique_ptr<ThreadPool> pool;
+    unique_ptr<ParallelParser> parallel;
+    if (parseThreads > 1 && tokens.size() >= ParallelParser::MIN_TOKENS)
+    {
+        pool.reset(new ThreadPool(parseThreads));
+        parallel.reset(new ParallelParser(*pool, tokens, options.maxDepth));
+    }
+    uint32_t program = NO_NODE;
+    {
+        PhaseScope phase(stats, "parse");
+        if (parallel && !parallel->parse(diagnostics))
+            parallel.reset();
+        if (!parallel)
+            program = parser.parseProgram();
+    }
+    const SymbolTable &symbols = parallel ? parallel->symbols() : parser.symbols();
+
+    ICGenerator icg(diagnostics);
+    if (diagnostics.empty())
+    {
+        PhaseScope phase(stats, "ir");
+        if (parallel)
+            parallel->generate(icg, diagnostics);
+        else
+            icg.generate(parser.tree(), tokens, program);
+    }
+    if (stats)
+    {
+        stats->sourceBytes = source.size();
+        for (TokenType type : tokens.types)
+        {
+            stats->tokenCounts[type]++;
+        }
+        stats->internedStrings = tokens.strings.size();
+        stats->symbols = symbols.size();
+        stats->declarations = symbols.declarationCount();
+        stats->deepestScope = symbols.deepestScope();
+        stats->symbolSlots = symbols.slotCount();
+        stats->astNodes = parallel ? parallel->nodeCount() : parser.tree().size();
+    }
+    if (!diagnostics.empty())
+    {
+        result.diagnostics = diagnostics.take();
+        return result;
+    }
+    result.ok = true;
+
+    ostringstream report;
+    if (options.optimize)
+    {
+        PhaseScope phase(stats, "optimize");
+        IrOptimizer optimizer;
+        optimizer.optimize(icg.ir());
+        optimizer.printSummary(report);
+        LoopOptimizer loops;
+        loops.optimize(icg.ir());
+        loops.printSummary(report);
+    }
+    if (stats)
+    {
+        const IrModule &ir = icg.ir();
+        stats->irInstructions = ir.code.size();
+        stats->irTemporaries = ir.temporaries.size();
+        stats->irVariables = ir.variables.size();
+        stats->irConstants = ir.constants.size();
+    }
+
+    {
+        PhaseScope phase(stats, "listing");
+        ostringstream text;
+        symbols.printTable(text, tokens.strings);
+        result.symbols = text.str();
+        if (options.dumpAst)
+        {
+            text.str(string());
+            if (parallel)
+                parallel->printAst(text);
+            else
+                AstPrinter(parser.tree(), tokens, text).print(program);
+            result.ast = text.str();
+        }
+        text.str(string());
+        icg.printInstructions(text);
+        result.ir = text.str();
+    }
+
+    if (options.emitIrImage)
+    {
+        PhaseScope phase(stats, "ir image");
+        result.irImage = writeIrImage(icg.ir());
+    }
+
+    if (options.emitAssembly)
+    {
+        PhaseScope phase(stats, "assembly");
+        RegisterAllocation allocation =
+            LinearScanAllocator(icg.ir(), ASM_INT_REGISTER_COUNT, ASM_FLOAT_REGISTER_COUNT).allocate();
+        allocation.printSummary(report);
+        ostringstream text;
+        AsmGenerator(icg.ir(), allocation, text).generate();
+        result.assembly = text.str();
+    }
+    result.report = report.str();
+
+    if (options.execute)
+    {
+        Bytecode bytecode;
+        {
+            PhaseScope phase(stats, "bytecode");
+            bytecode = BytecodeGenerator(icg.ir()).generate();
+        }
+        PhaseScope phase(stats, "execute");
+        ostringstream runtime;
+        auto start = chrono::steady_clock::now();
+        VmResult run = VirtualMachine(runtime).run(bytecode);
+        result.executeSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        result.executed = run.ok;
+        result.returnValue = run.value;
+        result.instructionsExecuted = run.executed;
+        if (!run.ok)
+        {
+            result.runtimeError = runtime.str();
+            result.runtimeError.pop_back();
+        }
+    }
+    return result;
+}
+
+CompileResult compile(string_view source, const CompileOptions &options)
+{
+    return compile(source, options, nullptr);
+}
+
+#ifndef COMPILER_LIBRARY
+
+// Feeds the heap counters declared with CompileStats. Live bytes are only
+// tracked under --stats, since that costs a malloc_usable_size() call on
+// every allocation and release.
+void *countedAllocate(size_t size, size_t alignment) noexcept
+{
+    void *p = nullptr;
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        p = malloc(size ? size : 1);
+    else if (posix_memalign(&p, alignment, size ? size : 1) != 0)
+        p = nullptr;
+    if (!p)
+        return nullptr;
+    allocationCount++;
+    allocationBytes += size;
+    if (heapTracking)
+    {
+        heapInUse += malloc_usable_size(p);
+        heapPeak = max(heapPeak, heapInUse);
+    }
+    return p;
+}
+
+// Kept out of line: once inlined, GCC sees memory from operator new handed
+// to free() and warns about the mismatch.
+__attribute__((noinline)) void countedRelease(void *p) noexcept
+{
+    if (heapTracking && p)
+        heapInUse -= malloc_usable_size(p);
+    free(p);
+}
+
+// Every replaceable form is routed through the counters, so no block is
+// ever allocated by one allocator and released by another.
+void *operator new(size_t size)
+{
+    if (void *p = countedAllocate(size, 0))
+        return p;
+    throw bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, align_val_t alignment)
+{
+    if (void *p = countedAllocate(size, static_cast<size_t>(alignment)))
+        return p;
+    throw bad_alloc();
+}
+
+void *operator new[](size_t size, align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    return countedAllocate(size, 0);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+    return countedAllocate(size, 0);
+}
+
+void *operator new(size_t size, align_val_t alignment, const nothrow_t &) noexcept
+{
+    return countedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, align_val_t alignment, const nothrow_t &) noexcept
+{
+    return countedAllocate(size, static_cast<size_t>(alignment));
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, const nothrow_t &) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, const nothrow_t &) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, align_val_t) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, align_val_t) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t, align_val_t) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t, align_val_t) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, align_val_t, const nothrow_t &) noexcept
+{
+    countedRelease(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, align_val_t, const nothrow_t &) noexcept
+{
+    countedRelease(p);
+}
+
+struct GeneratorOptions
+{
+    uint32_t seed = 1;
+    int declarations = 2000; // top-level declarations
+    int loops = 500;         // top-level loops
+    int depth = 3;           // deepest nesting of loop and if bodies
+    int expression = 4;      // operands per expression
+    int comments = 10;       // percent of statements preceded by a comment
+};
+
+// Writes a deterministic program out of the constructs in code.txt:
+// declarations of every type, assignments, if/else chains, the for and while
+// loop forms with break and continue, ternaries, and both comment styles.
+// Every variable is declared before use and only once. The random stream is
+// used raw, so a seed gives the same program on every platform.
+class SourceGenerator
+{
+private:
+    GeneratorOptions options;
+    mt19937 random;
+    string out;
+    vector<string> variables;
+    int names;
+
+    uint32_t pick(uint32_t n)
+    {
+        return random() % n;
+    }
+
+    void indent(int level)
+    {
+        out.append(4 * level, ' ');
+    }
+
+    void comment(int level)
+    {
+        if (static_cast<int>(pick(100)) >= options.comments)
+            return;
+        indent(level);
+        if (pick(3) == 0)
+            out += "/* block comment " + to_string(pick(1000)) + '\n' + string(4 * level + 3, ' ') + "over two lines */\n";
+        else
+            out += "// comment " + to_string(pick(1000)) + '\n';
+    }
+
+    string operand()
+    {
+        if (!variables.empty() && pick(3) != 0)
+            return variables[pick(variables.size())];
+        switch (pick(5))
+        {
+        case 0: return to_string(pick(1000)) + '.' + to_string(pick(100));
+        case 1: return string("'") + static_cast<char>('a' + pick(26)) + "'";
+        case 2: return pick(2) ? "true" : "false";
+        default: return to_string(pick(1000));
+        }
+    }
+
+    string expression(int operands)
+    {
+        static const char *const OPERATORS[] = {"+", "-", "*", "/", "%", "+", "-", "*", "<", ">", "<=", ">=", "==", "!=", "&&", "||"};
+        string e = operand();
+        for (int i = 1; i < operands; i++)
+        {
+            e += ' ';
+            e += OPERATORS[pick(sizeof(OPERATORS) / sizeof(*OPERATORS))];
+            e += ' ';
+            if (pick(4) == 0 && i + 1 < operands)
+            {
+                e += '(' + operand() + ' ' + OPERATORS[pick(3)] + ' ' + operand() + ')';
+                i++;
+            }
+            else if (pick(8) == 0)
+            {
+                e += '(' + operand() + " ? " + operand() + " : " + operand() + ')';
+            }
+            else
+            {
+                e += operand();
+            }
+        }
+        return e;
+    }
 
-        parseStatement();
+    string condition()
+    {
+        static const char *const COMPARISONS[] = {"<", ">", "<=", ">=", "==", "!="};
+        string c = operand() + ' ' + COMPARISONS[pick(6)] + ' ' + operand();
+        if (pick(3) == 0)
+            c += string(pick(2) ? " && " : " || ") + operand() + " > " + operand();
+        return c;
     }
 
-    void parseWhileLoop()
+    string declare()
     {
-        expect(T_WHILE);
-        expect(T_LPAREN);
-        parseExpression();
-        expect(T_RPAREN);
+        variables.push_back("v" + to_string(names++));
+        return variables.back();
+    }
+
+    void declaration(int level)
+    {
+        static const char *const TYPES[] = {"int", "float", "double", "char", "bool"};
+        comment(level);
+        indent(level);
+        out += TYPES[pick(5)];
+        int count = pick(4) == 0 ? 2 : 1;
+        for (int i = 0; i < count; i++)
+        {
+            // The initializer is built first so it cannot name the variable.
+            string value = pick(5) == 0 ? string() : expression(1 + pick(options.expression));
+            out += (i == 0 ? " " : ", ") + declare();
+            if (!value.empty())
+                out += " = " + value;
+        }
+        out += ";\n";
+    }
 
-        if (tokens[pos].type == T_LBRACE)
+    void assignment(int level)
+    {
+        static const char *const ASSIGNMENTS[] = {"=", "=", "+=", "-=", "*=", "/="};
+        if (variables.empty())
         {
-            parseBlock();
+            declaration(level);
+            return;
         }
+        comment(level);
+        indent(level);
+        string target = variables[pick(variables.size())];
+        if (pick(6) == 0)
+            out += target + (pick(2) ? "++" : "--") + ";\n";
         else
+            out += target + ' ' + ASSIGNMENTS[pick(6)] + ' ' + expression(1 + pick(options.expression)) + ";\n";
+    }
+
+    void body(int level, bool inLoop)
+    {
+        size_t visible = variables.size();
+        indent(level);
+        out += "{\n";
+        int statements = 1 + pick(3);
+        for (int i = 0; i < statements; i++)
+        {
+            statement(level + 1, inLoop);
+        }
+        indent(level);
+        out += "}\n";
+        // Names declared in the block go out of scope with it.
+        variables.resize(visible);
+    }
+
+    void ifStatement(int level, bool inLoop)
+    {
+        comment(level);
+        indent(level);
+        out += "if (" + condition() + ")\n";
+        body(level, inLoop);
+        while (pick(3) == 0)
+        {
+            indent(level);
+            out += "else if (" + condition() + ")\n";
+            body(level, inLoop);
+        }
+        if (pick(2) == 0)
+        {
+            indent(level);
+            out += "else\n";
+            body(level, inLoop);
+        }
+    }
+
+    void loop(int level)
+    {
+        // The counter is not added to the variables, so no statement in the
+        // body can assign it and keep the loop from ending.
+        indent(level);
+        string counter = "v" + to_string(names++);
+        out += "int " + counter + " = 0;\n";
+        comment(level);
+        indent(level);
+        string bound = to_string(1 + pick(100));
+        switch (pick(4))
+        {
+        case 0: out += "for (; " + counter + " < " + bound + "; " + counter + "++)\n"; break;
+        case 1: out += "for (" + counter + " = 0; " + counter + " < " + bound + " && " + operand() + " != 0; " + counter + "++, " + counter + " += 1)\n"; break;
+        case 2: out += "while (" + counter + " < " + bound + ")\n"; break;
+        default: out += "for (;; " + counter + "++)\n"; break;
+        }
+        indent(level);
+        out += "{\n";
+        indent(level + 1);
+        out += "if (" + counter + " >= " + bound + ")\n";
+        indent(level + 1);
+        out += "{\n";
+        indent(level + 2);
+        out += "break;\n";
+        indent(level + 1);
+        out += "}\n";
+        size_t visible = variables.size();
+        int statements = 1 + pick(3);
+        for (int i = 0; i < statements; i++)
+        {
+            statement(level + 1, true);
+        }
+        variables.resize(visible);
+        // Counted before a `continue`, which would otherwise skip it in the
+        // while form.
+        indent(level + 1);
+        out += counter + "++;\n";
+        if (pick(4) == 0)
         {
-            parseStatement();
+            indent(level + 1);
+            out += "continue;\n";
         }
+        indent(level);
+        out += "}\n";
     }
 
-    void parseAssignment()
+    void statement(int level, bool inLoop)
     {
-        expect(T_ID);
-        string identifier = tokens[pos - 1].value;
+        uint32_t kind = pick(10);
+        if (level < options.depth && kind == 0)
+            loop(level);
+        else if (level < options.depth && kind <= 2)
+            ifStatement(level, inLoop);
+        else if (kind <= 4)
+            declaration(level);
+        else
+            assignment(level);
+    }
+
+public:
+    SourceGenerator(const GeneratorOptions &options) : options(options), random(options.seed), names(0) {}
 
-        if (!symbolTable.exists(identifier))
+    string generate()
+    {
+        // Loops are spread evenly between the declarations.
+        int total = options.declarations + options.loops;
+        int loopsDone = 0;
+        for (int i = 0; i < total; i++)
         {
-            cerr << "Error: Identifier " << identifier << " not declared at line " << lineNumber << endl;
-            exit(1);
+            if (static_cast<int64_t>(loopsDone) * total < static_cast<int64_t>(i + 1) * options.loops)
+            {
+                loop(0);
+                loopsDone++;
+            }
+            else
+            {
+                declaration(0);
+                if (pick(2) == 0)
+                    assignment(0);
+            }
         }
+        return move(out);
+    }
+};
+
+// Recognizes a generator option at argv[i], consuming its value.
+bool parseGeneratorOption(int argc, char *argv[], int &i, GeneratorOptions &options)
+{
+    string arg = argv[i];
+    if (i + 1 >= argc)
+        return false;
+    int *target = arg == "--declarations" ? &options.declarations
+                  : arg == "--loops"      ? &options.loops
+                  : arg == "--depth"      ? &options.depth
+                  : arg == "--expression" ? &options.expression
+                  : arg == "--comments"   ? &options.comments
+                                          : nullptr;
+    if (arg == "--seed")
+        options.seed = strtoul(argv[++i], nullptr, 10);
+    else if (target)
+        *target = max(atoi(argv[++i]), 0);
+    else
+        return false;
+    options.expression = max(options.expression, 1);
+    return true;
+}
+
+struct PhaseResult
+{
+    const char *name;
+    double seconds; // per run
+    uint64_t allocations; // per run
+};
+
+// Runs `body` until it has taken at least a quarter second in total and
+// returns the mean time and allocation count of one run.
+template <class Body>
+PhaseResult measurePhase(const char *name, Body body)
+{
+    const double MINIMUM_SECONDS = 0.25;
+    body(); // warm-up
+    size_t runs = 0;
+    uint64_t allocationsBefore = allocationCount;
+    auto start = chrono::steady_clock::now();
+    double seconds = 0;
+    do
+    {
+        body();
+        runs++;
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    } while (seconds < MINIMUM_SECONDS);
+    return {name, seconds / runs, (allocationCount - allocationsBefore) / runs};
+}
+
+// Generates a workload and times each front-end phase on it separately,
+// then the whole compile() pipeline with optimization. With `jsonFile`, the
+// results are also written there as JSON for comparison across revisions.
+int runBenchmarkSuite(const GeneratorOptions &options, const string &jsonFile)
+{
+    string source = SourceGenerator(options).generate();
+    size_t lines = count(source.begin(), source.end(), '\n');
+
+    Diagnostics diagnostics(source, &cerr);
+    TokenBuffer tokens = Lexer(source, diagnostics).tokenize();
+    Parser parser(tokens, diagnostics);
+    uint32_t program = parser.parseProgram();
+    if (!diagnostics.empty())
+        return 1;
+    size_t tokenCount = tokens.size();
 
-        if (tokens[pos].type == T_INCREMENT || tokens[pos].type == T_DECREMENT)
+    vector<PhaseResult> results;
+    results.push_back(measurePhase("lex", [&]
+                                   {
+        Diagnostics discarded;
+        Lexer(source, discarded).tokenize(); }));
+    results.push_back(measurePhase("parse", [&]
+                                   {
+        Diagnostics discarded;
+        Parser(tokens, discarded).parseProgram(); }));
+    results.push_back(measurePhase("ir", [&]
+                                   {
+        ICGenerator icg(diagnostics);
+        icg.generate(parser.tree(), tokens, program); }));
+    CompileOptions pipeline;
+    pipeline.optimize = true;
+    results.push_back(measurePhase("pipeline", [&]
+                                   { compile(source, pipeline); }));
+
+    cout << "workload: " << lines << " lines, " << source.size() << " bytes, " << tokenCount << " tokens (seed "
+         << options.seed << ", " << options.declarations << " declarations, " << options.loops << " loops, depth "
+         << options.depth << ", expression " << options.expression << ", comments " << options.comments << "%)"
+         << endl;
+    for (const PhaseResult &result : results)
+    {
+        cout << result.name << ": " << result.seconds * 1e3 << " ms/run, " << source.size() / result.seconds / 1e6
+             << " MB/s, " << tokenCount / result.seconds / 1e6 << " Mtokens/s, "
+             << static_cast<double>(result.allocations) / tokenCount << " allocations/token" << endl;
+    }
+
+    if (!jsonFile.empty())
+    {
+        ofstream json(jsonFile);
+        if (!json)
         {
-            pos++;
+            cerr << "Error: Could not write " << jsonFile << '\n';
+            return 1;
         }
-        else if (tokens[pos].type == T_ASSIGN || tokens[pos].type == T_PLUS_ASSIGN ||
-                 tokens[pos].type == T_MINUS_ASSIGN || tokens[pos].type == T_MUL_ASSIGN ||
-                 tokens[pos].type == T_DIV_ASSIGN)
+        json << "{\n  \"workload\": {\"seed\": " << options.seed << ", \"declarations\": " << options.declarations
+             << ", \"loops\": " << options.loops << ", \"depth\": " << options.depth << ", \"expression\": "
+             << options.expression << ", \"comments\": " << options.comments << ", \"lines\": " << lines
+             << ", \"bytes\": " << source.size() << ", \"tokens\": " << tokenCount << "},\n  \"phases\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
         {
-            pos++;
-            parseExpression();
+            const PhaseResult &result = results[i];
+            json << "    {\"name\": \"" << result.name << "\", \"seconds_per_run\": " << result.seconds
+                 << ", \"mb_per_s\": " << source.size() / result.seconds / 1e6 << ", \"tokens_per_s\": "
+                 << tokenCount / result.seconds << ", \"allocations_per_token\": "
+                 << static_cast<double>(result.allocations) / tokenCount << "}" << (i + 1 < results.size() ? "," : "")
+                 << '\n';
+        }
+        json << "  ]\n}\n";
+    }
+    return 0;
+}
+
+// Lookup throughput of the symbol table on a generated program. Every
+// identifier token is resolved by its interned id with all of the program's
+// names declared, some of them shadowed in nested scopes; the same lookups
+// through a string-keyed hash map, as the parser used to make them, give the
+// baseline. Scope churn is timed as blocks declaring a few names each.
+int runSymbolBenchmark(const GeneratorOptions &options)
+{
+    string source = SourceGenerator(options).generate();
+    Diagnostics diagnostics(source, &cerr);
+    TokenBuffer tokens = Lexer(source, diagnostics).tokenize();
+    vector<uint32_t> uses;
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        if (tokens.types[i] == T_ID)
+            uses.push_back(tokens.values[i]);
+    }
+
+    SymbolTable table;
+    unordered_map<string, TokenType> byName;
+    for (uint32_t name : uses)
+    {
+        table.declare(name, T_INT);
+        byName[string(tokens.strings.get(name))] = T_INT;
+    }
+    for (int depth = 0; depth < options.depth; depth++)
+    {
+        table.enterScope();
+        for (size_t i = depth; i < uses.size(); i += 16)
+        {
+            table.declare(uses[i], T_FLOAT);
+        }
+    }
+    size_t shadowing = table.declarationCount() - table.size();
+
+    volatile size_t found = 0;
+    PhaseResult interned = measurePhase("interned", [&]
+                                        {
+        size_t hits = 0;
+        for (uint32_t name : uses)
+        {
+            hits += table.exists(name);
+        }
+        found = hits; });
+    PhaseResult hashed = measurePhase("string-keyed", [&]
+                                      {
+        size_t hits = 0;
+        for (uint32_t name : uses)
+        {
+            hits += byName.count(string(tokens.strings.get(name)));
+        }
+        found = hits; });
+    const size_t BLOCKS = 10000;
+    PhaseResult scopes = measurePhase("scopes", [&]
+                                      {
+        for (size_t block = 0; block < BLOCKS; block++)
+        {
+            table.enterScope();
+            for (size_t i = 0; i < 4; i++)
+            {
+                table.declare(uses[(block * 4 + i) % uses.size()], T_INT);
+            }
+            table.leaveScope();
+        } });
+
+    cout << "symbols: " << uses.size() << " identifier uses of " << table.size() << " names, " << shadowing
+         << " shadowing declarations in " << options.depth
+         << " nested scopes" << endl;
+    for (const PhaseResult &result : {interned, hashed})
+    {
+        cout << result.name << ": " << uses.size() / result.seconds / 1e6 << " Mlookups/s, "
+             << result.seconds / uses.size() * 1e9 << " ns/lookup, "
+             << static_cast<double>(result.allocations) / uses.size() << " allocations/lookup" << endl;
+    }
+    cout << "scopes: " << BLOCKS / scopes.seconds / 1e6 << " M blocks/s (enter, 4 declarations, leave)" << endl;
+    return 0;
+}
+
+// Parse time and memory per level of nesting, for programs nested `depth`
+// deep in each way the grammar allows. Both stay flat as the depth grows
+// when the parser's cost is linear in it. The depth limit is lifted so that
+// nothing is rejected.
+int runNestingBenchmark(const vector<uint32_t> &depths)
+{
+    struct Shape
+    {
+        const char *name;
+        const char *open;
+        const char *inner;
+        const char *close;
+        bool expression;
+    };
+    const Shape shapes[] = {
+        {"blocks", "{ ", "a = a + 1;", "} ", false},
+        {"if", "if (a) ", "a = a + 1;", "", false},
+        {"else-if", "if (a) a = 1; else ", "a = 2;", "", false},
+        {"while", "while (a < 2) ", "a = a + 1;", "", false},
+        {"parentheses", "(", "a", ")", true},
+        {"prefix", "- ", "a", "", true},
+        {"ternary", "a ? 1 : ", "0", "", true},
+    };
+
+    for (const Shape &shape : shapes)
+    {
+        for (uint32_t depth : depths)
+        {
+            string source = "int a = 1;\n";
+            if (shape.expression)
+                source += "a = ";
+            for (uint32_t level = 0; level < depth; level++)
+            {
+                source += shape.open;
+            }
+            source += shape.inner;
+            for (uint32_t level = 0; level < depth; level++)
+            {
+                source += shape.close;
+            }
+            source += shape.expression ? ";\n" : "\n";
+
+            Diagnostics diagnostics(source, &cerr);
+            TokenBuffer tokens = Lexer(source, diagnostics).tokenize();
+            heapTracking = true;
+            int64_t heapStart = heapInUse;
+            heapPeak = heapInUse;
+            {
+                Parser parser(tokens, diagnostics);
+                parser.setMaxDepth(UINT32_MAX);
+                parser.parseProgram();
+            }
+            int64_t peakBytes = heapPeak - heapStart;
+            heapTracking = false;
+            if (!diagnostics.empty())
+                return 1;
+
+            PhaseResult parse = measurePhase("parse", [&]
+                                             {
+                Parser parser(tokens, diagnostics);
+                parser.setMaxDepth(UINT32_MAX);
+                parser.parseProgram(); });
+
+            // Lowering walks the same depth, so it is timed on the tree too.
+            Parser parser(tokens, diagnostics);
+            parser.setMaxDepth(UINT32_MAX);
+            uint32_t program = parser.parseProgram();
+            PhaseResult lower = measurePhase("ir", [&]
+                                             {
+                ICGenerator icg(diagnostics);
+                icg.generate(parser.tree(), tokens, program); });
+            if (!diagnostics.empty())
+                return 1;
+            cout << shape.name << " at depth " << depth << ": parse " << parse.seconds * 1e3 << " ms, "
+                 << parse.seconds / depth * 1e9 << " ns/level, "
+                 << static_cast<double>(peakBytes) / depth << " peak heap bytes/level; IR generation "
+                 << lower.seconds * 1e3 << " ms, " << lower.seconds / depth * 1e9 << " ns/level" << endl;
+        }
+    }
+    return 0;
+}
+
+// Repeatedly lexes, parses, lowers and runs one input and reports throughput per phase. The
+// source is loaded once so only the compiler phases are measured.
+// Times writing the IR to a file and loading it back as the text listing and
+// as an image. No reader for the text form exists, so its load is reading the
+// file and splitting it into lines, a lower bound on parsing it.
+bool benchmarkIrImage(const IrModule &module, int iterations)
+{
+    char directory[] = "/tmp/mycompilerXXXXXX";
+    if (!mkdtemp(directory))
+    {
+        cerr << "Error: Could not create a temporary directory" << endl;
+        return false;
+    }
+    string textPath = string(directory) + "/program.txt";
+    string imagePath = string(directory) + "/program.ir";
+    auto measure = [&](auto body)
+    {
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+            body();
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count() / iterations;
+    };
+
+    double textWrite = measure([&]
+    {
+        ofstream file(textPath);
+        IrPrinter(module).print(file);
+    });
+    double imageWrite = measure([&]
+    {
+        string image = writeIrImage(module);
+        ofstream(imagePath, ios::binary).write(image.data(), image.size());
+    });
+
+    size_t lines = 0;
+    size_t textBytes = 0;
+    double textLoad = measure([&]
+    {
+        SourceFile file;
+        file.open(textPath);
+        string_view text = file.view();
+        textBytes = text.size();
+        vector<string_view> split;
+        for (size_t start = 0, end; start < text.size(); start = end + 1)
+        {
+            end = text.find('\n', start);
+            if (end == string_view::npos)
+                end = text.size();
+            split.push_back(text.substr(start, end - start));
+        }
+        lines = split.size();
+    });
+    bool valid = true;
+    size_t imageBytes = 0;
+    size_t instructions = 0;
+    double imageLoad = measure([&]
+    {
+        SourceFile file;
+        IrImage image;
+        string error;
+        valid = file.open(imagePath) && image.open(file.view(), error) && image.verify(error) && valid;
+        imageBytes = file.view().size();
+        instructions = valid ? image.codeSize() : 0;
+    });
+
+    // The dump has to reproduce the listing exactly.
+    ostringstream printed;
+    double print = measure([&]
+    {
+        printed.str(string());
+        IrPrinter(module).print(printed);
+    });
+    string image = writeIrImage(module);
+    IrImage view;
+    string error;
+    valid = valid && view.open(image, error) && view.verify(error);
+    ostringstream dumped;
+    double dump = measure([&]
+    {
+        dumped.str(string());
+        if (valid)
+            view.dump(dumped);
+    });
+    bool same = valid && instructions == module.code.size() && lines == module.code.size() &&
+                dumped.str() == printed.str();
+
+    remove(textPath.c_str());
+    remove(imagePath.c_str());
+    rmdir(directory);
+
+    cout << "ir text: " << textBytes << " bytes, write " << textWrite * 1e3 << " ms, load " << textLoad * 1e3
+         << " ms (read and split only), print " << print * 1e3 << " ms" << endl;
+    cout << "ir image: " << imageBytes << " bytes, write " << imageWrite * 1e3 << " ms ("
+         << textWrite / imageWrite << "x text), load " << imageLoad * 1e3 << " ms (" << textLoad / imageLoad
+         << "x text), dump " << dump * 1e3 << " ms (" << print / dump << "x print)"
+         << (same ? "" : ", image differs") << endl;
+    return same;
+}
+
+int runBenchmark(const string &filename, int iterations)
+{
+    SourceFile source;
+    if (!source.open(filename))
+    {
+        cerr << "Error: Could not open file " << filename << '\n';
+        return 1;
+    }
+
+    size_t tokenCount = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        Diagnostics diagnostics;
+        Lexer lexer(source.view(), diagnostics);
+        tokenCount += lexer.tokenize().size();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    double bytes = static_cast<double>(source.view().size()) * iterations;
+    cout << "lex: " << tokenCount / iterations << " tokens x " << iterations << " iterations in "
+         << seconds << " s, " << tokenCount / seconds / 1e6 << " Mtokens/s, "
+         << bytes / seconds / 1e6 << " MB/s" << endl;
+    double sequentialSeconds = seconds;
+
+    Diagnostics diagnostics(source.view(), &cerr);
+    Lexer lexer(source.view(), diagnostics);
+    TokenBuffer tokens = lexer.tokenize();
+
+    // Parallel lexing at doubling thread counts, checked against the
+    // sequential token stream.
+    unsigned cores = max(thread::hardware_concurrency(), 2u);
+    for (unsigned threads = 2; threads <= cores; threads *= 2)
+    {
+        ThreadPool pool(threads);
+        TokenBuffer parallel;
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            Diagnostics discarded;
+            parallel = ParallelLexer(pool).tokenize(source.view(), discarded);
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        bool same = parallel.types == tokens.types && parallel.offsets == tokens.offsets &&
+                    parallel.values == tokens.values;
+        cout << "lex on " << threads << " threads: " << bytes / seconds / 1e6 << " MB/s, "
+             << sequentialSeconds / seconds << "x sequential" << (same ? "" : ", tokens differ") << endl;
+        if (!same)
+            return 1;
+    }
+
+    size_t nodeCount = 0;
+    size_t arenaBytes = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        Diagnostics discarded;
+        Parser parser(tokens, discarded);
+        parser.parseProgram();
+        nodeCount += parser.tree().size();
+        arenaBytes = parser.tree().bytesReserved();
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    double parseSeconds = seconds;
+
+    size_t perRun = nodeCount / iterations;
+    cout << "parse: " << perRun << " nodes x " << iterations << " iterations in " << seconds << " s, "
+         << nodeCount / seconds / 1e6 << " Mnodes/s, " << sizeof(AstNode) << " bytes/node ("
+         << (perRun ? static_cast<double>(arenaBytes) / perRun : 0) << " with arena slack)" << endl;
+
+    Parser parser(tokens, diagnostics);
+    uint32_t program = parser.parseProgram();
+    if (!diagnostics.empty())
+        return 1;
+
+    size_t instrCount = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        ICGenerator icg(diagnostics);
+        icg.generate(parser.tree(), tokens, program);
+        instrCount += icg.ir().code.size();
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "ir: " << instrCount / iterations << " instructions x " << iterations << " iterations in "
+         << seconds << " s, " << instrCount / seconds / 1e6 << " Minstrs/s, " << sizeof(IrInstr)
+         << " bytes/instruction" << endl;
+    double sequentialFrontEnd = parseSeconds + seconds;
+
+    ICGenerator icg(diagnostics);
+    icg.generate(parser.tree(), tokens, program);
+    if (!diagnostics.empty())
+        return 1;
+
+    // Parsing and lowering at doubling thread counts, checked against the
+    // sequential IR.
+    ostringstream sequentialIr;
+    icg.printInstructions(sequentialIr);
+    for (unsigned threads = 2; threads <= cores; threads *= 2)
+    {
+        ThreadPool pool(threads);
+        Diagnostics discarded;
+        unique_ptr<ICGenerator> lowered;
+        bool split = true;
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations && split; i++)
+        {
+            ParallelParser parallel(pool, tokens);
+            split = parallel.parse(discarded);
+            if (split)
+            {
+                lowered.reset(new ICGenerator(discarded));
+                parallel.generate(*lowered, discarded);
+            }
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (!split)
+        {
+            cout << "parse and ir on " << threads << " threads: too small to split" << endl;
+            break;
+        }
+        ostringstream parallelIr;
+        lowered->printInstructions(parallelIr);
+        bool same = parallelIr.str() == sequentialIr.str();
+        cout << "parse and ir on " << threads << " threads: " << sequentialFrontEnd / seconds
+             << "x sequential" << (same ? "" : ", IR differs") << endl;
+        if (!same)
+            return 1;
+    }
+    if (!benchmarkIrImage(icg.ir(), iterations))
+        return 1;
+
+    Bytecode bytecode = BytecodeGenerator(icg.ir()).generate();
+    VirtualMachine vm;
+    uint64_t executed = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        VmResult result = vm.run(bytecode);
+        if (!result.ok)
+            return 1;
+        executed += result.executed;
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "vm: " << executed / iterations << " instructions executed x " << iterations << " iterations in "
+         << seconds << " s, " << executed / seconds / 1e6 << " Minstrs/s" << endl;
+    return 0;
+}
+
+// Applies small edits to one input through an IncrementalDocument and times
+// them against lexing and parsing the whole text again. Alternates between
+// changing a number literal and inserting a declaration before a statement,
+// then checks that the result matches a full parse.
+int runEditBenchmark(const string &filename, int edits)
+{
+    SourceFile source;
+    if (!source.open(filename))
+    {
+        cerr << "Error: Could not open file " << filename << '\n';
+        return 1;
+    }
+    string text(source.view());
+    size_t lines = count(text.begin(), text.end(), '\n');
+
+    auto start = chrono::steady_clock::now();
+    IncrementalDocument document(text);
+    double fullSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    mt19937 random(1);
+    vector<pair<size_t, size_t>> candidates; // offset and length
+    size_t relexed = 0, reparsed = 0;
+    double editSeconds = 0;
+    for (int i = 0; i < edits; i++)
+    {
+        TokenType wanted = i % 2 == 0 ? T_NUM : T_INT;
+        candidates.clear();
+        document.forEachToken([&](TokenType type, uint32_t offset, string_view lexeme)
+                              {
+                                  if (type == wanted)
+                                      candidates.push_back({offset, lexeme.size()}); });
+        if (candidates.empty())
+            continue;
+        size_t pick = random() % candidates.size();
+        size_t offset = candidates[pick].first;
+        size_t end = offset;
+        string replacement;
+        if (wanted == T_NUM)
+        {
+            end += candidates[pick].second;
+            replacement = to_string(random() % 100000);
         }
         else
         {
-            cerr << "Expected assignment or increment/decrement operator at line " << lineNumber << endl;
+            replacement = "int edited" + to_string(i) + " = " + to_string(i) + ";\n";
+        }
+
+        start = chrono::steady_clock::now();
+        document.edit(offset, end, replacement);
+        editSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        relexed += document.relexedTokens();
+        reparsed += document.reparsedStatements();
+    }
+
+    ostringstream incremental, full;
+    document.printAst(incremental);
+    IncrementalDocument reference(document.source());
+    reference.printAst(full);
+    bool matches = incremental.str() == full.str() &&
+                   document.diagnostics().size() == reference.diagnostics().size();
+
+    double perEdit = editSeconds / max(edits, 1);
+    cout << "edit: " << edits << " edits on " << lines << " lines, " << perEdit * 1e6 << " us/edit ("
+         << static_cast<double>(relexed) / max(edits, 1) << " tokens re-lexed, "
+         << static_cast<double>(reparsed) / max(edits, 1) << " statements re-parsed), full parse "
+         << fullSeconds * 1e3 << " ms, " << fullSeconds / perEdit << "x" << endl;
+    if (!matches)
+    {
+        cout << "Incremental result differs from a full parse" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Builds the compiled program natively with the system C compiler driver and
+// runs it, comparing exit status and wall-clock time with the VM run in
+// `result`.
+int compareWithNative(const CompileResult &result, ostream &out, ostream &diag)
+{
+    char directory[] = "/tmp/mycompilerXXXXXX";
+    if (!mkdtemp(directory))
+    {
+        diag << "Error: Could not create a temporary directory" << endl;
+        return 1;
+    }
+    string asmPath = string(directory) + "/program.s";
+    string exePath = string(directory) + "/program";
+    {
+        ofstream file(asmPath);
+        file << result.assembly;
+    }
+
+    int status = system(("cc -o " + exePath + " " + asmPath + " -lm").c_str());
+    if (status != 0)
+    {
+        diag << "Error: Could not assemble " << asmPath << endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    status = system(exePath.c_str());
+    double nativeSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    int nativeStatus = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    int vmStatus = result.executed ? static_cast<int>(result.returnValue & 255) : 1;
+
+    unlink(exePath.c_str());
+    unlink(asmPath.c_str());
+    rmdir(directory);
+
+    out << "native: exit status " << nativeStatus << " in " << nativeSeconds << " s" << endl;
+    out << "vm: exit status " << vmStatus << " in " << result.executeSeconds << " s ("
+        << result.instructionsExecuted << " instructions executed)" << endl;
+    if (nativeStatus != vmStatus)
+    {
+        out << "Mismatch between native and interpreted results" << endl;
+        return 1;
+    }
+    out << "Results match, native speedup " << result.executeSeconds / nativeSeconds << "x" << endl;
+    return 0;
+}
+
+// Fused lex -> parse -> IR pipeline. Tokens are lexed as the parser asks for
+// them and IR is printed after every top-level statement, so memory is bounded
+// by the largest statement rather than by the input.
+int compileStreaming(const string &filename, bool optimize, uint32_t maxDepth)
+{
+    SourceFile source;
+    unique_ptr<ChunkReader> reader;
+    unique_ptr<Diagnostics> diagnostics;
+    unique_ptr<Lexer> lexer;
+
+    struct stat st;
+    if (filename != "-" && stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (!source.open(filename))
+        {
+            cerr << "Error: Could not open file " << filename << '\n';
+            return 1;
+        }
+        diagnostics.reset(new Diagnostics(source.view(), &cerr));
+        lexer.reset(new Lexer(source.view(), *diagnostics));
+    }
+    else
+    {
+        int fd = filename == "-" ? STDIN_FILENO : open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            cerr << "Error: Could not open file " << filename << '\n';
+            return 1;
+        }
+        reader.reset(new ChunkReader(fd));
+        diagnostics.reset(new Diagnostics(string_view(), &cerr));
+        lexer.reset(new Lexer(*reader, *diagnostics));
+    }
+
+    TokenBuffer window;
+    TokenFeed feed{lexer.get(), window};
+    Parser parser(feed, *diagnostics);
+    if (maxDepth)
+        parser.setMaxDepth(maxDepth);
+    ICGenerator icg(*diagnostics);
+    IrOptimizer optimizer;
+    LoopOptimizer loops;
+
+    const size_t RELEASE_INTERVAL = 1 << 20;
+    size_t released = 0;
+    parser.parseProgramStreaming([&](const TokenBuffer &tokens, size_t, const AstArena &ast, uint32_t statement)
+                                 {
+        // Errors are reported as they are found; no more code is printed
+        // after the first.
+        if (!diagnostics->empty())
+            return;
+        icg.generate(ast, tokens, statement);
+        if (!diagnostics->empty())
+            return;
+        if (optimize)
+        {
+            optimizer.optimize(icg.ir());
+            loops.optimize(icg.ir());
         }
+        icg.printInstructions();
+        icg.clearInstructions();
+        cout.flush();
+
+        if (tokens.offsets[0] >= released + RELEASE_INTERVAL)
+        {
+            released = tokens.offsets[0];
+            source.release(released);
+        } });
+    if (!diagnostics->empty())
+        return 1;
+    parser.printSummary();
+    if (optimize)
+    {
+        optimizer.printSummary();
+        loops.printSummary();
+    }
+
+    return 0;
+}
+
+// Command-line options on top of the library's.
+struct UnitOptions
+{
+    CompileOptions compile;
+    bool compare = false;
+    string asmFile;
+    string irFile; // write the binary IR image here
+    bool qualify = false; // prefix diagnostics with the input path, as batches do
+    bool stats = false; // print a CompileStats report with the diagnostics
+    string statsJson;   // also write the reports to this file
+};
+
+// Writes a compiled unit's listing to `out` and its diagnostics to `diag`,
+// located by `path` when one is given. Returns the unit's exit status.
+int printResult(const CompileResult &result, const CompileOptions &options, ostream &out, ostream &diag,
+                const string *path = nullptr)
+{
+    for (const Diagnostic &diagnostic : result.diagnostics)
+    {
+        if (path)
+            Diagnostics::print(diag, diagnostic, *path);
+        else
+            Diagnostics::print(diag, diagnostic);
+    }
+    if (!result.ok)
+        return 1;
+
+    out << "Parsing completed successfully" << endl;
+    out << result.symbols << result.ast << result.ir << result.report;
 
-        if (tokens[pos].type == T_INCREMENT || tokens[pos].type == T_DECREMENT)
+    if (!result.runtimeError.empty())
+    {
+        diag << result.runtimeError << endl;
+    }
+    if (options.execute)
+    {
+        if (!result.executed)
+            return 1;
+        out << "Program returned " << result.returnValue << " (" << result.instructionsExecuted
+            << " instructions executed)" << endl;
+    }
+    return 0;
+}
+
+// Compiles one input file, writing its listing to `out` and its diagnostics
+// to `diag`. `stats`, if given, is filled in for --stats and --stats-json.
+// Returns the unit's exit status.
+int compileUnit(const string &filename, const UnitOptions &options, ostream &out, ostream &diag,
+                CompileStats *stats = nullptr)
+{
+    PhaseScope unit(nullptr, filename.c_str());
+    SourceFile source;
+
+    if (!source.open(filename))
+    {
+        diag << "Error: Could not open file " << filename << '\n';
+        return 1;
+    }
+
+    CompileOptions compileOptions = options.compile;
+    compileOptions.execute |= options.compare;
+    compileOptions.emitAssembly |= options.compare || !options.asmFile.empty();
+    compileOptions.emitIrImage |= !options.irFile.empty();
+    CompileResult result = compile(source.view(), compileOptions, stats);
+    int status = printResult(result, options.compile, out, diag, options.qualify ? &filename : nullptr);
+    if (stats && options.stats)
+    {
+        diag << "stats for " << filename << ":\n";
+        stats->print(diag);
+    }
+    if (status != 0 || !result.ok)
+        return status;
+
+    if (!options.asmFile.empty())
+    {
+        ofstream file(options.asmFile);
+        if (!file)
         {
-            pos++;
+            diag << "Error: Could not write " << options.asmFile << '\n';
+            return 1;
         }
+        file << result.assembly;
     }
 
-    void parseBlock()
+    if (!options.irFile.empty())
     {
-        expect(T_LBRACE);
-        while (tokens[pos].type != T_RBRACE && tokens[pos].type != T_EOF)
+        ofstream file(options.irFile, ios::binary);
+        if (!file || !file.write(result.irImage.data(), result.irImage.size()))
         {
-            parseStatement();
+            diag << "Error: Could not write " << options.irFile << '\n';
+            return 1;
         }
-        expect(T_RBRACE);
     }
 
-    void parseBreakStatement()
+    if (options.compare)
     {
-        expect(T_BREAK);
-        expect(T_SEMICOLON);
+        return compareWithNative(result, out, diag);
     }
 
-    void parseContinueStatement()
+    return 0;
+}
+
+// Writes the --stats-json report: one entry per input, in input order.
+bool writeStatsJson(const string &path, const vector<string> &inputs, const vector<CompileStats> &stats)
+{
+    ofstream json(path);
+    if (!json)
     {
-        expect(T_CONTINUE);
-        expect(T_SEMICOLON);
+        cerr << "Error: Could not write " << path << '\n';
+        return false;
+    }
+    json << "{\"units\": [\n";
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        json << "  {\"file\": ";
+        writeJsonString(json, inputs[i]);
+        json << ", \"stats\":\n   ";
+        stats[i].printJson(json);
+        json << "}" << (i + 1 < inputs.size() ? "," : "") << '\n';
     }
+    json << "]}\n";
+    return true;
+}
 
-    void parseExpression()
+// Expands the command-line inputs of a batch: `@list` names a response file
+// with one input per line, and a directory stands for the regular files in
+// it, in name order.
+bool expandInputs(const vector<string> &arguments, vector<string> &inputs)
+{
+    for (const string &argument : arguments)
     {
-        if (tokens[pos].type == T_ID || tokens[pos].type == T_NUM || tokens[pos].type == T_TRUE || tokens[pos].type == T_FALSE)
+        if (argument.size() > 1 && argument[0] == '@')
         {
-            parseTernaryExpression();
+            ifstream list(argument.substr(1));
+            if (!list)
+            {
+                cerr << "Error: Could not open response file " << argument.substr(1) << '\n';
+                return false;
+            }
+            string line;
+            while (getline(list, line))
+            {
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                if (!line.empty())
+                    inputs.push_back(line);
+            }
+            continue;
         }
-        else
+
+        struct stat st;
+        if (stat(argument.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
         {
-            parseLogicalOr();
+            DIR *directory = opendir(argument.c_str());
+            if (!directory)
+            {
+                cerr << "Error: Could not open directory " << argument << '\n';
+                return false;
+            }
+            vector<string> files;
+            while (dirent *entry = readdir(directory))
+            {
+                string path = argument + "/" + entry->d_name;
+                if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                    files.push_back(path);
+            }
+            closedir(directory);
+            sort(files.begin(), files.end());
+            inputs.insert(inputs.end(), files.begin(), files.end());
+            continue;
         }
+
+        inputs.push_back(argument);
     }
+    return true;
+}
 
-    void parseTernaryExpression()
+// Compiles every input on the pool. Each unit writes into its own buffers,
+// which are printed strictly in input order as soon as all earlier units are
+// done. Returns 1 if any unit failed.
+int compileBatch(const vector<string> &inputs, const UnitOptions &batchOptions, ThreadPool &pool, bool print = true)
+{
+    UnitOptions options = batchOptions;
+    options.qualify = true;
+    struct Unit
     {
-        parseLogicalOr();
-
-        if (tokens[pos].type == T_QUESTION)
-        {
-            pos++;
-            parseExpression();
+        ostringstream out;
+        ostringstream diag;
+        CompileStats stats;
+        int status = 0;
+        bool done = false;
+    };
+    vector<Unit> units(inputs.size());
+    mutex lock;
+    condition_variable finished;
 
-            expect(T_COLON);
-            parseExpression();
-        }
-    }
+    pool.start(inputs.size(), [&](size_t i)
+               {
+        Unit &unit = units[i];
+        bool collect = options.stats || !options.statsJson.empty();
+        unit.status = compileUnit(inputs[i], options, unit.out, unit.diag, collect ? &unit.stats : nullptr);
+        lock_guard<mutex> guard(lock);
+        unit.done = true;
+        finished.notify_all(); });
 
-    void parseLogicalOr()
+    int status = 0;
+    for (size_t i = 0; i < units.size(); i++)
     {
-        parseLogicalAnd();
-        while (tokens[pos].type == T_OR)
+        Unit &unit = units[i];
         {
-            pos++;
-            parseLogicalAnd();
+            unique_lock<mutex> guard(lock);
+            finished.wait(guard, [&]
+                          { return unit.done; });
+        }
+        if (print)
+        {
+            // Listings follow each other on stdout, so each names its input.
+            if (inputs.size() > 1 && unit.out.tellp() > 0)
+                cout << "==> " << inputs[i] << " <==\n";
+            cout << unit.out.str();
+            cout.flush();
+            cerr << unit.diag.str();
         }
+        unit.out.str(string());
+        unit.diag.str(string());
+        status |= unit.status;
     }
-
-    void parseLogicalAnd()
+    pool.wait();
+    if (!options.statsJson.empty())
     {
-        parseEquality();
-        while (tokens[pos].type == T_AND)
+        vector<CompileStats> stats;
+        for (Unit &unit : units)
         {
-            pos++;
-            parseEquality();
+            stats.push_back(unit.stats);
         }
+        if (!writeStatsJson(options.statsJson, inputs, stats))
+            status = 1;
     }
+    return status;
+}
 
-    void parseEquality()
+// Times batch compilation of the inputs with 1, 2, 4, ... threads up to the
+// machine's hardware concurrency, discarding the output.
+int runBatchBenchmark(const vector<string> &inputs)
+{
+    unsigned hardware = max(thread::hardware_concurrency(), 1u);
+    vector<unsigned> counts;
+    for (unsigned threads = 1; threads < hardware; threads *= 2)
     {
-        parseRelational();
-        while (tokens[pos].type == T_EQ || tokens[pos].type == T_NEQ)
-        {
-            pos++;
-            parseRelational();
-        }
+        counts.push_back(threads);
     }
+    counts.push_back(hardware);
 
-    void parseRelational()
+    double baseline = 0;
+    for (unsigned threads : counts)
     {
-        parseAdditive();
-        while (tokens[pos].type == T_GT || tokens[pos].type == T_LT || tokens[pos].type == T_GTE || tokens[pos].type == T_LTE)
-        {
-            pos++;
-            parseAdditive();
-        }
+        ThreadPool pool(threads);
+        auto start = chrono::steady_clock::now();
+        compileBatch(inputs, UnitOptions(), pool, false);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double rate = inputs.size() / seconds;
+        if (threads == 1)
+            baseline = rate;
+        cout << "batch: " << inputs.size() << " files on " << threads << " threads in " << seconds << " s, "
+             << rate << " files/s, " << rate / baseline << "x" << endl;
     }
+    return 0;
+}
+
+// 64-bit xxHash (XXH64) of `length` bytes.
+uint64_t hashBytes(const char *data, size_t length, uint64_t seed)
+{
+    const uint64_t P1 = 11400714785074694791ull, P2 = 14029467366897019727ull, P3 = 1609587929392839161ull,
+                   P4 = 9650029242287828579ull, P5 = 2870177450012600261ull;
+    auto rotl = [](uint64_t x, int r)
+    { return (x << r) | (x >> (64 - r)); };
+    auto round = [&](uint64_t acc, uint64_t input)
+    { return rotl(acc + input * P2, 31) * P1; };
+    auto read64 = [](const char *p)
+    { uint64_t v; memcpy(&v, p, 8); return v; };
+    auto read32 = [](const char *p)
+    { uint32_t v; memcpy(&v, p, 4); return static_cast<uint64_t>(v); };
 
-    void parseAdditive()
+    const char *p = data;
+    const char *end = data + length;
+    uint64_t h;
+    if (length >= 32)
     {
-        parseMultiplicative();
-        while (tokens[pos].type == T_PLUS || tokens[pos].type == T_MINUS)
+        uint64_t v[4] = {seed + P1 + P2, seed + P2, seed, seed - P1};
+        for (; p + 32 <= end; p += 32)
         {
-            pos++;
-            parseMultiplicative();
+            for (int i = 0; i < 4; i++)
+                v[i] = round(v[i], read64(p + 8 * i));
         }
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = (h ^ round(0, v[i])) * P1 + P4;
+    }
+    else
+    {
+        h = seed + P5;
+    }
+    h += length;
+    for (; p + 8 <= end; p += 8)
+        h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end)
+    {
+        h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+        p += 4;
     }
+    for (; p < end; p++)
+        h = rotl(h ^ (static_cast<unsigned char>(*p) * P5), 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
 
-    void parseMultiplicative()
+// Maps an image written by --emit-ir, checks it and prints its instructions
+// in the listing format.
+int dumpIrImage(const string &filename)
+{
+    SourceFile file;
+    if (!file.open(filename))
     {
-        parseUnary();
-        while (tokens[pos].type == T_MUL || tokens[pos].type == T_DIV || tokens[pos].type == T_MOD)
-        {
-            pos++;
-            parseUnary();
-        }
+        cerr << "Error: Could not open file " << filename << '\n';
+        return 1;
+    }
+    IrImage image;
+    string error;
+    if (!image.open(file.view(), error) || !image.verify(error))
+    {
+        cerr << "Error: " << filename << ": " << error << '\n';
+        return 1;
     }
+    image.dump(cout);
+    cout.flush();
+    return 0;
+}
+
+// Wire format between --client and --server. A request is a ServerRequest
+// followed by the source bytes; the reply is a ServerReply followed by the
+// listing and then the diagnostics.
+struct ServerRequest
+{
+    uint32_t flags; // SERVER_* option bits
+    uint32_t length;
+};
+
+struct ServerReply
+{
+    int32_t status;
+    uint32_t outLength;
+    uint32_t diagLength;
+};
 
-    void parseUnary()
+const uint32_t SERVER_DUMP_AST = 1;
+const uint32_t SERVER_OPTIMIZE = 2;
+const uint32_t SERVER_EXECUTE = 4;
+const uint32_t SERVER_FLAGS = SERVER_DUMP_AST | SERVER_OPTIMIZE | SERVER_EXECUTE;
+
+bool readFully(int fd, void *buffer, size_t length)
+{
+    char *p = static_cast<char *>(buffer);
+    while (length > 0)
     {
-        if (tokens[pos].type == T_PLUS || tokens[pos].type == T_MINUS || tokens[pos].type == T_INCREMENT || tokens[pos].type == T_DECREMENT)
-        {
-            pos++;
-        }
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
 
-        if (tokens[pos].type == T_ID || tokens[pos].type == T_NUM || tokens[pos].type == T_TRUE || tokens[pos].type == T_FALSE || tokens[pos].type == T_CHAR_LITERAL || tokens[pos].type == T_FLOAT_LITERAL)
-        {
-            pos++;
-        }
-        else if (tokens[pos].type == T_LPAREN)
-        {
-            pos++;
-            parseExpression();
-            expect(T_RPAREN);
-        }
-        else
-        {
-            cerr << "Expected a valid expression at line " << lineNumber << endl;
-        }
+bool writeFully(int fd, const void *buffer, size_t length)
+{
+    const char *p = static_cast<const char *>(buffer);
+    while (length > 0)
+    {
+        ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        length -= n;
     }
+    return true;
+}
 
-    TokenType expectType()
+bool unixSocketAddress(const string &path, sockaddr_un &address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
     {
-        TokenType type = tokens[pos].type;
-        if (type == T_INT || type == T_CHAR || type == T_FLOAT || type == T_DOUBLE || type == T_BOOLEAN)
-        {
-            pos++;
-            return type;
-        }
-        cerr << "Expected a type at line " << lineNumber << endl;
-        exit(1);
+        cerr << "Error: Socket path too long: " << path << '\n';
+        return false;
     }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
 
-    Token expect(TokenType expectedType)
+// Bumped whenever the layout of a stored reply changes.
+const uint32_t CACHE_FORMAT_VERSION = 2;
+
+// Identifies the running compiler by a hash of its own executable, so that
+// replies cached by another build are never served.
+uint64_t compilerBuild()
+{
+    SourceFile executable;
+    if (!executable.open("/proc/self/exe"))
+        return 0;
+    return hashBytes(executable.view().data(), executable.view().size(), CACHE_FORMAT_VERSION);
+}
+
+// What a cached reply is checked against on a hit, on top of its key: the
+// source length and a second, independently seeded hash of the source.
+struct CacheCheck
+{
+    uint64_t length;
+    uint64_t hash;
+
+    bool operator==(const CacheCheck &other) const
     {
-        if (tokens[pos].type == expectedType)
-        {
-            return tokens[pos++];
-        }
-        cerr << "Expected token type " << expectedType << " at line " << lineNumber << endl;
-        exit(1);
+        return length == other.length && hash == other.hash;
     }
 };
 
-class ICGenerator
+// Compiled replies keyed by a hash of the compiler build, the options and
+// the source bytes, evicted least recently used first once they exceed
+// `capacity` bytes. With a directory, replies are also stored on disk, as a
+// CacheCheck followed by the reply, and survive a server restart.
+class ResultCache
 {
 private:
-    vector<string> instructions;
-    stack<string> operands;
-    int tempVarCounter;
+    struct Entry
+    {
+        uint64_t key;
+        CacheCheck check;
+        string reply; // ServerReply header and payload, ready to send
+    };
+
+    list<Entry> entries; // most recently used first
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+    size_t capacity;
+    size_t bytes;
+    string directory;
+    uint64_t build;
+
+    string diskPath(uint64_t key) const
+    {
+        char name[48];
+        snprintf(name, sizeof(name), "v%u-%016llx-%016llx", CACHE_FORMAT_VERSION,
+                 static_cast<unsigned long long>(build), static_cast<unsigned long long>(key));
+        return directory + "/" + name;
+    }
 
-    string getTempVar()
+    void insert(uint64_t key, const CacheCheck &check, string reply)
     {
-        return "t" + to_string(tempVarCounter++);
+        bytes += reply.size();
+        entries.push_front({key, check, move(reply)});
+        index[key] = entries.begin();
+        while (bytes > capacity && entries.size() > 1)
+        {
+            bytes -= entries.back().reply.size();
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
     }
 
 public:
-    ICGenerator() : tempVarCounter(1) {}
-    void processToken(const vector<Token> &tokens)
+    ResultCache(size_t capacity, const string &directory, uint64_t build)
+        : capacity(capacity), bytes(0), directory(directory), build(build)
     {
-        for (size_t i = 0; i < tokens.size(); ++i)
+    }
+
+    // Null unless a reply for `key` was stored for a source that passes `check`.
+    const string *find(uint64_t key, const CacheCheck &check)
+    {
+        auto found = index.find(key);
+        if (found != index.end())
         {
-            const Token &token = tokens[i];
+            if (!(found->second->check == check))
+                return nullptr;
+            entries.splice(entries.begin(), entries, found->second);
+            return &found->second->reply;
+        }
+        if (directory.empty())
+            return nullptr;
+        ifstream file(diskPath(key), ios::binary);
+        if (!file)
+            return nullptr;
+        CacheCheck stored;
+        if (!file.read(reinterpret_cast<char *>(&stored), sizeof(stored)) || !(stored == check))
+            return nullptr;
+        string reply((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        if (reply.size() < sizeof(ServerReply))
+            return nullptr;
+        insert(key, check, move(reply));
+        return &entries.front().reply;
+    }
 
-            switch (token.type)
+    const string &store(uint64_t key, const CacheCheck &check, string reply)
+    {
+        // Two connections may have compiled the same source at once.
+        auto found = index.find(key);
+        if (found != index.end() && found->second->check == check)
+            return found->second->reply;
+        if (found != index.end())
+        {
+            bytes -= found->second->reply.size();
+            entries.erase(found->second);
+            index.erase(found);
+        }
+        if (!directory.empty())
+        {
+            // Written under a temporary name and renamed, so a concurrent
+            // reader never sees a partial file.
+            string path = diskPath(key);
+            string temporary = path + ".tmp" + to_string(getpid()) + "." +
+                               to_string(hash<thread::id>()(this_thread::get_id()));
             {
-            case T_ID:
-            case T_NUM:
-                operands.push(token.value);
-                break;
+                ofstream file(temporary, ios::binary);
+                file.write(reinterpret_cast<const char *>(&check), sizeof(check));
+                file << reply;
+            }
+            rename(temporary.c_str(), path.c_str());
+        }
+        insert(key, check, move(reply));
+        return entries.front().reply;
+    }
 
-            case T_PLUS:
-            case T_MINUS:
-            case T_MUL:
-            case T_DIV:
-            case T_MOD:
-            {
-                // Ensure there are enough operands for binary operations
-                if (operands.size() < 2)
-                {
-                    cerr << "Error: Insufficient operands for operator '" << token.value << "'." << endl;
-                    return;
-                }
+    size_t size() const
+    {
+        return entries.size();
+    }
+};
 
-                string right = operands.top();
-                operands.pop();
-                string left = operands.top();
-                operands.pop();
+volatile sig_atomic_t serverStopping = 0;
 
-                string temp = getTempVar();
-                string operation = (token.type == T_PLUS) ? "+" : (token.type == T_MINUS) ? "-"
-                                                              : (token.type == T_MUL)     ? "*"
-                                                              : (token.type == T_DIV)     ? "/"
-                                                                                          : "%";
+void stopServer(int)
+{
+    serverStopping = 1;
+}
 
-                instructions.push_back(temp + " = " + left + " " + operation + " " + right);
-                operands.push(temp);
-                break;
-            }
+// A connection that sends or accepts nothing for this long is dropped.
+const int SERVER_TIMEOUT_SECONDS = 10;
 
-            case T_ASSIGN:
-                if (i + 1 < tokens.size() && tokens[i + 1].type == T_ID)
-                {
-                    string var = tokens[++i].value;
-                    if (operands.empty())
-                    {
-                        cerr << "Error: No operand to assign to variable " << var << endl;
-                        return;
-                    }
-                    string value = operands.top();
-                    operands.pop();
-                    instructions.push_back(var + " = " + value);
-                }
-                break;
+// Larger requests are refused before their source is read.
+const uint32_t SERVER_MAX_REQUEST = 64 << 20;
 
-            case T_PLUS_ASSIGN:
-            case T_MINUS_ASSIGN:
-            case T_MUL_ASSIGN:
-            case T_DIV_ASSIGN:
-            {
-                if (i + 1 < tokens.size() && tokens[i + 1].type == T_ID)
-                {
-                    string var = tokens[++i].value;
-                    if (operands.empty())
-                    {
-                        cerr << "Error: No operand for assignment operation to variable " << var << endl;
-                        return;
-                    }
-                    string value = operands.top();
-                    operands.pop();
+// Connections beyond this many wait in the listen backlog.
+const unsigned SERVER_MAX_CONNECTIONS = 64;
 
-                    string operation = (token.type == T_PLUS_ASSIGN) ? "+=" : (token.type == T_MINUS_ASSIGN) ? "-="
-                                                                          : (token.type == T_MUL_ASSIGN)     ? "*="
-                                                                                                             : "/=";
+// What the connections of one server share. Held by each connection's
+// thread, so it outlives runServer() if a compile is still running.
+struct ServerState
+{
+    ResultCache cache;
+    uint64_t build;
+    mutex lock; // guards the cache, the counters and the log
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    unsigned connections = 0; // being served
+    condition_variable released;
 
-                    instructions.push_back(var + " " + operation + " " + value);
-                }
-                break;
-            }
+    ServerState(size_t cacheBytes, const string &cacheDirectory, uint64_t build)
+        : cache(cacheBytes, cacheDirectory, build), build(build)
+    {
+    }
+};
 
-            case T_EQ:
-            case T_NEQ:
-            case T_GT:
-            case T_LT:
-            case T_GTE:
-            case T_LTE:
-            {
-                // Comparison operators
-                if (operands.size() < 2)
-                {
-                    cerr << "Error: Insufficient operands for comparison operator '" << token.value << "'." << endl;
-                    return;
-                }
+// Replies with an error and closes the connection.
+void refuseRequest(int connection, const string &message)
+{
+    ServerReply header = {1, 0, static_cast<uint32_t>(message.size())};
+    writeFully(connection, &header, sizeof(header));
+    writeFully(connection, message.data(), message.size());
+    close(connection);
+}
 
-                string right = operands.top();
-                operands.pop();
-                string left = operands.top();
-                operands.pop();
+void serveConnection(ServerState &state, int connection)
+{
+    timeval timeout = {SERVER_TIMEOUT_SECONDS, 0};
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-                string temp = getTempVar();
-                string comparison = (token.type == T_EQ) ? "==" : (token.type == T_NEQ) ? "!="
-                                                              : (token.type == T_GT)    ? ">"
-                                                              : (token.type == T_LT)    ? "<"
-                                                              : (token.type == T_GTE)   ? ">="
-                                                                                        : "<=";
+    ServerRequest request;
+    string source;
+    if (!readFully(connection, &request, sizeof(request)))
+    {
+        close(connection);
+        return;
+    }
+    if (request.length > SERVER_MAX_REQUEST)
+    {
+        refuseRequest(connection, "Error: Request of " + to_string(request.length) +
+                                      " bytes is larger than the server's limit of " + to_string(SERVER_MAX_REQUEST) + '\n');
+        return;
+    }
+    auto start = chrono::steady_clock::now();
+    source.resize(request.length);
+    if (!readFully(connection, &source[0], source.size()))
+    {
+        close(connection);
+        return;
+    }
+    // Checked once the source is read, so closing does not reset the
+    // connection before the client sees the reply.
+    if (request.flags & ~SERVER_FLAGS)
+    {
+        refuseRequest(connection, "Error: Unknown request flags " + to_string(request.flags & ~SERVER_FLAGS) + '\n');
+        return;
+    }
 
-                instructions.push_back(temp + " = " + left + " " + comparison + " " + right);
-                operands.push(temp);
-                break;
-            }
+    uint64_t seed = hashBytes(reinterpret_cast<const char *>(&request.flags), sizeof(request.flags), state.build);
+    uint64_t key = hashBytes(source.data(), source.size(), seed);
+    CacheCheck check = {source.size(), hashBytes(source.data(), source.size(), ~seed)};
+    string reply;
+    bool hit;
+    {
+        lock_guard<mutex> guard(state.lock);
+        const string *cached = state.cache.find(key, check);
+        hit = cached != nullptr;
+        if (hit)
+            reply = *cached;
+    }
+    if (!hit)
+    {
+        CompileOptions options;
+        options.dumpAst = request.flags & SERVER_DUMP_AST;
+        options.optimize = request.flags & SERVER_OPTIMIZE;
+        options.execute = request.flags & SERVER_EXECUTE;
+        ostringstream out, diag;
+        ServerReply header;
+        header.status = printResult(compile(source, options), options, out, diag);
+        string outText = out.str(), diagText = diag.str();
+        header.outLength = outText.size();
+        header.diagLength = diagText.size();
+        reply = string(reinterpret_cast<const char *>(&header), sizeof(header)) + outText + diagText;
+        lock_guard<mutex> guard(state.lock);
+        state.cache.store(key, check, reply);
+    }
+    writeFully(connection, reply.data(), reply.size());
+    close(connection);
 
-            case T_AND:
-            case T_OR:
-            {
-                // Logical operators
-                if (operands.size() < 2)
-                {
-                    cerr << "Error: Insufficient operands for logical operator '" << token.value << "'." << endl;
-                    return;
-                }
+    double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    lock_guard<mutex> guard(state.lock);
+    (hit ? state.hits : state.misses)++;
+    cerr << (hit ? "hit " : "miss ") << source.size() << " bytes in " << micros << " us (" << state.hits
+         << " hits, " << state.misses << " misses, " << state.cache.size() << " cached)" << endl;
+}
 
-                string right = operands.top();
-                operands.pop();
-                string left = operands.top();
-                operands.pop();
+// Serves compile requests on a Unix domain socket until interrupted, each
+// connection on its own thread, so a slow client or a long --run does not
+// hold up the others. At most SERVER_MAX_CONNECTIONS are served at once. The process stays warm between requests and repeated
+// sources are answered from the cache without compiling.
+int runServer(const string &socketPath, size_t cacheBytes, const string &cacheDirectory)
+{
+    sockaddr_un address;
+    if (!unixSocketAddress(socketPath, address))
+        return 1;
+    if (!cacheDirectory.empty())
+        mkdir(cacheDirectory.c_str(), 0755);
 
-                string temp = getTempVar();
-                string logicalOp = (token.type == T_AND) ? "&&" : "||";
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listener, 64) != 0)
+    {
+        cerr << "Error: Could not listen on " << socketPath << '\n';
+        return 1;
+    }
 
-                instructions.push_back(temp + " = " + left + " " + logicalOp + " " + right);
-                operands.push(temp);
-                break;
-            }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
 
-            case T_TRUE:
-            case T_FALSE:
-                // Boolean values
-                operands.push(token.value);
-                break;
+    shared_ptr<ServerState> state = make_shared<ServerState>(cacheBytes, cacheDirectory, compilerBuild());
 
-            case T_IF:
-            case T_ELSE:
-            case T_RETURN:
-            case T_SWITCH:
-            case T_CASE:
-            case T_BREAK:
-            case T_CONTINUE:
-            case T_DEFAULT:
+    // Connection threads start with the stop signals blocked, so they are
+    // always delivered to the accepting thread.
+    sigset_t stopSignals, previous;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    while (!serverStopping)
+    {
+        {
+            // Woken periodically to notice a stop signal.
+            unique_lock<mutex> guard(state->lock);
+            if (state->connections >= SERVER_MAX_CONNECTIONS)
             {
-                // Handle control flow
-                string controlFlow = token.value;
-                instructions.push_back(controlFlow + " statement");
-                break;
+                state->released.wait_for(guard, chrono::milliseconds(100));
+                continue;
             }
+        }
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0)
+            continue;
+        {
+            lock_guard<mutex> guard(state->lock);
+            state->connections++;
+        }
+        pthread_sigmask(SIG_BLOCK, &stopSignals, &previous);
+        thread([state, connection]
+               {
+                   serveConnection(*state, connection);
+                   lock_guard<mutex> guard(state->lock);
+                   state->connections--;
+                   state->released.notify_one(); })
+            .detach();
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
 
-            case T_FOR:
-            case T_WHILE:
-            {
-                // Handle loops
-                string loop = token.value;
-                instructions.push_back(loop + " loop");
-                break;
-            }
+    close(listener);
+    unlink(socketPath.c_str());
+    return 0;
+}
 
-            case T_EOL:
-                // End of line
-                instructions.push_back("End of Line");
-                break;
+// Sends one input to a running server and prints its reply as if the
+// input had been compiled in this process.
+int runClient(const string &socketPath, const string &filename, const CompileOptions &options)
+{
+    SourceFile source;
+    if (!source.open(filename))
+    {
+        cerr << "Error: Could not open file " << filename << '\n';
+        return 1;
+    }
+    if (source.view().size() > UINT32_MAX)
+    {
+        cerr << "Error: Input larger than 4 GiB is not supported" << '\n';
+        return 1;
+    }
 
-            default:
-                cerr << "Error: Unhandled token type: " << token.value << endl;
-                break;
+    sockaddr_un address;
+    if (!unixSocketAddress(socketPath, address))
+        return 1;
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        cerr << "Error: Could not connect to " << socketPath << '\n';
+        return 1;
+    }
+
+    ServerRequest request;
+    request.flags = (options.dumpAst ? SERVER_DUMP_AST : 0) | (options.optimize ? SERVER_OPTIMIZE : 0) |
+                    (options.execute ? SERVER_EXECUTE : 0);
+    request.length = source.view().size();
+    ServerReply reply;
+    string out, diag;
+    bool ok = writeFully(connection, &request, sizeof(request)) &&
+              writeFully(connection, source.view().data(), source.view().size()) &&
+              readFully(connection, &reply, sizeof(reply));
+    if (ok)
+    {
+        out.resize(reply.outLength);
+        diag.resize(reply.diagLength);
+        ok = readFully(connection, &out[0], out.size()) && readFully(connection, &diag[0], diag.size());
+    }
+    close(connection);
+    if (!ok)
+    {
+        cerr << "Error: Lost connection to " << socketPath << '\n';
+        return 1;
+    }
+    cout << out;
+    cout.flush();
+    cerr << diag;
+    return reply.status;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 3 && string(argv[1]) == "--bench")
+    {
+        int iterations = argc >= 4 ? atoi(argv[3]) : 10;
+        return runBenchmark(argv[2], iterations > 0 ? iterations : 1);
+    }
+
+    if (argc >= 2 && (string(argv[1]) == "--generate" || string(argv[1]) == "--bench-suite" ||
+                      string(argv[1]) == "--bench-symbols"))
+    {
+        GeneratorOptions generator;
+        string jsonFile;
+        for (int i = 2; i < argc; i++)
+        {
+            if (string(argv[i]) == "--json" && i + 1 < argc)
+                jsonFile = argv[++i];
+            else if (!parseGeneratorOption(argc, argv, i, generator))
+            {
+                cerr << "Error: Unknown generator option " << argv[i] << '\n';
+                return 1;
             }
         }
+        if (string(argv[1]) == "--generate")
+        {
+            cout << SourceGenerator(generator).generate();
+            return 0;
+        }
+        if (string(argv[1]) == "--bench-symbols")
+            return runSymbolBenchmark(generator);
+        return runBenchmarkSuite(generator, jsonFile);
     }
 
-    void printInstructions() const
+    if (argc >= 2 && string(argv[1]) == "--bench-nesting")
     {
-        for (const string &instr : instructions)
+        vector<uint32_t> depths;
+        for (int i = 2; i < argc; i++)
         {
-            cout << instr << endl;
+            if (atoi(argv[i]) > 0)
+                depths.push_back(atoi(argv[i]));
         }
+        if (depths.empty())
+            depths = {10000, 100000, 1000000};
+        return runNestingBenchmark(depths);
     }
-};
 
-int main(int argc, char *argv[])
-{
+    if (argc == 3 && string(argv[1]) == "--dump-ir")
+    {
+        return dumpIrImage(argv[2]);
+    }
 
-    string code = "";
+    if (argc >= 3 && string(argv[1]) == "--bench-edit")
+    {
+        int edits = argc >= 4 ? atoi(argv[3]) : 100;
+        return runEditBenchmark(argv[2], edits > 0 ? edits : 1);
+    }
 
-    if (argc != 2)
+    if (argc >= 3 && string(argv[1]) == "--bench-batch")
     {
-        cerr << "Usage: mycompiler <filename.txt>\n";
-        return 1;
+        vector<string> inputs;
+        if (!expandInputs(vector<string>(argv + 2, argv + argc), inputs) || inputs.empty())
+            return 1;
+        return runBatchBenchmark(inputs);
     }
 
-    string filename = argv[1];
-    ifstream file(filename);
+    if (argc >= 3 && string(argv[1]) == "--server")
+    {
+        size_t cacheMegabytes = 64;
+        string cacheDirectory;
+        for (int i = 3; i + 1 < argc; i += 2)
+        {
+            if (string(argv[i]) == "--cache-size")
+                cacheMegabytes = atoi(argv[i + 1]);
+            else if (string(argv[i]) == "--cache-dir")
+                cacheDirectory = argv[i + 1];
+        }
+        return runServer(argv[2], cacheMegabytes << 20, cacheDirectory);
+    }
 
-    if (!file.is_open())
+    bool streaming = false;
+    bool usage = false;
+    unsigned jobs = thread::hardware_concurrency();
+    string serverSocket;
+    string traceFile;
+    UnitOptions options;
+    vector<string> arguments;
+    for (int i = 1; i < argc; i++)
     {
-        cerr << "Error: Could not open file " << filename << '\n';
+        string arg = argv[i];
+        if (arg == "--stream")
+            streaming = true;
+        else if (arg == "--ast")
+            options.compile.dumpAst = true;
+        else if (arg == "-O")
+            options.compile.optimize = true;
+        else if (arg == "--run")
+            options.compile.execute = true;
+        else if (arg == "--compare")
+            options.compare = true;
+        else if (arg == "-S" && i + 1 < argc)
+            options.asmFile = argv[++i];
+        else if (arg == "--emit-ir" && i + 1 < argc)
+            options.irFile = argv[++i];
+        else if (arg == "-j" && i + 1 < argc)
+            jobs = atoi(argv[++i]);
+        else if (arg == "--client" && i + 1 < argc)
+            serverSocket = argv[++i];
+        else if (arg == "--stats")
+            options.stats = true;
+        else if (arg == "--stats-json" && i + 1 < argc)
+            options.statsJson = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc)
+            traceFile = argv[++i];
+        else if (arg == "--max-depth" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            options.compile.maxDepth = atoi(argv[++i]);
+        else if (arg == "-" || arg[0] != '-')
+            arguments.push_back(arg);
+        else
+            usage = true;
+    }
+
+    vector<string> inputs;
+    if (!expandInputs(arguments, inputs))
+        return 1;
+    bool batch = inputs.size() != 1 || arguments[0][0] == '@' || inputs[0] != arguments[0];
+    bool singleOnly = streaming || options.compare || !options.asmFile.empty() || !options.irFile.empty() ||
+                      !serverSocket.empty();
+    bool instrumented = options.stats || !options.statsJson.empty() || !traceFile.empty();
+
+    if (usage || inputs.empty() || (batch && singleOnly) ||
+        (streaming && (options.compile.execute || options.compare || !options.asmFile.empty() || !options.irFile.empty())) ||
+        (!serverSocket.empty() && (streaming || options.compare || !options.asmFile.empty() || !options.irFile.empty() ||
+                                   options.compile.maxDepth)) ||
+        ((streaming || !serverSocket.empty()) && instrumented))
+    {
+        cerr << "Usage: mycompiler [--stream] [--ast] [-O] [--max-depth <n>] <filename.txt | ->\n"
+             << "       mycompiler [--ast] [-O] [--run] [--compare] [-S <out.s>] [--emit-ir <out.ir>] [-j <threads>]\n"
+             << "                  [--max-depth <n>] [<stats options>] <filename.txt | ->\n"
+             << "       mycompiler [--ast] [-O] [--run] [-j <threads>] [--max-depth <n>] [<stats options>]\n"
+             << "                  <file | directory | @list>...\n"
+             << "       mycompiler --bench <filename.txt> [iterations]\n"
+             << "       mycompiler --bench-edit <filename.txt> [edits]\n"
+             << "       mycompiler --dump-ir <file.ir | ->\n"
+             << "       mycompiler --generate | --bench-suite [--json <out.json>] [--seed <n>] [--declarations <n>]\n"
+             << "                  [--loops <n>] [--depth <n>] [--expression <operands>] [--comments <percent>]\n"
+             << "       mycompiler --bench-symbols [<generator options>]\n"
+             << "       mycompiler --bench-nesting [depth]...\n"
+             << "       mycompiler --bench-batch <file | directory | @list>...\n"
+             << "       mycompiler --server <socket> [--cache-size <MB>] [--cache-dir <directory>]\n"
+             << "       mycompiler --client <socket> [--ast] [-O] [--run] <filename.txt | ->\n"
+             << "stats options: --stats, --stats-json <out.json>, --trace <out.json>\n";
         return 1;
     }
 
-    string line;
-    while (getline(file, line))
+    if (streaming)
     {
-        code += line;
-        code += '\n';
+        return compileStreaming(inputs[0], options.compile.optimize, options.compile.maxDepth);
     }
-    file.close();
 
-    Lexer lexer(code);
+    if (!serverSocket.empty())
+    {
+        return runClient(serverSocket, inputs[0], options.compile);
+    }
 
-    SymbolTable symbolTable;
-    vector<Token> tokens = lexer.tokenize(symbolTable);
+    bool collectStats = options.stats || !options.statsJson.empty();
+    heapTracking = collectStats;
+    TraceLog trace;
+    if (!traceFile.empty())
+        traceLog = &trace;
 
-    Parser parser(tokens);
-    parser.parseProgram();
+    int status;
+    if (!batch)
+    {
+        options.compile.lexThreads = jobs > 0 ? jobs : 1;
+        options.compile.parseThreads = options.compile.lexThreads;
+        vector<CompileStats> stats(1);
+        status = compileUnit(inputs[0], options, cout, cerr, collectStats ? &stats[0] : nullptr);
+        if (!options.statsJson.empty() && !writeStatsJson(options.statsJson, inputs, stats))
+            status = 1;
+    }
+    else
+    {
+        ThreadPool pool(jobs > 0 ? jobs : 1);
+        status = compileBatch(inputs, options, pool);
+    }
 
-    ICGenerator icg;
-    icg.processToken(tokens);
-    icg.printInstructions();
+    if (traceLog)
+    {
+        traceLog = nullptr;
+        ofstream file(traceFile);
+        if (!file)
+        {
+            cerr << "Error: Could not write " << traceFile << '\n';
+            return 1;
+        }
+        trace.write(file);
+    }
+    return status;
+}
 
-    return 0;
-}
\ No newline at end of file
+#endif
@@ -0,0 +1,216 @@
+#!/bin/sh
+# End-to-end tests for the x86-64 backend. Each program is compiled with -S,
+# with and without -O, then assembled and linked with cc and run. Its exit
+# status must equal the expected value and the VM's result for the program.
+#
+# Usage: tests/run.sh [compiler]
+# Without a compiler, parser.cpp is built into a temporary directory first,
+# with $CXXFLAGS added (e.g. -fsanitize=address).
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+compiler=${1:-}
+if [ -z "$compiler" ]; then
+    compiler=$work/mycompiler
+    ${CXX:-g++} -std=c++17 -O2 -pthread ${CXXFLAGS:-} -o "$compiler" "$root/parser.cpp" || exit 1
+fi
+
+passed=0
+failed=0
+
+fail()
+{
+    echo "FAIL $1"
+    failed=$((failed + 1))
+}
+
+# check <name> <expected exit status>, with the program on stdin.
+check()
+{
+    name=$1
+    expected=$2
+    cat > "$work/$name.txt"
+    for flags in "" "-O"; do
+        label="$name${flags:+ $flags}"
+        if ! "$compiler" $flags -S "$work/$name.s" "$work/$name.txt" > /dev/null 2> "$work/$name.err"; then
+            fail "$label: compile error: $(head -n 1 "$work/$name.err")"
+            continue
+        fi
+        if ! cc -o "$work/$name" "$work/$name.s" -lm 2> "$work/$name.err"; then
+            fail "$label: assembly rejected: $(head -n 1 "$work/$name.err")"
+            continue
+        fi
+        "$work/$name" > /dev/null 2>&1
+        native=$?
+
+        # A program the VM stops with a runtime error exits with status 1.
+        output=$("$compiler" $flags --run "$work/$name.txt" 2>&1)
+        vm=$(echo "$output" | sed -n 's/^Program returned \(-*[0-9]*\).*/\1/p')
+        if [ -n "$vm" ]; then
+            vm=$((vm & 255))
+        elif echo "$output" | grep -q '^Runtime error:'; then
+            vm=1
+        else
+            fail "$label: no result from the VM"
+            continue
+        fi
+
+        if [ "$native" -ne "$expected" ]; then
+            fail "$label: native exit status $native, expected $expected"
+        elif [ "$vm" -ne "$native" ]; then
+            fail "$label: VM result $vm, native exit status $native"
+        else
+            passed=$((passed + 1))
+        fi
+    done
+}
+
+# reject <name> <expected error>, with the program on stdin.
+reject()
+{
+    name=$1
+    cat > "$work/$name.txt"
+    if "$compiler" "$work/$name.txt" > /dev/null 2> "$work/$name.err"; then
+        fail "$name: compiled, expected \"$2\""
+    elif ! grep -qF "$2" "$work/$name.err"; then
+        fail "$name: expected \"$2\", got: $(head -n 1 "$work/$name.err")"
+    else
+        passed=$((passed + 1))
+    fi
+}
+
+# edits <name>, with the document on stdin. Random edits through the
+# incremental document must give the same tree and errors as a full parse.
+edits()
+{
+    name=$1
+    cat > "$work/$name.txt"
+    if "$compiler" --bench-edit "$work/$name.txt" 200 > "$work/$name.out" 2>&1; then
+        passed=$((passed + 1))
+    else
+        fail "$name: $(tail -n 1 "$work/$name.out")"
+    fi
+}
+
+# `a` is 1223 after the truncating initializer, and the program returns it.
+# Read from a file rather than a pipe: a function at the end of a pipeline
+# runs in a subshell and its counts would be lost.
+head -n 83 "$root/code.txt" > "$work/code-83.txt"
+check code 199 < "$work/code-83.txt"
+
+# The last line reads names declared only inside blocks above it.
+reject code-scope "Identifier 'd' not declared" < "$root/code.txt"
+
+check loops 40 <<'PROGRAM'
+int total = 0;
+int i;
+for (i = 0; i < 10; i++)
+{
+    if (i == 3)
+    {
+        continue;
+    }
+    if (i == 8)
+    {
+        break;
+    }
+    total += i;
+}
+int n = 0;
+while (n < 5)
+{
+    n++;
+    total = total + n;
+}
+return total;
+PROGRAM
+
+check nested-loops 55 <<'PROGRAM'
+int sum = 0;
+int i;
+int j;
+for (i = 0; i < 10; i++)
+{
+    for (j = 0; j < 10; j++)
+    {
+        if (j > i)
+        {
+            break;
+        }
+        if (j != i)
+        {
+            continue;
+        }
+        sum = sum + j + 1;
+    }
+}
+return sum;
+PROGRAM
+
+check conversions 164 <<'PROGRAM'
+float f = 3.75;
+int i = f;
+char c = 'A';
+int k = c + 1;
+double d = -2.5;
+int m = d;
+char e = 66.9;
+return i * 10 + k - m + e;
+PROGRAM
+
+check float-compare 3 <<'PROGRAM'
+double x = 0.1;
+float y = 0.25;
+int result = 0;
+if (x * 3.0 > 0.3)
+{
+    result = result + 1;
+}
+if (y + y == 0.5)
+{
+    result = result + 2;
+}
+return result;
+PROGRAM
+
+check division-by-zero 1 <<'PROGRAM'
+int a = 7;
+int b = 0;
+int c = a / b;
+return c + 3;
+PROGRAM
+
+check remainder-by-zero 1 <<'PROGRAM'
+int a = 7;
+int b = 0;
+return a % b;
+PROGRAM
+
+check int-min-by-minus-one 10 <<'PROGRAM'
+int a = -2147483647 - 1;
+int b = -1;
+int q = a / b;
+int r = a % b;
+if (q == a)
+{
+    return 10 + r;
+}
+return 20;
+PROGRAM
+
+check negative-exit 251 <<'PROGRAM'
+int a = 2;
+return a - 7;
+PROGRAM
+
+edits code-edits < "$root/code.txt"
+
+# The block is still open at the end, so its scope is left at T_EOF.
+edits unclosed-block <<'PROGRAM'
+for(;;k++){
+PROGRAM
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]